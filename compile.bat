@@ -1,8 +1,15 @@
 SETLOCAL
 cd ./src
-gcc -O3 -c window.c logger.c ./nes/cpu.c ./nes/loader.c ./nes/ppu.c ./nes/controller.c
+gcc -O3 -c window.c logger.c video.c swapchain.c scaler.c ntsc.c overlay.c frameprofile.c eventtrace.c videocapture.c ./nes/cpu.c ./nes/loader.c ./nes/ppu.c ./nes/ppu_pipeline.c ./nes/ppu_capture.c ./nes/cpu_trace.c ./nes/cpu_profile.c ./nes/controller.c ./nes/input_recording.c ./tools/ppurender.c ./tools/nesrun.c ./tools/cputrace.c ./tools/nestest.c ./tools/cpufuzz.c ./tools/nesbench.c ./tools/framebench.c
 windres -i menu.rc -o menu.o
-gcc -o emunes.exe window.o logger.o cpu.o loader.o ppu.o controller.o menu.o -s -lcomctl32 -Wl,--subsystem,windows -lgdi32 -lWinmm -lComdlg32
+gcc -o emunes.exe window.o logger.o video.o swapchain.o scaler.o ntsc.o overlay.o frameprofile.o videocapture.o cpu.o loader.o ppu.o eventtrace.o ppu_pipeline.o ppu_capture.o cpu_trace.o cpu_profile.o controller.o input_recording.o menu.o -s -lcomctl32 -Wl,--subsystem,windows -lgdi32 -lWinmm -lComdlg32
+gcc -o ppurender.exe ppurender.o logger.o video.o swapchain.o videocapture.o cpu.o loader.o ppu.o eventtrace.o ppu_pipeline.o ppu_capture.o cpu_trace.o cpu_profile.o controller.o input_recording.o -s
+gcc -o nesrun.exe nesrun.o logger.o video.o swapchain.o videocapture.o cpu.o loader.o ppu.o eventtrace.o ppu_pipeline.o ppu_capture.o cpu_trace.o cpu_profile.o controller.o input_recording.o -s
+gcc -o cputrace.exe cputrace.o logger.o video.o swapchain.o videocapture.o cpu.o loader.o ppu.o eventtrace.o ppu_pipeline.o ppu_capture.o cpu_trace.o cpu_profile.o controller.o input_recording.o -s
+gcc -o nestest.exe nestest.o logger.o video.o swapchain.o videocapture.o cpu.o loader.o ppu.o eventtrace.o ppu_pipeline.o ppu_capture.o cpu_trace.o cpu_profile.o controller.o input_recording.o -s
+gcc -o cpufuzz.exe cpufuzz.o logger.o video.o swapchain.o videocapture.o cpu.o loader.o ppu.o eventtrace.o ppu_pipeline.o ppu_capture.o cpu_trace.o cpu_profile.o controller.o input_recording.o -s
+gcc -o nesbench.exe nesbench.o logger.o video.o swapchain.o scaler.o videocapture.o cpu.o loader.o ppu.o eventtrace.o ppu_pipeline.o ppu_capture.o cpu_trace.o cpu_profile.o controller.o input_recording.o -s
+gcc -o framebench.exe framebench.o logger.o video.o swapchain.o videocapture.o cpu.o loader.o ppu.o eventtrace.o ppu_pipeline.o ppu_capture.o cpu_trace.o cpu_profile.o controller.o input_recording.o -s -lpsapi
 DEL *.o
 echo Starting...
 START emunes.exe
\ No newline at end of file
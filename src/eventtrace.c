@@ -0,0 +1,174 @@
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "logger.h"
+#include "eventtrace.h"
+
+/*
+    Timeline of the frames and the emulated events, written as Chrome trace events (JSON), to be opened in Perfetto or chrome://tracing
+
+    Each thread adds its events to its own buffer, which costs it a read of the performance counter and a few stores.
+    The writer thread takes the events from the buffers every EVENT_TRACE_FLUSH_MS, and formats and writes them.
+    When it falls so far behind that a buffer is full, the events are dropped and counted instead.
+    The buffers are kept after the trace is stopped, as the other threads may still be adding the events they started.
+*/
+
+EVENT_TRACE eventTrace;
+
+static const struct
+{
+    const char *Name;
+    const char *Category;
+    const char *Argument; // Name of the argument of the event, or NULL if it has none
+} traceNames[TRACE_NAME_COUNT] =
+{
+    [TRACE_FRAME] = {"frame", "frame", "frame"},
+    [TRACE_INPUT] = {"input", "frame", NULL},
+    [TRACE_CPU] = {"cpu", "emulation", "cycles"},
+    [TRACE_PPU_BATCH] = {"ppu", "emulation", "scanline"},
+    [TRACE_PRESENT] = {"present", "video", NULL},
+    [TRACE_SLEEP] = {"sleep", "frame", NULL},
+    [TRACE_ROM_LOAD] = {"rom load", "emulation", "status"},
+    [TRACE_NMI] = {"NMI", "cpu", "pc"},
+    [TRACE_OAM_DMA] = {"OAM DMA", "cpu", "page"},
+    [TRACE_VBLANK] = {"VBLANK", "ppu", "frame"},
+    [TRACE_CONTROLLER_STROBE] = {"controller strobe", "input", "buttons"},
+};
+
+static const char *streamNames[TRACE_STREAM_COUNT] = {"emulation", "present", "render"};
+
+static double TicksToMicroseconds(int64_t ticks)
+{
+    return (double)ticks * 1000000.0 / eventTrace.Frequency;
+}
+
+static void WriteTraceEvent(TRACE_STREAM stream, const TRACE_EVENT *event)
+{
+    const char *separator = eventTrace.Written++ ? ",\n" : "";
+    double timestamp = TicksToMicroseconds(event->Start - eventTrace.StartTime);
+
+    if (event->Name >= TRACE_FIRST_INSTANT)
+    {
+        fprintf(eventTrace.File, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%d",
+                separator, traceNames[event->Name].Name, traceNames[event->Name].Category, timestamp, stream + 1);
+    }
+    else
+    {
+        fprintf(eventTrace.File, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d",
+                separator, traceNames[event->Name].Name, traceNames[event->Name].Category, timestamp, TicksToMicroseconds(event->Duration), stream + 1);
+    }
+
+    if (traceNames[event->Name].Argument != NULL)
+    {
+        fprintf(eventTrace.File, ",\"args\":{\"%s\":%u}", traceNames[event->Name].Argument, event->Argument);
+    }
+    fprintf(eventTrace.File, "}");
+}
+
+static void FlushTraceBuffers(void)
+{
+    for (TRACE_STREAM stream = 0; stream < TRACE_STREAM_COUNT; stream++)
+    {
+        TRACE_BUFFER *buffer = &eventTrace.Buffers[stream];
+        LONG64 head = buffer->Head;
+        LONG64 tail = buffer->Tail;
+
+        while (tail < head)
+        {
+            WriteTraceEvent(stream, &buffer->Events[tail % EVENT_TRACE_BUFFER_EVENTS]);
+            tail++;
+        }
+
+        InterlockedExchange64(&buffer->Tail, tail);
+    }
+}
+
+DWORD WINAPI EventTraceWriterProc(LPVOID param)
+{
+    // Events added before the stop are still written
+    while (WaitForSingleObject(eventTrace.StopEvent, EVENT_TRACE_FLUSH_MS) == WAIT_TIMEOUT)
+    {
+        FlushTraceBuffers();
+    }
+    FlushTraceBuffers();
+
+    return 0;
+}
+
+BOOL StartEventTrace(LPCSTR filename)
+{
+    if (eventTrace.Enabled)
+    {
+        return TRUE;
+    }
+
+    if (eventTrace.Buffers == NULL)
+    {
+        eventTrace.Buffers = VirtualAlloc(NULL, TRACE_STREAM_COUNT * sizeof(TRACE_BUFFER), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if (eventTrace.Buffers == NULL)
+        {
+            Log("Unable to allocate the event trace buffers", LL_ERROR);
+            return FALSE;
+        }
+    }
+
+    eventTrace.File = fopen(filename, "w");
+    if (eventTrace.File == NULL)
+    {
+        Logf("Unable to create the event trace %s", LL_ERROR, filename);
+        return FALSE;
+    }
+    setvbuf(eventTrace.File, NULL, _IOFBF, EVENT_TRACE_FILE_BUFFER_SIZE);
+
+    fprintf(eventTrace.File, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    eventTrace.Written = 0;
+
+    for (TRACE_STREAM stream = 0; stream < TRACE_STREAM_COUNT; stream++)
+    {
+        fprintf(eventTrace.File, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                eventTrace.Written++ ? ",\n" : "", stream + 1, streamNames[stream]);
+
+        eventTrace.Buffers[stream].Head = 0;
+        eventTrace.Buffers[stream].Tail = 0;
+        eventTrace.Buffers[stream].Dropped = 0;
+    }
+
+    QueryPerformanceFrequency((LARGE_INTEGER *)&eventTrace.Frequency);
+    QueryPerformanceCounter((LARGE_INTEGER *)&eventTrace.StartTime);
+
+    eventTrace.StopEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    eventTrace.Thread = CreateThread(NULL, 0, EventTraceWriterProc, NULL, 0, NULL);
+    eventTrace.Enabled = TRUE;
+
+    Logf("Event trace started: %s", LL_INFO, filename);
+    return TRUE;
+}
+
+void StopEventTrace(void)
+{
+    if (!eventTrace.Enabled)
+    {
+        return;
+    }
+
+    eventTrace.Enabled = FALSE;
+    SetEvent(eventTrace.StopEvent);
+    WaitForSingleObject(eventTrace.Thread, INFINITE);
+    CloseHandle(eventTrace.Thread);
+    CloseHandle(eventTrace.StopEvent);
+
+    fprintf(eventTrace.File, "\n]}\n");
+    fclose(eventTrace.File);
+
+    uint32_t dropped = 0;
+    for (TRACE_STREAM stream = 0; stream < TRACE_STREAM_COUNT; stream++)
+    {
+        dropped += eventTrace.Buffers[stream].Dropped;
+    }
+
+    Logf("Event trace stopped: %llu events written, %u dropped", LL_INFO, eventTrace.Written - TRACE_STREAM_COUNT, dropped);
+    if (dropped)
+    {
+        Log("The event trace writer could not keep up, events were dropped", LL_WARNING);
+    }
+}
@@ -0,0 +1,133 @@
+#ifndef EVENTTRACE_H
+
+#define EVENTTRACE_H
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#define EVENT_TRACE_FILE "trace.json"
+// Events waiting to be written for each thread (a power of two), events are dropped rather than waiting when it is full
+#define EVENT_TRACE_BUFFER_EVENTS 0x10000
+// The writer wakes this often to write the buffered events
+#define EVENT_TRACE_FLUSH_MS 100
+#define EVENT_TRACE_FILE_BUFFER_SIZE 0x100000
+
+// Each thread writing events has its own buffer, and is its own track in the timeline
+typedef enum TRACE_STREAM
+{
+    TRACE_STREAM_EMULATION, // The frame loop, the cpu and the ppu when it is not pipelined
+    TRACE_STREAM_PRESENT,
+    TRACE_STREAM_RENDER, // The ppu when it is pipelined
+    TRACE_STREAM_COUNT,
+} TRACE_STREAM;
+
+typedef enum TRACE_NAME
+{
+    // Spans
+    TRACE_FRAME,
+    TRACE_INPUT,
+    TRACE_CPU,       // The instructions of a frame, with the ppu when it is not pipelined
+    TRACE_PPU_BATCH, // The scanlines the render thread ran at once
+    TRACE_PRESENT,
+    TRACE_SLEEP,
+    TRACE_ROM_LOAD,
+    // Instant events
+    TRACE_NMI,
+    TRACE_OAM_DMA,
+    TRACE_VBLANK,
+    TRACE_CONTROLLER_STROBE,
+    TRACE_NAME_COUNT,
+} TRACE_NAME;
+
+#define TRACE_FIRST_INSTANT TRACE_NMI
+
+// A span is written as a whole when it ends, so a dropped event never leaves one without its end
+typedef struct TRACE_EVENT
+{
+    int64_t Start;    // Performance counter ticks
+    int64_t Duration; // Zero for instant events
+    uint32_t Argument;
+    uint16_t Name;
+} TRACE_EVENT;
+
+// Single producer (the thread of the stream) single consumer (the writer thread) ring buffer
+typedef struct TRACE_BUFFER
+{
+    TRACE_EVENT Events[EVENT_TRACE_BUFFER_EVENTS];
+    volatile LONG64 Head; // Number of events added
+    volatile LONG64 Tail; // Number of events written
+    uint32_t Dropped;
+} TRACE_BUFFER;
+
+typedef struct EVENT_TRACE
+{
+    BOOL Enabled;
+    FILE *File;
+    HANDLE Thread;
+    HANDLE StopEvent;
+    int64_t Frequency;
+    int64_t StartTime;
+    uint64_t Written;
+    TRACE_BUFFER *Buffers; // TRACE_STREAM_COUNT buffers
+} EVENT_TRACE;
+
+extern EVENT_TRACE eventTrace;
+
+BOOL StartEventTrace(LPCSTR filename);
+void StopEventTrace(void);
+
+static inline void AddTraceEvent(TRACE_STREAM stream, TRACE_NAME name, int64_t start, int64_t end, uint32_t argument)
+{
+    TRACE_BUFFER *buffer = &eventTrace.Buffers[stream];
+    LONG64 head = buffer->Head;
+
+    if (head - buffer->Tail >= EVENT_TRACE_BUFFER_EVENTS)
+    {
+        buffer->Dropped++;
+        return;
+    }
+
+    TRACE_EVENT *event = &buffer->Events[head % EVENT_TRACE_BUFFER_EVENTS];
+    event->Start = start;
+    event->Duration = end - start;
+    event->Argument = argument;
+    event->Name = name;
+
+    // The event is complete before the writer can see it
+    InterlockedExchange64(&buffer->Head, head + 1);
+}
+
+// Spans are timed like the frame sections, by the start which is zero while not tracing, and the end
+static inline int64_t StartTraceSpan(void)
+{
+    int64_t start = 0;
+    if (eventTrace.Enabled)
+    {
+        QueryPerformanceCounter((LARGE_INTEGER *)&start);
+    }
+    return start;
+}
+
+// A span started before the trace is left out
+static inline void EndTraceSpan(TRACE_STREAM stream, TRACE_NAME name, int64_t start, uint32_t argument)
+{
+    if (eventTrace.Enabled && start != 0)
+    {
+        int64_t end;
+        QueryPerformanceCounter((LARGE_INTEGER *)&end);
+        AddTraceEvent(stream, name, start, end, argument);
+    }
+}
+
+static inline void TraceInstant(TRACE_STREAM stream, TRACE_NAME name, uint32_t argument)
+{
+    if (eventTrace.Enabled)
+    {
+        int64_t now;
+        QueryPerformanceCounter((LARGE_INTEGER *)&now);
+        AddTraceEvent(stream, name, now, now, argument);
+    }
+}
+
+#endif
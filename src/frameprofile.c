@@ -0,0 +1,239 @@
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <x86intrin.h>
+#include "main.h"
+#include "logger.h"
+#include "frameprofile.h"
+
+/*
+    Where the time of each frame goes, measured with the time stamp counter
+
+    Each section is timed by reading the counter at its start and end, which is cheap enough to do every frame.
+    The cpu and the ppu alternate every instruction, far too often to read the counter around each of them, so the
+    emulation is timed as a whole and split between them by the instructions sampled every SPLIT_SAMPLE_INTERVAL.
+    When a frame ends its sections are converted to microseconds, kept in a history for the overlay, and counted
+    in a histogram per section. Both can be dumped as CSV.
+*/
+
+typedef LONG(NTAPI *NT_QUERY_TIMER_RESOLUTION)(PULONG MinimumResolution, PULONG MaximumResolution, PULONG CurrentResolution);
+
+FRAME_PROFILER frameProfiler;
+
+const char *frameSectionNames[FRAME_SECTION_COUNT] =
+{
+    [FRAME_SECTION_CPU] = "cpu",
+    [FRAME_SECTION_PPU] = "ppu",
+    [FRAME_SECTION_INPUT] = "input",
+    [FRAME_SECTION_PRESENT] = "present",
+    [FRAME_SECTION_SLEEP] = "sleep",
+};
+
+static NT_QUERY_TIMER_RESOLUTION ntQueryTimerResolution;
+
+static uint64_t FileTimeToUint64(FILETIME fileTime)
+{
+    return ((uint64_t)fileTime.dwHighDateTime << 32) | fileTime.dwLowDateTime;
+}
+
+void InitFrameProfiler(void)
+{
+    // The counter runs at a constant rate, which is found by counting its ticks over a known time
+    int64_t qpcStart, qpcEnd;
+    QueryPerformanceCounter((LARGE_INTEGER *)&qpcStart);
+    uint64_t tscStart = __rdtsc();
+
+    do
+    {
+        QueryPerformanceCounter((LARGE_INTEGER *)&qpcEnd);
+    } while ((qpcEnd - qpcStart) * 1000 < FRAME_PROFILE_CALIBRATION_MS * perfData.PerfFrequency);
+
+    uint64_t tscEnd = __rdtsc();
+    frameProfiler.TicksPerMicrosecond = (double)(tscEnd - tscStart) * perfData.PerfFrequency / ((qpcEnd - qpcStart) * 1000000.0);
+    Logf("Time stamp counter: %.1f MHz", LL_INFO, frameProfiler.TicksPerMicrosecond);
+
+    GetSystemInfo(&perfData.SystemInfo);
+
+    // The timer resolution is only available from ntdll
+    ntQueryTimerResolution = (NT_QUERY_TIMER_RESOLUTION)GetProcAddress(GetModuleHandleA("ntdll.dll"), "NtQueryTimerResolution");
+    UpdateProcessCounters();
+}
+
+void EndProfiledFrame(void)
+{
+    frameProfiler.Ticks[FRAME_SECTION_PRESENT] = InterlockedExchange64(&frameProfiler.PresentTicks, 0);
+
+    // The time of the emulation is in the cpu section until it is split
+    uint64_t samples = frameProfiler.CpuSampleTicks + frameProfiler.PpuSampleTicks;
+    if (samples > 0)
+    {
+        uint64_t emulation = frameProfiler.Ticks[FRAME_SECTION_CPU];
+        frameProfiler.Ticks[FRAME_SECTION_CPU] = emulation * frameProfiler.CpuSampleTicks / samples;
+        frameProfiler.Ticks[FRAME_SECTION_PPU] = emulation - frameProfiler.Ticks[FRAME_SECTION_CPU];
+    }
+
+    FRAME_TIMES *times = &frameProfiler.History[frameProfiler.Frames % FRAME_PROFILE_HISTORY];
+    for (FRAME_SECTION section = 0; section < FRAME_SECTION_COUNT; section++)
+    {
+        float microseconds = frameProfiler.Ticks[section] / frameProfiler.TicksPerMicrosecond;
+        times->Sections[section] = microseconds;
+
+        uint32_t bucket = microseconds / FRAME_HISTOGRAM_BUCKET_MICROSECONDS;
+        frameProfiler.Histograms[section][bucket < FRAME_HISTOGRAM_BUCKETS ? bucket : FRAME_HISTOGRAM_BUCKETS - 1]++;
+
+        frameProfiler.Ticks[section] = 0;
+    }
+
+    frameProfiler.CpuSampleTicks = 0;
+    frameProfiler.PpuSampleTicks = 0;
+    frameProfiler.Frames++;
+}
+
+// The counters of the process in the performance data, which the overlay shows
+void UpdateProcessCounters(void)
+{
+    FILETIME systemTime, creationTime, exitTime, kernelTime, userTime;
+    GetSystemTimeAsFileTime(&systemTime);
+    GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime);
+
+    // The time of the process is the sum over all its threads, so it is compared with the time of all processors
+    uint64_t processTime = FileTimeToUint64(kernelTime) + FileTimeToUint64(userTime);
+    perfData.PreviousSystemTime = perfData.CurrentSystemTime;
+    perfData.CurrentSystemTime = FileTimeToUint64(systemTime);
+
+    if (perfData.PreviousSystemTime != 0 && perfData.CurrentSystemTime > perfData.PreviousSystemTime)
+    {
+        perfData.CPUPercent = (double)(processTime - frameProfiler.PreviousProcessTime) * 100.0 /
+                              ((perfData.CurrentSystemTime - perfData.PreviousSystemTime) * perfData.SystemInfo.dwNumberOfProcessors);
+    }
+    frameProfiler.PreviousProcessTime = processTime;
+
+    GetProcessHandleCount(GetCurrentProcess(), &perfData.HandleCount);
+
+    // In units of 100 ns, where the minimum is the coarsest
+    if (ntQueryTimerResolution != NULL)
+    {
+        ntQueryTimerResolution(&perfData.MinimumTimerResolution, &perfData.MaximumTimerResolution, &perfData.CurrentTimerResolution);
+    }
+}
+
+static int CompareFloats(const void *a, const void *b)
+{
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Number of the latest frames in the history, up to the given number
+static uint16_t HistoryFrames(uint16_t frames)
+{
+    if (frames > FRAME_PROFILE_HISTORY)
+    {
+        frames = FRAME_PROFILE_HISTORY;
+    }
+    return frameProfiler.Frames < frames ? frameProfiler.Frames : frames;
+}
+
+// The microseconds of the section in the latest frames, read while the emulation may be writing the next one
+float FrameSectionPercentile(FRAME_SECTION section, uint16_t frames, uint8_t percentile)
+{
+    static float values[FRAME_PROFILE_HISTORY];
+    uint64_t last = frameProfiler.Frames;
+    frames = HistoryFrames(frames);
+
+    if (frames == 0)
+    {
+        return 0;
+    }
+
+    for (uint16_t i = 0; i < frames; i++)
+    {
+        values[i] = frameProfiler.History[(last - 1 - i) % FRAME_PROFILE_HISTORY].Sections[section];
+    }
+    qsort(values, frames, sizeof(float), CompareFloats);
+
+    // Nearest rank
+    return values[(frames * percentile + 99) / 100 - 1];
+}
+
+float FrameSectionAverage(FRAME_SECTION section, uint16_t frames)
+{
+    uint64_t last = frameProfiler.Frames;
+    frames = HistoryFrames(frames);
+
+    if (frames == 0)
+    {
+        return 0;
+    }
+
+    float sum = 0;
+    for (uint16_t i = 0; i < frames; i++)
+    {
+        sum += frameProfiler.History[(last - 1 - i) % FRAME_PROFILE_HISTORY].Sections[section];
+    }
+    return sum / frames;
+}
+
+// Writes the sections of the frames in the history, and the histograms of every frame so far
+BOOL DumpFrameProfile(LPCSTR framesFile, LPCSTR histogramFile)
+{
+    FILE *frames = fopen(framesFile, "w");
+    if (frames == NULL)
+    {
+        Logf("Unable to create %s", LL_ERROR, framesFile);
+        return FALSE;
+    }
+
+    uint64_t last = frameProfiler.Frames;
+    uint64_t first = last > FRAME_PROFILE_HISTORY ? last - FRAME_PROFILE_HISTORY : 0;
+
+    fprintf(frames, "frame");
+    for (FRAME_SECTION section = 0; section < FRAME_SECTION_COUNT; section++)
+    {
+        fprintf(frames, ",%s_us", frameSectionNames[section]);
+    }
+    fprintf(frames, "\n");
+
+    for (uint64_t frame = first; frame < last; frame++)
+    {
+        FRAME_TIMES *times = &frameProfiler.History[frame % FRAME_PROFILE_HISTORY];
+        fprintf(frames, "%llu", frame);
+        for (FRAME_SECTION section = 0; section < FRAME_SECTION_COUNT; section++)
+        {
+            fprintf(frames, ",%.1f", times->Sections[section]);
+        }
+        fprintf(frames, "\n");
+    }
+    fclose(frames);
+
+    FILE *histogram = fopen(histogramFile, "w");
+    if (histogram == NULL)
+    {
+        Logf("Unable to create %s", LL_ERROR, histogramFile);
+        return FALSE;
+    }
+
+    // Each row is the number of frames where the section took from the bucket time up to the next
+    fprintf(histogram, "from_us");
+    for (FRAME_SECTION section = 0; section < FRAME_SECTION_COUNT; section++)
+    {
+        fprintf(histogram, ",%s", frameSectionNames[section]);
+    }
+    fprintf(histogram, "\n");
+
+    for (uint32_t bucket = 0; bucket < FRAME_HISTOGRAM_BUCKETS; bucket++)
+    {
+        fprintf(histogram, "%u", bucket * FRAME_HISTOGRAM_BUCKET_MICROSECONDS);
+        for (FRAME_SECTION section = 0; section < FRAME_SECTION_COUNT; section++)
+        {
+            fprintf(histogram, ",%u", frameProfiler.Histograms[section][bucket]);
+        }
+        fprintf(histogram, "\n");
+    }
+    fclose(histogram);
+
+    Logf("Frame profile of %llu frames written to %s and %s", LL_INFO, last - first, framesFile, histogramFile);
+    return TRUE;
+}
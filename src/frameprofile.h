@@ -0,0 +1,77 @@
+#ifndef FRAMEPROFILE_H
+
+#define FRAMEPROFILE_H
+
+#include <windows.h>
+#include <stdint.h>
+#include <x86intrin.h>
+#include "main.h"
+
+#define FRAME_PROFILE_FILE "frame_profile.csv"
+#define FRAME_HISTOGRAM_FILE "frame_histogram.csv"
+// Frames kept for the overlay and the dump, a power of two
+#define FRAME_PROFILE_HISTORY 1024
+// The histograms have buckets of this many microseconds, the last bucket has everything longer
+#define FRAME_HISTOGRAM_BUCKET_MICROSECONDS 250
+#define FRAME_HISTOGRAM_BUCKETS 81
+// Time the time stamp counter is measured against the performance counter for
+#define FRAME_PROFILE_CALIBRATION_MS 20
+
+typedef enum FRAME_SECTION
+{
+    FRAME_SECTION_CPU,     // Instructions, split from the ppu by the sampled instructions
+    FRAME_SECTION_PPU,     // The ppu cycles, or adding to the log of the render thread when the ppu is pipelined
+    FRAME_SECTION_INPUT,   // The window messages and the controller
+    FRAME_SECTION_PRESENT, // Scaling and drawing the frames presented while the frame ran, on the present thread
+    FRAME_SECTION_SLEEP,   // Waiting for the time of the frame to pass
+    FRAME_SECTION_COUNT,
+} FRAME_SECTION;
+
+// Microseconds spent in each section of a frame
+typedef struct FRAME_TIMES
+{
+    float Sections[FRAME_SECTION_COUNT];
+} FRAME_TIMES;
+
+typedef struct FRAME_PROFILER
+{
+    double TicksPerMicrosecond;
+
+    // The frame being measured, in time stamp counter ticks
+    uint64_t Ticks[FRAME_SECTION_COUNT];
+    // The sampled ticks of the cpu and the ppu, which the emulation time of the frame is split by
+    uint64_t CpuSampleTicks;
+    uint64_t PpuSampleTicks;
+    // Added by the present thread, taken when the frame ends
+    volatile LONG64 PresentTicks;
+
+    FRAME_TIMES History[FRAME_PROFILE_HISTORY];
+    uint64_t Frames; // Number of frames ended, the latest is in History[(Frames - 1) % FRAME_PROFILE_HISTORY]
+    uint32_t Histograms[FRAME_SECTION_COUNT][FRAME_HISTOGRAM_BUCKETS];
+
+    // For the cpu usage of the process
+    uint64_t PreviousProcessTime;
+} FRAME_PROFILER;
+
+extern FRAME_PROFILER frameProfiler;
+extern const char *frameSectionNames[FRAME_SECTION_COUNT];
+
+void InitFrameProfiler(void);
+void EndProfiledFrame(void);
+void UpdateProcessCounters(void);
+float FrameSectionPercentile(FRAME_SECTION section, uint16_t frames, uint8_t percentile);
+float FrameSectionAverage(FRAME_SECTION section, uint16_t frames);
+BOOL DumpFrameProfile(LPCSTR framesFile, LPCSTR histogramFile);
+
+// Scoped timing is a read of the time stamp counter at the start, and adding the ticks since it at the end
+static inline uint64_t StartFrameSection(void)
+{
+    return __rdtsc();
+}
+
+static inline void EndFrameSection(FRAME_SECTION section, uint64_t start)
+{
+    frameProfiler.Ticks[section] += __rdtsc() - start;
+}
+
+#endif
@@ -1,12 +1,234 @@
 #include <windows.h>
 #include <fileapi.h>
 #include <handleapi.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include "logger.h"
 
+/*
+    Asynchronous logger
+
+    Each thread writing to the log gets a ring of its own, so writing a message is formatting it into the next free entry
+    without any locks or system calls. A flusher thread takes the messages of all rings in the order of their time stamps,
+    formats the time and level and writes them to the file a batch at a time.
+    When a ring is full the message is dropped and counted, as the emulation is never held up by the log.
+
+    Messages below errors from the same call site (the same format string) are limited to LOG_RATE_LIMIT a second,
+    the rest are counted and written as one message when the window has passed. A message written again right after
+    itself is only counted.
+    The ring of a thread is marked dead when the thread exits (a fiber local storage callback), and freed by the flusher
+    once it has written what is left in it. Only the flusher removes rings from the list, the threads only add them.
+*/
+
 HANDLE fileHandle;
 
+static LOG_RING *volatile logRings;
+static HANDLE flusherThread;
+static HANDLE flushEvent;
+static volatile BOOL logRunning;
+static volatile BOOL flusherStop;
+
+static __thread LOG_RING *threadRing;
+static DWORD ringFlsIndex = FLS_OUT_OF_INDEXES;
+
+// Consecutive identical messages, only counted after the first
+static char lastMessage[LOG_MESSAGE_SIZE];
+static LOG_LEVEL lastLevel;
+static uint32_t lastRepeats;
+
+static char flushBuffer[LOG_FLUSH_BUFFER_SIZE];
+static uint32_t flushLength;
+
+static const char *levelNames[] = {"[DEBUG]\t", "[INFO]\t", "[WARNING]\t", "[ERROR]\t"};
+
+static int64_t LogTime(void)
+{
+    int64_t time;
+    GetSystemTimeAsFileTime((FILETIME *)&time);
+    return time;
+}
+
+static void FlushBuffer(void)
+{
+    DWORD bytesWritten;
+    WriteFile(fileHandle, flushBuffer, flushLength, &bytesWritten, NULL);
+    flushLength = 0;
+}
+
+static void AppendLine(int64_t time, LOG_LEVEL ll, const char *text)
+{
+    if (flushLength + LOG_MESSAGE_SIZE + 64 > LOG_FLUSH_BUFFER_SIZE)
+    {
+        FlushBuffer();
+    }
+
+    FILETIME localFileTime;
+    SYSTEMTIME localTime;
+    FileTimeToLocalFileTime((FILETIME *)&time, &localFileTime);
+    FileTimeToSystemTime(&localFileTime, &localTime);
+
+    flushLength += sprintf(flushBuffer + flushLength, "[%02d:%02d:%02d.%03d %02d:%02d:%d] %s%s\n",
+                           localTime.wHour, localTime.wMinute, localTime.wSecond, localTime.wMilliseconds,
+                           localTime.wDay, localTime.wMonth, localTime.wYear, levelNames[ll], text);
+}
+
+static void WriteRepeats(int64_t time)
+{
+    if (lastRepeats > 0)
+    {
+        char text[64];
+        sprintf(text, "Last message repeated %d times", lastRepeats);
+        AppendLine(time, lastLevel, text);
+        lastRepeats = 0;
+    }
+}
+
+static void FormatSuppressed(char *text, LONG suppressed, const char *site)
+{
+    sprintf(text, "%ld more messages like \"%.64s\" suppressed", suppressed, site);
+}
+
+// Counts of the call sites whose window has passed (or all of them) are written and taken from the ring
+static void WriteSuppressed(LOG_RING *ring, BOOL all)
+{
+    int64_t time = LogTime();
+
+    for (uint32_t i = 0; i < LOG_RATE_SLOTS; i++)
+    {
+        LOG_RATE *rate = &ring->Rates[i];
+        const char *site = rate->Site;
+
+        if (rate->Suppressed > 0 && (all || time - rate->WindowStart >= LOG_RATE_WINDOW))
+        {
+            LONG suppressed = InterlockedExchange(&rate->Suppressed, 0);
+            if (suppressed > 0)
+            {
+                char text[LOG_MESSAGE_SIZE];
+                FormatSuppressed(text, suppressed, site);
+                WriteRepeats(time);
+                AppendLine(time, LL_WARNING, text);
+            }
+        }
+    }
+}
+
+// Frees the rings of the threads which have exited, once everything in them is written
+static void ReleaseDeadRings(void)
+{
+    LOG_RING *previous = NULL;
+    LOG_RING *ring = logRings;
+
+    while (ring != NULL)
+    {
+        LOG_RING *next = ring->Next;
+
+        if (ring->Dead && ring->Tail == ring->Head)
+        {
+            // A thread may be adding a ring in front of the first one, then it is freed with the next flush
+            BOOL unlinked = previous != NULL || InterlockedCompareExchangePointer((PVOID volatile *)&logRings, next, ring) == ring;
+            if (unlinked)
+            {
+                if (previous != NULL)
+                {
+                    previous->Next = next;
+                }
+                WriteSuppressed(ring, TRUE);
+                VirtualFree(ring, 0, MEM_RELEASE);
+                ring = next;
+                continue;
+            }
+        }
+
+        previous = ring;
+        ring = next;
+    }
+}
+
+static void WriteEntry(const LOG_ENTRY *entry)
+{
+    if (entry->Level == lastLevel && strcmp(entry->Text, lastMessage) == 0)
+    {
+        lastRepeats++;
+        return;
+    }
+
+    WriteRepeats(entry->Time);
+    AppendLine(entry->Time, entry->Level, entry->Text);
+    strcpy(lastMessage, entry->Text);
+    lastLevel = entry->Level;
+}
+
+// Writes the messages waiting in all rings, merged by their time stamps
+static void FlushRings(void)
+{
+    for (;;)
+    {
+        LOG_RING *oldest = NULL;
+
+        for (LOG_RING *ring = logRings; ring != NULL; ring = ring->Next)
+        {
+            if (ring->Tail != ring->Head && (oldest == NULL || ring->Entries[ring->Tail % LOG_RING_SIZE].Time < oldest->Entries[oldest->Tail % LOG_RING_SIZE].Time))
+            {
+                oldest = ring;
+            }
+        }
+
+        if (oldest == NULL)
+        {
+            break;
+        }
+
+        WriteEntry(&oldest->Entries[oldest->Tail % LOG_RING_SIZE]);
+        InterlockedIncrement(&oldest->Tail);
+    }
+
+    for (LOG_RING *ring = logRings; ring != NULL; ring = ring->Next)
+    {
+        LONG dropped = InterlockedExchange(&ring->Dropped, 0);
+        if (dropped > 0)
+        {
+            char text[64];
+            sprintf(text, "%d messages dropped, the log could not keep up", dropped);
+            WriteRepeats(LogTime());
+            AppendLine(LogTime(), LL_WARNING, text);
+        }
+
+        WriteSuppressed(ring, FALSE);
+    }
+
+    ReleaseDeadRings();
+    WriteRepeats(LogTime());
+    FlushBuffer();
+}
+
+DWORD WINAPI FlusherProc(LPVOID param)
+{
+    while (!flusherStop)
+    {
+        WaitForSingleObject(flushEvent, LOG_FLUSH_MS);
+        FlushRings();
+    }
+
+    FlushRings();
+
+    // The threads have stopped logging, so the messages they had suppressed are counted here
+    for (LOG_RING *ring = logRings; ring != NULL; ring = ring->Next)
+    {
+        WriteSuppressed(ring, TRUE);
+    }
+
+    WriteRepeats(LogTime());
+    FlushBuffer();
+    return 0;
+}
+
+// Called when a thread which has logged exits
+static VOID WINAPI ReleaseThreadRing(PVOID ring)
+{
+    ((LOG_RING *)ring)->Dead = TRUE;
+}
+
 void CreateLogFile()
 {
     fileHandle = CreateFileA(
@@ -21,58 +243,161 @@ void CreateLogFile()
     if (fileHandle == INVALID_HANDLE_VALUE)
     {
         MessageBox(NULL, "Unable to create log file", "Warning", MB_ICONWARNING | MB_OK);
+        return;
     }
+
+    lastLevel = -1;
+    ringFlsIndex = FlsAlloc(ReleaseThreadRing);
+    flusherStop = FALSE;
+    flushEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    flusherThread = CreateThread(NULL, 0, FlusherProc, NULL, 0, NULL);
+    logRunning = TRUE;
 }
 
 void CloseLogFile()
 {
+    if (logRunning)
+    {
+        logRunning = FALSE;
+        flusherStop = TRUE;
+        SetEvent(flushEvent);
+        WaitForSingleObject(flusherThread, INFINITE);
+        CloseHandle(flusherThread);
+        CloseHandle(flushEvent);
+    }
+
+    if (ringFlsIndex != FLS_OUT_OF_INDEXES)
+    {
+        FlsFree(ringFlsIndex);
+        ringFlsIndex = FLS_OUT_OF_INDEXES;
+    }
+
     CloseHandle(fileHandle);
 }
 
-void Log(char *msg, LOG_LEVEL ll)
+static BOOL CreateThreadRing(void)
 {
-    if(ll < CURRENT_LOG_LEVEL) return;
+    threadRing = VirtualAlloc(NULL, sizeof(LOG_RING), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (threadRing == NULL)
+    {
+        return FALSE;
+    }
 
-    DWORD lpBytesWritten;
+    // The ring is added to the front of the list, which is only read by the flusher
+    do
+    {
+        threadRing->Next = logRings;
+    } while (InterlockedCompareExchangePointer((PVOID volatile *)&logRings, threadRing, threadRing->Next) != threadRing->Next);
 
-    SYSTEMTIME localTime;
-    GetLocalTime(&localTime);
+    if (ringFlsIndex != FLS_OUT_OF_INDEXES)
+    {
+        FlsSetValue(ringFlsIndex, threadRing);
+    }
 
-    char logPrefix[100];
-    sprintf(logPrefix, "[%02d:%02d:%02d %02d:%02d:%d] ", localTime.wHour, localTime.wMinute, localTime.wSecond, localTime.wDay, localTime.wMonth, localTime.wYear);
+    return TRUE;
+}
 
-    switch (ll)
+// Returns the entry to write the next message of the thread into, or NULL if its ring is full
+static LOG_ENTRY *ReserveEntry(LOG_LEVEL ll, int64_t time)
+{
+    if ((uint32_t)(threadRing->Head - threadRing->Tail) >= LOG_RING_SIZE)
     {
-    case LL_DEBUG:
-        strcat(logPrefix, "[DEBUG]\t");
-        break;
-    case LL_INFO:
-        strcat(logPrefix, "[INFO]\t");
-        break;
-    case LL_WARNING:
-        strcat(logPrefix, "[WARNING]\t");
-        break;
-    case LL_ERROR:
-        strcat(logPrefix, "[ERROR]\t");
-        break;
+        InterlockedIncrement(&threadRing->Dropped);
+        return NULL;
     }
 
-    WriteFile(fileHandle, logPrefix, strlen(logPrefix), &lpBytesWritten, NULL);
-    WriteFile(fileHandle, msg, strlen(msg), &lpBytesWritten, NULL);
-    WriteFile(fileHandle, "\n", 1, &lpBytesWritten, NULL);
+    LOG_ENTRY *entry = &threadRing->Entries[threadRing->Head % LOG_RING_SIZE];
+    entry->Time = time;
+    entry->Level = ll;
+    return entry;
 }
 
-void Logf(char *msg, LOG_LEVEL ll, ...)
+static void CommitEntry(LOG_LEVEL ll);
+
+// Returns false if the call site has written too many messages in the current window
+static BOOL CheckRate(const char *site, int64_t time)
 {
-    va_list args;
-    va_start(args, ll);
+    LOG_RATE *rate = &threadRing->Rates[((uintptr_t)site >> 3) % LOG_RATE_SLOTS];
+    if (rate->Site != site || time - rate->WindowStart >= LOG_RATE_WINDOW)
+    {
+        // The flusher may already have taken the count when the window has passed
+        LONG suppressed = InterlockedExchange(&rate->Suppressed, 0);
+        if (suppressed > 0)
+        {
+            LOG_ENTRY *entry = ReserveEntry(LL_WARNING, time);
+            if (entry != NULL)
+            {
+                FormatSuppressed(entry->Text, suppressed, rate->Site);
+                CommitEntry(LL_WARNING);
+            }
+        }
+
+        rate->Site = site;
+        rate->WindowStart = time;
+        rate->Count = 0;
+    }
+
+    if (rate->Count >= LOG_RATE_LIMIT)
+    {
+        InterlockedIncrement(&rate->Suppressed);
+        return FALSE;
+    }
+
+    rate->Count++;
+    return TRUE;
+}
 
-    char strbuf[4096] = {0};
-    _vsnprintf_s(strbuf, sizeof(strbuf), _TRUNCATE, msg, args);
+static void CommitEntry(LOG_LEVEL ll)
+{
+    // The entry is complete before the flusher can see it
+    InterlockedIncrement(&threadRing->Head);
+
+    // Errors are written right away, anything else with the next flush
+    if (ll >= LL_ERROR)
+    {
+        SetEvent(flushEvent);
+    }
+}
 
+void LogMessage(const char *msg, LOG_LEVEL ll)
+{
+    int64_t time = LogTime();
+    if (!logRunning || (threadRing == NULL && !CreateThreadRing()) || (ll < LL_ERROR && !CheckRate(msg, time)))
+    {
+        return;
+    }
+
+    LOG_ENTRY *entry = ReserveEntry(ll, time);
+    if (entry == NULL)
+    {
+        return;
+    }
+
+    strncpy(entry->Text, msg, LOG_MESSAGE_SIZE - 1);
+    entry->Text[LOG_MESSAGE_SIZE - 1] = '\0';
+    CommitEntry(ll);
+}
+
+void LogMessagef(const char *msg, LOG_LEVEL ll, ...)
+{
+    int64_t time = LogTime();
+    if (!logRunning || (threadRing == NULL && !CreateThreadRing()) || (ll < LL_ERROR && !CheckRate(msg, time)))
+    {
+        return;
+    }
+
+    LOG_ENTRY *entry = ReserveEntry(ll, time);
+    if (entry == NULL)
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, ll);
+    _vsnprintf_s(entry->Text, LOG_MESSAGE_SIZE, _TRUNCATE, msg, args);
     va_end(args);
 
-    Log(strbuf, ll);
+    CommitEntry(ll);
 }
 
 char *opcode_to_string[] =
@@ -2,6 +2,9 @@
 
 #define LOGGER_H
 
+#include <windows.h>
+#include <stdint.h>
+
 
 typedef enum LOG_LEVEL
 {
@@ -11,15 +14,74 @@ typedef enum LOG_LEVEL
     LL_ERROR = 3,
 }LOG_LEVEL;
 
+#ifndef CURRENT_LOG_LEVEL
 #define CURRENT_LOG_LEVEL LL_INFO
+#endif
+
+// Messages each thread can have waiting to be written, and the longest message kept
+#define LOG_RING_SIZE 1024
+#define LOG_MESSAGE_SIZE 240
+#define LOG_FLUSH_MS 100
+#define LOG_FLUSH_BUFFER_SIZE 0x10000
+// Messages from one call site in a window of 1 second (in the 100ns units of the time stamps)
+#define LOG_RATE_LIMIT 10
+#define LOG_RATE_WINDOW 10000000
+#define LOG_RATE_SLOTS 64
+
+// The number of messages from a call site in the current window, kept per thread
+typedef struct LOG_RATE
+{
+    const char *Site;
+    int64_t WindowStart;
+    uint32_t Count;
+    volatile LONG Suppressed; // Taken by the thread when the site changes, or by the flusher when the window has passed
+} LOG_RATE;
+
+typedef struct LOG_ENTRY
+{
+    int64_t Time; // FILETIME
+    LOG_LEVEL Level;
+    char Text[LOG_MESSAGE_SIZE];
+} LOG_ENTRY;
+
+// Written by a single thread, and read by the flusher
+typedef struct LOG_RING
+{
+    LOG_ENTRY Entries[LOG_RING_SIZE];
+    volatile LONG Head;    // Number of messages written by the thread
+    volatile LONG Tail;    // Number of messages written to the file
+    volatile LONG Dropped; // Messages not written as the ring was full
+    LOG_RATE Rates[LOG_RATE_SLOTS];
+    volatile BOOL Dead; // Set when the thread has exited, the flusher frees the ring once it has written it
+    struct LOG_RING *Next;
+} LOG_RING;
 
 void CreateLogFile();
 
 void CloseLogFile();
 
-void Log(char *msg, LOG_LEVEL ll);
+void LogMessage(const char *msg, LOG_LEVEL ll);
+
+void LogMessagef(const char *msg, LOG_LEVEL ll, ...);
+
+// Messages below CURRENT_LOG_LEVEL are removed when compiled, including the evaluation of their arguments
+#define Log(msg, ll)                      \
+    do                                    \
+    {                                     \
+        if ((ll) >= CURRENT_LOG_LEVEL)    \
+        {                                 \
+            LogMessage((msg), (ll));      \
+        }                                 \
+    } while (0)
 
-void Logf(char *msg, LOG_LEVEL, ...);
+#define Logf(msg, ll, ...)                          \
+    do                                              \
+    {                                               \
+        if ((ll) >= CURRENT_LOG_LEVEL)              \
+        {                                           \
+            LogMessagef((msg), (ll), ##__VA_ARGS__); \
+        }                                           \
+    } while (0)
 
 extern char *opcode_to_string[57];
 
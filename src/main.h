@@ -19,6 +19,12 @@
 #define AVG_FRAMERATE_FRAME_SAMPLES 120
 // This results in 60 FPS
 #define TARGET_MICROSECONDS_PER_FRAME 16667
+// The present thread wakes up at least this often without new frames, to update the debug info
+#define PRESENT_TIMEOUT_MS 50
+// Number of raw frame times kept for the graph in the debug overlay
+#define FRAME_TIME_HISTORY 128
+// Every so many instructions the time of the cpu and the ppu is measured, to split the time of the emulation between them
+#define SPLIT_SAMPLE_INTERVAL 64
 
 typedef struct NES_BITMAP
 {
@@ -72,6 +78,9 @@ typedef struct PERFDATA
 
 	uint8_t CurrentScaleFactor;
 
+	// Raw frame times in microseconds, indexed by TotalFramesRendered
+	uint16_t FrameTimes[FRAME_TIME_HISTORY];
+
 } PERFDATA;
 
 //////////// DECLARATIONS /////////////
@@ -85,7 +94,8 @@ extern BOOL running;
 // Functions
 
 DWORD CreateMainWindow(void);
-void RenderFrame(HDC hdc);
+void RenderFrame(void *frame);
+DWORD WINAPI PresentThreadProc(LPVOID param);
 DWORD SetWindowToMatchScale(uint8_t scale);
 void ProcessInput(void);
 
@@ -1,12 +1,21 @@
 #include <Windows.h>
 #include <stdint.h>
 #include "controller.h"
+#include "input_recording.h"
 #include "../logger.h"
+#include "../eventtrace.h"
 
 CONTROLLER controller;
 CONTROLLER locked_btn_state;
 BOOL strobe = 0;
 
+// The latched buttons and the strobe are cleared when the nes is powered up, the buttons held are kept
+void controller_power_up()
+{
+    strobe = FALSE;
+    locked_btn_state.bits = 0;
+}
+
 uint8_t read_controller(uint16_t address)
 {
     if(address == CONTROLLER_PORT1)
@@ -36,6 +45,11 @@ void write_controller(uint16_t address, uint8_t value)
         if(strobe && !(value & STROBE_BIT))
         {
             locked_btn_state = controller;
+            if(input_recording.mode != INPUT_RECORDING_OFF)
+            {
+                latch_recorded_input(&locked_btn_state);
+            }
+            TraceInstant(TRACE_STREAM_EMULATION, TRACE_CONTROLLER_STROBE, locked_btn_state.bits);
         }
 
         strobe = value & STROBE_BIT;
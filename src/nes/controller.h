@@ -39,6 +39,7 @@ typedef union CONTROLLER
 
 extern CONTROLLER controller;
 
+void controller_power_up();
 uint8_t read_controller(uint16_t address);
 void write_controller(uint16_t address, uint8_t value);
 
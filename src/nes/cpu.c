@@ -3,8 +3,14 @@
 #include <stdio.h>
 #include "cpu.h"
 #include "ppu.h"
+#include "ppu_pipeline.h"
+#include "ppu_capture.h"
+#include "cpu_trace.h"
+#include "cpu_profile.h"
 #include "../logger.h"
+#include "../eventtrace.h"
 #include "loader.h"
+#include "controller.h"
 
 nes_cpu cpu;
 uint8_t cpu_memory[CPU_MEMORY_SIZE] = {0};
@@ -229,7 +235,7 @@ instruction_t instruction_set[] =
         {NIL, NO_ADDR, 0, 0},         // 0xCB
         {CPY, ADDR_ABSOLUTE, 3, 4},   // 0xCC
         {CMP, ADDR_ABSOLUTE, 3, 4},   // 0xCD
-        {DEC, ADDR_ABSOLUTE, 3, 3},   // 0xCE
+        {DEC, ADDR_ABSOLUTE, 3, 6},   // 0xCE
         {NIL, NO_ADDR, 0, 0},         // 0xCF
 
         {BNE, ADDR_RELATIVE, 2, 2},   // 0xD0 **
@@ -271,7 +277,7 @@ instruction_t instruction_set[] =
         {NIL, NO_ADDR, 0, 0},         // 0xF2
         {NIL, NO_ADDR, 0, 0},         // 0xF3
         {NIL, NO_ADDR, 0, 0},         // 0xF4
-        {SBC, ADDR_ZEROPAGE_X, 2, 5}, // 0xF5
+        {SBC, ADDR_ZEROPAGE_X, 2, 4}, // 0xF5
         {INC, ADDR_ZEROPAGE_X, 2, 6}, // 0xF6
         {NIL, NO_ADDR, 0, 0},         // 0xF7
         {SED, ADDR_IMPLIED, 1, 2},    // 0xF8
@@ -309,6 +315,8 @@ void cpu_power_up()
         mapper.write_memory(APU_INPUT_REGISTER_ADDRESS + i, 0);
     }
 
+    controller_power_up();
+
     cpu.registers.pc = (mapper.read_memory(RESET_VECTOR_ADDRESS + 1) << 8) | mapper.read_memory(RESET_VECTOR_ADDRESS);
     Logf("Initial PC: %x", LL_DEBUG, cpu.registers.pc);
 
@@ -325,8 +333,11 @@ void perform_next_instruction()
 
     cpu.current_instruction = instruction_set[mapper.read_memory(cpu.registers.pc)];
 
-    /*     if(cpu.registers.pc >= 0xc4b0)
-        log_cpu_state(); */
+    if (cpu_trace.enabled)
+        trace_cpu_instruction();
+
+    if (cpu_profile.enabled)
+        profile_cpu_instruction();
 
     perform_instruction(cpu.current_instruction);
 }
@@ -334,10 +345,13 @@ void perform_next_instruction()
 void perform_nmi()
 {
     cpu.nmi_requested = FALSE;
+    if (cpu_profile.enabled)
+        profile_cpu_interrupt();
+    TraceInstant(TRACE_STREAM_EMULATION, TRACE_NMI, cpu.registers.pc);
 
     // Push current program counter
     mapper.write_memory(STACK_BASE + cpu.registers.sp, cpu.registers.pc >> 8);
-    mapper.write_memory(STACK_BASE + cpu.registers.sp - 1, cpu.registers.pc & 0xff);
+    mapper.write_memory(STACK_BASE + (uint8_t)(cpu.registers.sp - 1), cpu.registers.pc & 0xff);
     cpu.registers.sp -= 2;
 
     // Push current status flags and set the B flag
@@ -358,13 +372,41 @@ void perform_nmi()
 void perform_oam_dma(uint8_t hbyte)
 {
     uint16_t cpu_read_addr = (hbyte << 8) | 0x00;
+    TraceInstant(TRACE_STREAM_EMULATION, TRACE_OAM_DMA, hbyte);
+
+    // The render thread copies the bytes into the OAM when it reaches the cycle of the DMA
+    if (ppu_pipeline.enabled)
+    {
+        for (uint16_t i = 0; i < OAM_SIZE; i++)
+        {
+            log_ppu_write(PPU_LOG_OAM, i, mapper.read_memory(cpu_read_addr + i));
+        }
+
+        cpu.cycle += 514;
+        return;
+    }
 
-    for (uint16_t i = 0; i < 256; i++)
+    BOOL changed = FALSE;
+    for (uint16_t i = 0; i < OAM_SIZE; i++)
     {
         uint8_t value = mapper.read_memory(cpu_read_addr + i);
-        mapper.oam_write(i, value);
+        if (ppu_capture.enabled)
+        {
+            capture_ppu_access(PPU_LOG_OAM, i, value);
+        }
+        changed |= oam_memory[i] != value;
+        oam_memory[i] = value;
+    }
+
+    // Most games copy the OAM every frame, even when no sprite has moved
+    if (changed)
+    {
+        mark_ppu_dirty();
     }
 
+    // The whole OAM is replaced, so the shadow is rebuilt in one pass
+    refresh_oam_shadow();
+
     cpu.cycle += 514; // TODO this is 513 or 514 depending on odd or even cycle count
 }
 
@@ -375,6 +417,8 @@ void perform_instruction(instruction_t instruction)
     // This decides whether the pc should be incremented or not
     BOOL branched = FALSE;
     BOOL jumped = FALSE;
+    // The indexed address is on another page than the base address
+    BOOL page_crossed = FALSE;
 
     switch (instruction.addr_mode)
     {
@@ -391,19 +435,19 @@ void perform_instruction(instruction_t instruction)
     break;
     case ADDR_ABSOLUTE_X:
     {
-        // TODO check page boundery
         uint8_t LL = mapper.read_memory(cpu.registers.pc + 1);
         uint8_t HH = mapper.read_memory(cpu.registers.pc + 2);
         uint16_t address = (((uint16_t)HH) << 8) | LL;
+        page_crossed = LL + cpu.registers.x > 0xff;
         operand = mapper.get_memory_pointer(address + cpu.registers.x);
     }
     break;
     case ADDR_ABSOLUTE_Y:
     {
-        // TODO check page boundery
         uint8_t LL = mapper.read_memory(cpu.registers.pc + 1);
         uint8_t HH = mapper.read_memory(cpu.registers.pc + 2);
         uint16_t address = (((uint16_t)HH) << 8) | LL;
+        page_crossed = LL + cpu.registers.y > 0xff;
         operand = mapper.get_memory_pointer(address + cpu.registers.y);
     }
     break;
@@ -449,12 +493,12 @@ void perform_instruction(instruction_t instruction)
         uint8_t HH = mapper.read_memory((zero_page_addr + 1) & 0xff);
 
         uint16_t address = (HH << 8) | LL;
+        page_crossed = LL + cpu.registers.y > 0xff;
         address += cpu.registers.y;
         operand = mapper.get_memory_pointer(address);
     }
     break;
     case ADDR_RELATIVE:
-// TODO Check page boundery
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wint-conversion"
         operand = ((int8_t)mapper.read_memory(cpu.registers.pc + 1)) + cpu.registers.pc;
@@ -467,7 +511,7 @@ void perform_instruction(instruction_t instruction)
     }
     break;
     case ADDR_ZEROPAGE_X:
-        // TODO check page boundery
+        // The address wraps around in the zero page, so there is never a page crossing
         // Important to not have carry
         {
             uint8_t zero_page_address = mapper.read_memory(cpu.registers.pc + 1) + cpu.registers.x;
@@ -475,7 +519,7 @@ void perform_instruction(instruction_t instruction)
         }
         break;
     case ADDR_ZEROPAGE_Y:
-        // TODO check page boundery
+        // The address wraps around in the zero page, so there is never a page crossing
         // Important to not have carry
         {
             uint8_t zero_page_address = mapper.read_memory(cpu.registers.pc + 1) + cpu.registers.y;
@@ -494,10 +538,11 @@ void perform_instruction(instruction_t instruction)
     case ADC:
     {
 
+        uint8_t value = mapper.read_pointer(operand);
         uint8_t tmp0 = cpu.registers.ac;
-        uint16_t res = *operand + cpu.registers.ac + READ_C(cpu.registers.sr);
+        uint16_t res = value + cpu.registers.ac + READ_C(cpu.registers.sr);
         cpu.registers.ac = (uint8_t)res;
-        SET_V(cpu.registers.sr, ((tmp0 ^ res) & (*operand ^ res)) & 0x80 ? 1 : 0);
+        SET_V(cpu.registers.sr, ((tmp0 ^ res) & (value ^ res)) & 0x80 ? 1 : 0);
         SET_C(cpu.registers.sr, res > 255 ? 1 : 0);
         SET_Z(cpu.registers.sr, (uint8_t)res == 0);
         SET_N(cpu.registers.sr, (uint8_t)res & 0x80 ? 1 : 0);
@@ -505,17 +550,21 @@ void perform_instruction(instruction_t instruction)
     break;
     case AND:
     {
-        cpu.registers.ac &= *operand;
+        cpu.registers.ac &= mapper.read_pointer(operand);
         SET_Z(cpu.registers.sr, cpu.registers.ac == 0);
         SET_N(cpu.registers.sr, 0b1 & (cpu.registers.ac >> 7));
     }
     break;
     case ASL:
-        SET_C(cpu.registers.sr, (*operand >> 7) & 0b1);
-        mapper.write_to_pointer(operand, *operand << 1);
-        SET_Z(cpu.registers.sr, *operand == 0);
-        SET_N(cpu.registers.sr, 0b1 & (*operand >> 7));
-        break;
+    {
+        uint8_t value = mapper.read_pointer(operand);
+        uint8_t res = value << 1;
+        SET_C(cpu.registers.sr, (value >> 7) & 0b1);
+        mapper.write_to_pointer(operand, res);
+        SET_Z(cpu.registers.sr, res == 0);
+        SET_N(cpu.registers.sr, 0b1 & (res >> 7));
+    }
+    break;
     case BCC:
         if (READ_C(cpu.registers.sr) == 0)
         {
@@ -535,10 +584,13 @@ void perform_instruction(instruction_t instruction)
         }
         break;
     case BIT:
-        SET_N(cpu.registers.sr, 0b1 & (*operand >> 7));
-        SET_V(cpu.registers.sr, 0b1 & (*operand >> 6));
-        SET_Z(cpu.registers.sr, (cpu.registers.ac & *operand) == 0);
-        break;
+    {
+        uint8_t value = mapper.read_pointer(operand);
+        SET_N(cpu.registers.sr, 0b1 & (value >> 7));
+        SET_V(cpu.registers.sr, 0b1 & (value >> 6));
+        SET_Z(cpu.registers.sr, (cpu.registers.ac & value) == 0);
+    }
+    break;
     case BMI:
         if (READ_N(cpu.registers.sr) == 1)
         {
@@ -565,11 +617,13 @@ void perform_instruction(instruction_t instruction)
         cpu.registers.sp--;
         mapper.write_memory(STACK_BASE + cpu.registers.sp, ret_addr & 0xff);
         cpu.registers.sp--;
-        mapper.write_memory(STACK_BASE + cpu.registers.sp, cpu.registers.sr);
-        SET_I(*mapper.get_memory_pointer(STACK_BASE + cpu.registers.sp), 1);
+        // The status is pushed with the B flag set, and interrupts are disabled after it
+        mapper.write_memory(STACK_BASE + cpu.registers.sp, cpu.registers.sr | BIT_5 | BIT_B);
         cpu.registers.sp--;
+        SET_I(cpu.registers.sr, 1);
 
         // Load the new program counter
+        jumped = TRUE;
         cpu.registers.pc = (mapper.read_memory(IRQ_VECTOR_ADDRESS + 1) << 8) | mapper.read_memory(IRQ_VECTOR_ADDRESS);
     }
     break;
@@ -598,25 +652,37 @@ void perform_instruction(instruction_t instruction)
         SET_V(cpu.registers.sr, 0);
         break;
     case CMP:
-        SET_N(cpu.registers.sr, ((cpu.registers.ac - *operand) >> 7) & 0b1);
-        SET_Z(cpu.registers.sr, cpu.registers.ac == *operand);
-        SET_C(cpu.registers.sr, cpu.registers.ac >= *operand);
-        break;
+    {
+        uint8_t value = mapper.read_pointer(operand);
+        SET_N(cpu.registers.sr, ((cpu.registers.ac - value) >> 7) & 0b1);
+        SET_Z(cpu.registers.sr, cpu.registers.ac == value);
+        SET_C(cpu.registers.sr, cpu.registers.ac >= value);
+    }
+    break;
     case CPX:
-        SET_N(cpu.registers.sr, ((cpu.registers.x - *operand) >> 7) & 0b1);
-        SET_Z(cpu.registers.sr, cpu.registers.x == *operand);
-        SET_C(cpu.registers.sr, cpu.registers.x >= *operand);
-        break;
+    {
+        uint8_t value = mapper.read_pointer(operand);
+        SET_N(cpu.registers.sr, ((cpu.registers.x - value) >> 7) & 0b1);
+        SET_Z(cpu.registers.sr, cpu.registers.x == value);
+        SET_C(cpu.registers.sr, cpu.registers.x >= value);
+    }
+    break;
     case CPY:
-        SET_N(cpu.registers.sr, ((cpu.registers.y - *operand) >> 7) & 0b1);
-        SET_Z(cpu.registers.sr, cpu.registers.y == *operand);
-        SET_C(cpu.registers.sr, cpu.registers.y >= *operand);
-        break;
+    {
+        uint8_t value = mapper.read_pointer(operand);
+        SET_N(cpu.registers.sr, ((cpu.registers.y - value) >> 7) & 0b1);
+        SET_Z(cpu.registers.sr, cpu.registers.y == value);
+        SET_C(cpu.registers.sr, cpu.registers.y >= value);
+    }
+    break;
     case DEC:
-        mapper.write_to_pointer(operand, *operand - 1);
-        SET_Z(cpu.registers.sr, *operand == 0);
-        SET_N(cpu.registers.sr, (*operand >> 7) & 1);
-        break;
+    {
+        uint8_t res = mapper.read_pointer(operand) - 1;
+        mapper.write_to_pointer(operand, res);
+        SET_Z(cpu.registers.sr, res == 0);
+        SET_N(cpu.registers.sr, (res >> 7) & 1);
+    }
+    break;
     case DEX:
         cpu.registers.x--;
         SET_Z(cpu.registers.sr, cpu.registers.x == 0);
@@ -628,15 +694,18 @@ void perform_instruction(instruction_t instruction)
         SET_N(cpu.registers.sr, (cpu.registers.y >> 7) & 1);
         break;
     case EOR:
-        cpu.registers.ac ^= *operand;
+        cpu.registers.ac ^= mapper.read_pointer(operand);
         SET_Z(cpu.registers.sr, cpu.registers.ac == 0);
         SET_N(cpu.registers.sr, (cpu.registers.ac >> 7) & 1);
         break;
     case INC:
-        mapper.write_to_pointer(operand, *operand + 1);
-        SET_Z(cpu.registers.sr, *operand == 0);
-        SET_N(cpu.registers.sr, (*operand >> 7) & 1);
-        break;
+    {
+        uint8_t res = mapper.read_pointer(operand) + 1;
+        mapper.write_to_pointer(operand, res);
+        SET_Z(cpu.registers.sr, res == 0);
+        SET_N(cpu.registers.sr, (res >> 7) & 1);
+    }
+    break;
     case INX:
         cpu.registers.x++;
         SET_Z(cpu.registers.sr, cpu.registers.x == 0);
@@ -667,11 +736,13 @@ void perform_instruction(instruction_t instruction)
     {
 
         jumped = TRUE;
+        // The low byte of the address is read before the return address is pushed, the high byte after
+        uint8_t LL = mapper.read_memory(cpu.registers.pc + 1);
         uint16_t retAddr = cpu.registers.pc + 2;
         mapper.write_memory(STACK_BASE + cpu.registers.sp, retAddr >> 8);
-        mapper.write_memory(STACK_BASE + cpu.registers.sp - 1, retAddr & 0xff);
+        mapper.write_memory(STACK_BASE + (uint8_t)(cpu.registers.sp - 1), retAddr & 0xff);
         cpu.registers.sp -= 2;
-        cpu.registers.pc = (mapper.read_memory(cpu.registers.pc + 2) << 8) | mapper.read_memory(cpu.registers.pc + 1); // (*(operand + 1) << 8) | *operand;
+        cpu.registers.pc = (mapper.read_memory(cpu.registers.pc + 2) << 8) | LL;
     }
     break;
     case LDA:
@@ -690,16 +761,20 @@ void perform_instruction(instruction_t instruction)
         SET_Z(cpu.registers.sr, cpu.registers.y == 0);
         break;
     case LSR:
-        SET_C(cpu.registers.sr, (*operand & 1));
-        mapper.write_to_pointer(operand, *operand >> 1);
+    {
+        uint8_t value = mapper.read_pointer(operand);
+        uint8_t res = value >> 1;
+        SET_C(cpu.registers.sr, (value & 1));
+        mapper.write_to_pointer(operand, res);
         SET_N(cpu.registers.sr, 0);
-        SET_Z(cpu.registers.sr, *operand == 0);
-        break;
+        SET_Z(cpu.registers.sr, res == 0);
+    }
+    break;
     case NOP:
         // No operation performed
         break;
     case ORA:
-        cpu.registers.ac |= *operand;
+        cpu.registers.ac |= mapper.read_pointer(operand);
         SET_N(cpu.registers.sr, (cpu.registers.ac >> 7) & 1);
         SET_Z(cpu.registers.sr, cpu.registers.ac == 0);
         break;
@@ -726,36 +801,40 @@ void perform_instruction(instruction_t instruction)
     case ROL:
     {
         bool prev_carry = READ_C(cpu.registers.sr);
-        SET_C(cpu.registers.sr, (*operand >> 7) & 1);
-        mapper.write_to_pointer(operand, (*operand << 1) | prev_carry);
-        SET_N(cpu.registers.sr, (*operand >> 7) & 1);
-        SET_Z(cpu.registers.sr, *operand == 0);
+        uint8_t value = mapper.read_pointer(operand);
+        uint8_t res = (value << 1) | prev_carry;
+        SET_C(cpu.registers.sr, (value >> 7) & 1);
+        mapper.write_to_pointer(operand, res);
+        SET_N(cpu.registers.sr, (res >> 7) & 1);
+        SET_Z(cpu.registers.sr, res == 0);
     }
     break;
     case ROR:
     {
         bool prev_carry = READ_C(cpu.registers.sr);
-        SET_C(cpu.registers.sr, *operand & 1);
-        mapper.write_to_pointer(operand, (*operand >> 1) | (prev_carry << 7));
-        SET_N(cpu.registers.sr, (*operand >> 7) & 1);
-        SET_Z(cpu.registers.sr, *operand == 0);
+        uint8_t value = mapper.read_pointer(operand);
+        uint8_t res = (value >> 1) | (prev_carry << 7);
+        SET_C(cpu.registers.sr, value & 1);
+        mapper.write_to_pointer(operand, res);
+        SET_N(cpu.registers.sr, (res >> 7) & 1);
+        SET_Z(cpu.registers.sr, res == 0);
     }
     break;
     case RTI:
         jumped = TRUE;
         cpu.registers.sp++;
-        cpu.registers.sr = mapper.read_memory(STACK_BASE + cpu.registers.sp) & ~((BIT_5 | BIT_I));
-        cpu.registers.pc = mapper.read_memory(STACK_BASE + cpu.registers.sp + 1) | (mapper.read_memory(STACK_BASE + cpu.registers.sp + 2) << 8);
+        cpu.registers.sr = mapper.read_memory(STACK_BASE + cpu.registers.sp) & ~((BIT_5 | BIT_B));
+        cpu.registers.pc = mapper.read_memory(STACK_BASE + (uint8_t)(cpu.registers.sp + 1)) | (mapper.read_memory(STACK_BASE + (uint8_t)(cpu.registers.sp + 2)) << 8);
         cpu.registers.sp += 2;
         break;
     case RTS:
-        cpu.registers.pc = (mapper.read_memory(STACK_BASE + cpu.registers.sp + 1) | (mapper.read_memory(STACK_BASE + cpu.registers.sp + 2) << 8));
+        cpu.registers.pc = (mapper.read_memory(STACK_BASE + (uint8_t)(cpu.registers.sp + 1)) | (mapper.read_memory(STACK_BASE + (uint8_t)(cpu.registers.sp + 2)) << 8));
         cpu.registers.sp += 2;
         break;
     case SBC:
     {
 
-        uint16_t val = ((uint16_t)*operand) ^ 0x00FF;
+        uint16_t val = ((uint16_t)mapper.read_pointer(operand)) ^ 0x00FF;
 
         uint16_t tmp = (uint16_t)cpu.registers.ac + val + (uint16_t)READ_C(cpu.registers.sr);
 
@@ -845,6 +924,39 @@ void perform_instruction(instruction_t instruction)
 
     cpu.cycle += cpu.current_instruction.cycles;
 
+    // Reads through an indexed address take a cycle more to fix its high byte when it is on another page,
+    // writes and read-modify-writes always take that cycle, which is in their base cycles
+    if (page_crossed)
+    {
+        switch (instruction.operation)
+        {
+        case ADC:
+        case AND:
+        case CMP:
+        case EOR:
+        case LDA:
+        case LDX:
+        case LDY:
+        case ORA:
+        case SBC:
+            cpu.cycle++;
+            break;
+        default:
+            break;
+        }
+    }
+
+    // A taken branch takes a cycle more, and another when the target is on another page than the next instruction
+    if (branched)
+    {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+        uint16_t target = (uint16_t)operand + instruction.bytes;
+#pragma GCC diagnostic pop
+        uint16_t next = cpu.registers.pc + instruction.bytes;
+        cpu.cycle += (target & 0xff00) != (next & 0xff00) ? 2 : 1;
+    }
+
     // If the instruction jumps, the program counter does not need to be incremented
     if (!jumped)
     {
@@ -0,0 +1,415 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../logger.h"
+#include "cpu_profile.h"
+#include "cpu.h"
+
+/*
+    Where the game spends its cycles, counted exactly for every instruction while profiling
+
+    The cycles of an instruction are known when the next one starts, so each instruction is settled then:
+    its cycles go to its address and to the routine on top of a shadow call stack. JSR and interrupts push a frame
+    on that stack and RTS and RTI pop it. Games also leave routines by moving the stack pointer or by pushing an address
+    and returning to it, so a frame is taken as returned as soon as the stack is back up to where it was before the call.
+    Each distinct path of calls is a node of a tree, which keeps the cycles spent on that path for the collapsed stacks.
+
+    The addresses are those seen by the cpu, so with a mapper switching banks the code of every bank at an address is counted together.
+*/
+
+#define CPU_CYCLES_PER_FRAME (CYCLES_PER_SEC / 60)
+
+cpu_profile_t cpu_profile;
+
+static uint16_t order[0x10000];
+
+static uint32_t find_node(uint32_t parent, uint16_t target, BOOL interrupt)
+{
+    cpu_profile_data_t *data = cpu_profile.data;
+    uint32_t index = (parent * 0x9E3779B1 ^ (target | interrupt << 16)) % CPU_PROFILE_NODE_TABLE_SIZE;
+
+    while (data->node_table[index] != 0)
+    {
+        cpu_profile_node_t *node = &data->nodes[data->node_table[index]];
+        if (node->parent == parent && node->target == target && node->interrupt == interrupt)
+        {
+            return data->node_table[index];
+        }
+        index = (index + 1) % CPU_PROFILE_NODE_TABLE_SIZE;
+    }
+
+    // With no room the cycles stay with the caller
+    if (cpu_profile.node_count == CPU_PROFILE_MAX_NODES)
+    {
+        return parent;
+    }
+
+    uint32_t node = cpu_profile.node_count++;
+    data->nodes[node] = (cpu_profile_node_t){parent, target, interrupt, 0};
+    data->node_table[index] = node;
+    return node;
+}
+
+static void pop_frame()
+{
+    cpu_profile_frame_t *frame = &cpu_profile.stack[--cpu_profile.depth];
+    uint64_t cycles = cpu.cycle - frame->start_cycle;
+
+    cpu_profile.data->routine_cycles[frame->target] += cycles;
+    cpu_profile.data->routine_calls[frame->target]++;
+
+    if (frame->interrupt)
+    {
+        cpu_profile.nmi_count++;
+        cpu_profile.nmi_cycles += cycles;
+        if (cycles > cpu_profile.nmi_max_cycles)
+        {
+            cpu_profile.nmi_max_cycles = cycles;
+        }
+    }
+}
+
+// Pops the frames which have returned, as the stack is back up to where it was before they were called
+static void unwind_frames(uint16_t sp)
+{
+    while (cpu_profile.depth > 1 && cpu_profile.stack[cpu_profile.depth - 1].sp <= sp)
+    {
+        pop_frame();
+    }
+}
+
+static void push_frame(uint16_t target, uint16_t sp, BOOL interrupt, uint64_t start_cycle)
+{
+    unwind_frames(sp);
+
+    if (cpu_profile.depth == CPU_PROFILE_STACK_DEPTH)
+    {
+        return;
+    }
+
+    uint32_t node = find_node(cpu_profile.stack[cpu_profile.depth - 1].node, target, interrupt);
+    cpu_profile.stack[cpu_profile.depth++] = (cpu_profile_frame_t){node, target, sp, interrupt, start_cycle};
+
+    if (interrupt)
+    {
+        cpu_profile.data->nmi_handler[target] = TRUE;
+    }
+}
+
+static void charge_routine(uint64_t cycles)
+{
+    cpu_profile_frame_t *frame = &cpu_profile.stack[cpu_profile.depth - 1];
+    cpu_profile.data->nodes[frame->node].cycles += cycles;
+
+    // The first frame is not a routine
+    if (cpu_profile.depth > 1)
+    {
+        cpu_profile.data->routine_self[frame->target] += cycles;
+    }
+}
+
+// Counts the cycles of the pending instruction, and what it did to the call stack
+static void settle_instruction()
+{
+    uint64_t cycles = cpu.cycle - cpu_profile.cycle;
+    cpu_profile.total_cycles += cycles;
+
+    switch (cpu_profile.kind)
+    {
+    case CPU_PROFILE_CALL:
+        cpu_profile.data->pc_cycles[cpu_profile.pc] += cycles;
+        charge_routine(cycles);
+        push_frame(cpu.registers.pc, cpu.registers.sp + 2, FALSE, cpu_profile.cycle);
+        break;
+    case CPU_PROFILE_INTERRUPT:
+        cpu_profile.data->pc_cycles[cpu_profile.pc] += cycles;
+        charge_routine(cycles);
+        push_frame(cpu.registers.pc, cpu.registers.sp + 3, FALSE, cpu_profile.cycle);
+        break;
+    // The cycles of taking the NMI are the handler's, as no instruction was performed
+    case CPU_PROFILE_NMI:
+        push_frame(cpu.registers.pc, cpu.registers.sp + 3, TRUE, cpu_profile.cycle);
+        charge_routine(cycles);
+        break;
+    case CPU_PROFILE_RETURN:
+        cpu_profile.data->pc_cycles[cpu_profile.pc] += cycles;
+        charge_routine(cycles);
+        unwind_frames(cpu.registers.sp);
+        break;
+    case CPU_PROFILE_JUMP:
+        cpu_profile.data->pc_cycles[cpu_profile.pc] += cycles;
+        charge_routine(cycles);
+        if (cpu.registers.pc <= cpu_profile.pc && cpu_profile.pc - cpu.registers.pc <= CPU_PROFILE_LOOP_BYTES)
+        {
+            cpu_profile.data->loop_start[cpu_profile.pc] = cpu.registers.pc;
+        }
+        break;
+    default:
+        cpu_profile.data->pc_cycles[cpu_profile.pc] += cycles;
+        charge_routine(cycles);
+        break;
+    }
+}
+
+void profile_cpu_instruction()
+{
+    if (cpu_profile.pending)
+    {
+        settle_instruction();
+    }
+
+    switch (cpu.current_instruction.operation)
+    {
+    case JSR:
+        cpu_profile.kind = CPU_PROFILE_CALL;
+        break;
+    case BRK:
+        cpu_profile.kind = CPU_PROFILE_INTERRUPT;
+        break;
+    case RTS:
+    case RTI:
+        cpu_profile.kind = CPU_PROFILE_RETURN;
+        break;
+    case JMP:
+    case BCC:
+    case BCS:
+    case BEQ:
+    case BMI:
+    case BNE:
+    case BPL:
+    case BVC:
+    case BVS:
+        cpu_profile.kind = CPU_PROFILE_JUMP;
+        break;
+    default:
+        cpu_profile.kind = CPU_PROFILE_PLAIN;
+        break;
+    }
+
+    cpu_profile.pending = TRUE;
+    cpu_profile.pc = cpu.registers.pc;
+    cpu_profile.cycle = cpu.cycle;
+}
+
+// Called before the NMI is taken, the handler is pushed when its first instruction starts
+void profile_cpu_interrupt()
+{
+    if (cpu_profile.pending)
+    {
+        settle_instruction();
+    }
+
+    cpu_profile.pending = TRUE;
+    cpu_profile.kind = CPU_PROFILE_NMI;
+    cpu_profile.pc = cpu.registers.pc;
+    cpu_profile.cycle = cpu.cycle;
+}
+
+BOOL start_cpu_profile()
+{
+    if (cpu_profile.enabled)
+    {
+        return FALSE;
+    }
+
+    cpu_profile.data = VirtualAlloc(NULL, sizeof(cpu_profile_data_t), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (cpu_profile.data == NULL)
+    {
+        Log("Unable to allocate the cpu profile", LL_ERROR);
+        return FALSE;
+    }
+
+    // The first node and frame are the code outside any routine, which is never returned from
+    cpu_profile.node_count = 1;
+    cpu_profile.stack[0] = (cpu_profile_frame_t){0, 0, 0x100, FALSE, cpu.cycle};
+    cpu_profile.depth = 1;
+
+    cpu_profile.pending = FALSE;
+    cpu_profile.total_cycles = 0;
+    cpu_profile.nmi_count = 0;
+    cpu_profile.nmi_cycles = 0;
+    cpu_profile.nmi_max_cycles = 0;
+    cpu_profile.enabled = TRUE;
+
+    Log("Cpu profile started", LL_INFO);
+    return TRUE;
+}
+
+void stop_cpu_profile()
+{
+    if (!cpu_profile.enabled)
+    {
+        return;
+    }
+
+    cpu_profile.enabled = FALSE;
+    VirtualFree(cpu_profile.data, 0, MEM_RELEASE);
+    cpu_profile.data = NULL;
+
+    Log("Cpu profile stopped", LL_INFO);
+}
+
+// The cycles from calling the routine to its return, with the calls which have not returned yet up to now
+static uint64_t routine_cycles(uint16_t address)
+{
+    uint64_t cycles = cpu_profile.data->routine_cycles[address];
+    for (uint8_t i = 1; i < cpu_profile.depth; i++)
+    {
+        if (cpu_profile.stack[i].target == address)
+        {
+            cycles += cpu.cycle - cpu_profile.stack[i].start_cycle;
+        }
+    }
+    return cycles;
+}
+
+// Cycles of the instructions of a loop, from where it jumps back to up to the jump
+static uint64_t loop_cycles(uint16_t address)
+{
+    uint64_t cycles = 0;
+    for (uint32_t pc = cpu_profile.data->loop_start[address]; pc <= address; pc++)
+    {
+        cycles += cpu_profile.data->pc_cycles[pc];
+    }
+    return cycles;
+}
+
+static const uint64_t *sort_values;
+
+static int compare_descending(const void *a, const void *b)
+{
+    uint64_t x = sort_values[*(const uint16_t *)a];
+    uint64_t y = sort_values[*(const uint16_t *)b];
+    return x > y ? -1 : x < y;
+}
+
+// Sorts the addresses with a value by the value, returning their number
+static uint32_t sort_addresses(const uint64_t *values)
+{
+    uint32_t count = 0;
+    for (uint32_t address = 0; address < 0x10000; address++)
+    {
+        if (values[address] != 0)
+        {
+            order[count++] = address;
+        }
+    }
+
+    sort_values = values;
+    qsort(order, count, sizeof(uint16_t), compare_descending);
+    return count;
+}
+
+static double percent(uint64_t cycles)
+{
+    return cpu_profile.total_cycles ? cycles * 100.0 / cpu_profile.total_cycles : 0;
+}
+
+static void write_cpu_profile_report(FILE *file)
+{
+    cpu_profile_data_t *data = cpu_profile.data;
+
+    fprintf(file, "%llu cycles profiled (%.1f frames)\n\n", cpu_profile.total_cycles, (double)cpu_profile.total_cycles / CPU_CYCLES_PER_FRAME);
+
+    fprintf(file, "Hottest routines, by the cycles in the routine itself\n");
+    fprintf(file, "%-8s %8s %8s %10s %14s\n", "routine", "self %", "total %", "calls", "cycles/call");
+    uint32_t count = sort_addresses(data->routine_self);
+    for (uint32_t i = 0; i < count && i < CPU_PROFILE_REPORT_LINES; i++)
+    {
+        uint16_t address = order[i];
+        uint64_t total = routine_cycles(address);
+        uint32_t calls = data->routine_calls[address];
+        fprintf(file, "$%04X%s %8.2f %8.2f %10u %14.1f\n", address, data->nmi_handler[address] ? " nmi" : "    ",
+                percent(data->routine_self[address]), percent(total), calls, calls ? (double)data->routine_cycles[address] / calls : 0);
+    }
+
+    fprintf(file, "\nHottest instructions\n");
+    fprintf(file, "%-8s %8s\n", "address", "%");
+    count = sort_addresses(data->pc_cycles);
+    for (uint32_t i = 0; i < count && i < CPU_PROFILE_REPORT_LINES; i++)
+    {
+        fprintf(file, "$%04X    %8.2f\n", order[i], percent(data->pc_cycles[order[i]]));
+    }
+
+    // Short loops taking many cycles are mostly waiting, for the NMI or for a register, and are where idle loops can be skipped
+    static uint64_t loops[0x10000];
+    for (uint32_t address = 0; address < 0x10000; address++)
+    {
+        loops[address] = data->loop_start[address] ? loop_cycles(address) : 0;
+    }
+
+    fprintf(file, "\nIdle loops, short loops by their cycles\n");
+    fprintf(file, "%-12s %8s\n", "loop", "%");
+    count = sort_addresses(loops);
+    for (uint32_t i = 0; i < count && i < CPU_PROFILE_REPORT_LINES; i++)
+    {
+        fprintf(file, "$%04X-$%04X  %8.2f\n", data->loop_start[order[i]], order[i], percent(loops[order[i]]));
+    }
+
+    fprintf(file, "\nNMI handlers: %u returned from", cpu_profile.nmi_count);
+    if (cpu_profile.nmi_count)
+    {
+        double average = (double)cpu_profile.nmi_cycles / cpu_profile.nmi_count;
+        fprintf(file, ", %.1f cycles on average (%.1f%% of a frame), %llu at most (%.1f%%)",
+                average, average * 100.0 / CPU_CYCLES_PER_FRAME, cpu_profile.nmi_max_cycles, cpu_profile.nmi_max_cycles * 100.0 / CPU_CYCLES_PER_FRAME);
+    }
+    fprintf(file, "\n");
+}
+
+// Each line is the path of routines from the outermost, and the cycles spent in the last of them on that path
+static void write_cpu_profile_stacks(FILE *file)
+{
+    cpu_profile_data_t *data = cpu_profile.data;
+    uint32_t path[CPU_PROFILE_STACK_DEPTH];
+
+    for (uint32_t node = 0; node < cpu_profile.node_count; node++)
+    {
+        if (data->nodes[node].cycles == 0)
+        {
+            continue;
+        }
+
+        uint32_t length = 0;
+        for (uint32_t n = node; n != 0 && length < CPU_PROFILE_STACK_DEPTH; n = data->nodes[n].parent)
+        {
+            path[length++] = n;
+        }
+
+        fprintf(file, "main");
+        while (length > 0)
+        {
+            cpu_profile_node_t *frame = &data->nodes[path[--length]];
+            fprintf(file, frame->interrupt ? ";nmi_$%04X" : ";$%04X", frame->target);
+        }
+        fprintf(file, " %llu\n", data->nodes[node].cycles);
+    }
+}
+
+BOOL write_cpu_profile(LPCSTR report_file, LPCSTR stacks_file)
+{
+    if (!cpu_profile.enabled)
+    {
+        return FALSE;
+    }
+
+    FILE *report = fopen(report_file, "w");
+    if (report == NULL)
+    {
+        Logf("Unable to create %s", LL_ERROR, report_file);
+        return FALSE;
+    }
+    write_cpu_profile_report(report);
+    fclose(report);
+
+    FILE *stacks = fopen(stacks_file, "w");
+    if (stacks == NULL)
+    {
+        Logf("Unable to create %s", LL_ERROR, stacks_file);
+        return FALSE;
+    }
+    write_cpu_profile_stacks(stacks);
+    fclose(stacks);
+
+    Logf("Cpu profile written to %s and %s", LL_INFO, report_file, stacks_file);
+    return TRUE;
+}
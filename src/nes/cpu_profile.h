@@ -0,0 +1,92 @@
+#ifndef CPU_PROFILE_H
+
+#define CPU_PROFILE_H
+
+#include "Windows.h"
+#include <stdint.h>
+
+#define CPU_PROFILE_REPORT_FILE "cpu_profile.txt"
+// Collapsed stacks, one line per call path with its cycles, read by flamegraph.pl and speedscope
+#define CPU_PROFILE_STACKS_FILE "cpu_profile.folded"
+// The 6502 stack holds at most 128 return addresses
+#define CPU_PROFILE_STACK_DEPTH 128
+// Distinct call paths kept, the cycles of deeper paths go to their caller when there is no room
+#define CPU_PROFILE_MAX_NODES 0x10000
+#define CPU_PROFILE_NODE_TABLE_SIZE (2 * CPU_PROFILE_MAX_NODES)
+// A jump or branch back at most this many bytes is a loop which may be waiting, such as for the NMI
+#define CPU_PROFILE_LOOP_BYTES 16
+// Lines of each list in the report
+#define CPU_PROFILE_REPORT_LINES 20
+
+// What the instruction being profiled does to the call stack
+typedef enum CPU_PROFILE_KIND
+{
+    CPU_PROFILE_PLAIN,
+    CPU_PROFILE_CALL,      // JSR
+    CPU_PROFILE_INTERRUPT, // BRK
+    CPU_PROFILE_NMI,       // Taking the NMI, before the first instruction of the handler
+    CPU_PROFILE_RETURN,    // RTS and RTI
+    CPU_PROFILE_JUMP,      // JMP and the branches, which may loop
+} CPU_PROFILE_KIND;
+
+// A call path, which is the path of its caller and the routine called
+typedef struct cpu_profile_node_t
+{
+    uint32_t parent;
+    uint16_t target;
+    BOOL interrupt;
+    uint64_t cycles; // Spent in the routine itself on this path
+} cpu_profile_node_t;
+
+typedef struct cpu_profile_frame_t
+{
+    uint32_t node;
+    uint16_t target;
+    uint16_t sp; // The stack pointer before the call, the frame has returned when the stack is back up to it
+    BOOL interrupt;
+    uint64_t start_cycle;
+} cpu_profile_frame_t;
+
+typedef struct cpu_profile_data_t
+{
+    uint64_t pc_cycles[0x10000];      // Cycles of the instructions at each address
+    uint64_t routine_self[0x10000];   // Cycles of the instructions in the routine at each address, outside the routines it calls
+    uint64_t routine_cycles[0x10000]; // Cycles from calling the routine at each address to its return
+    uint32_t routine_calls[0x10000];
+    uint16_t loop_start[0x10000]; // The address a short jump or branch back at each address went to, or 0
+    BOOL nmi_handler[0x10000];
+
+    cpu_profile_node_t nodes[CPU_PROFILE_MAX_NODES];
+    uint32_t node_table[CPU_PROFILE_NODE_TABLE_SIZE]; // Open addressing from the parent and the routine to the node, 0 is empty
+} cpu_profile_data_t;
+
+typedef struct cpu_profile_t
+{
+    BOOL enabled;
+    cpu_profile_data_t *data;
+    uint32_t node_count;
+
+    cpu_profile_frame_t stack[CPU_PROFILE_STACK_DEPTH]; // The first frame is the code outside any routine
+    uint8_t depth;
+
+    // The instruction being profiled, which is settled when the next one starts and its cycles are known
+    BOOL pending;
+    uint16_t pc;
+    CPU_PROFILE_KIND kind;
+    uint64_t cycle;
+    uint64_t total_cycles;
+
+    uint32_t nmi_count; // NMI handlers returned from
+    uint64_t nmi_cycles;
+    uint64_t nmi_max_cycles;
+} cpu_profile_t;
+
+extern cpu_profile_t cpu_profile;
+
+BOOL start_cpu_profile();
+void stop_cpu_profile();
+void profile_cpu_instruction();
+void profile_cpu_interrupt();
+BOOL write_cpu_profile(LPCSTR report_file, LPCSTR stacks_file);
+
+#endif
@@ -0,0 +1,250 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include "../logger.h"
+#include "cpu_trace.h"
+#include "cpu.h"
+#include "ppu.h"
+#include "loader.h"
+
+/*
+    While tracing, the state of the cpu before each instruction is appended to the trace file as a fixed size record,
+    written straight into a view of the file mapped into memory. Nothing is formatted while the game runs,
+    the cputrace tool turns a trace into the log format of nestest (format_cpu_trace_record) afterwards.
+
+    A trace of every instruction is mapped CPU_TRACE_CHUNK_RECORDS records at a time, growing the file as it goes.
+    A trace in a ring only keeps the last instructions, in a file of a fixed size mapped as a whole.
+*/
+
+cpu_trace_t cpu_trace;
+
+static void unmap_cpu_trace_view()
+{
+    if (cpu_trace.view != NULL)
+    {
+        UnmapViewOfFile(cpu_trace.view);
+        cpu_trace.view = NULL;
+    }
+
+    if (cpu_trace.mapping != NULL)
+    {
+        CloseHandle(cpu_trace.mapping);
+        cpu_trace.mapping = NULL;
+    }
+}
+
+// Maps the records first -> first + length of the file, making the file larger if needed
+static BOOL map_cpu_trace_view(uint64_t first, uint64_t length)
+{
+    unmap_cpu_trace_view();
+
+    uint64_t size = (first + length) * sizeof(cpu_trace_record_t);
+    uint64_t offset = first * sizeof(cpu_trace_record_t);
+
+    cpu_trace.mapping = CreateFileMappingA(cpu_trace.file, NULL, PAGE_READWRITE, size >> 32, size & 0xffffffff, NULL);
+    if (cpu_trace.mapping == NULL)
+    {
+        return FALSE;
+    }
+
+    cpu_trace.view = MapViewOfFile(cpu_trace.mapping, FILE_MAP_WRITE, offset >> 32, offset & 0xffffffff, length * sizeof(cpu_trace_record_t));
+    if (cpu_trace.view == NULL)
+    {
+        unmap_cpu_trace_view();
+        return FALSE;
+    }
+
+    cpu_trace.view_first = first;
+    cpu_trace.view_length = length;
+    return TRUE;
+}
+
+BOOL start_cpu_trace(LPCSTR filename, uint64_t ring_capacity)
+{
+    if (cpu_trace.enabled)
+    {
+        return FALSE;
+    }
+
+    cpu_trace.file = CreateFileA(
+        filename,
+        GENERIC_READ | GENERIC_WRITE,
+        0,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+
+    if (cpu_trace.file == INVALID_HANDLE_VALUE)
+    {
+        Logf("Unable to create the cpu trace file %s", LL_ERROR, filename);
+        return FALSE;
+    }
+
+    cpu_trace.header.magic = CPU_TRACE_MAGIC;
+    cpu_trace.header.record_size = sizeof(cpu_trace_record_t);
+    cpu_trace.header.count = 0;
+    cpu_trace.header.capacity = ring_capacity;
+
+    if (!map_cpu_trace_view(0, ring_capacity > 0 ? ring_capacity + 1 : CPU_TRACE_CHUNK_RECORDS))
+    {
+        Logf("Unable to map the cpu trace file %s", LL_ERROR, filename);
+        CloseHandle(cpu_trace.file);
+        return FALSE;
+    }
+
+    cpu_trace.enabled = TRUE;
+    Logf("CPU trace started: %s", LL_INFO, filename);
+    return TRUE;
+}
+
+void stop_cpu_trace()
+{
+    if (!cpu_trace.enabled)
+    {
+        return;
+    }
+
+    cpu_trace.enabled = FALSE;
+    unmap_cpu_trace_view();
+
+    // The last chunk is only partly used
+    if (cpu_trace.header.capacity == 0)
+    {
+        LARGE_INTEGER size;
+        size.QuadPart = (cpu_trace.header.count + 1) * sizeof(cpu_trace_record_t);
+        SetFilePointerEx(cpu_trace.file, size, NULL, FILE_BEGIN);
+        SetEndOfFile(cpu_trace.file);
+    }
+
+    DWORD bytes_written;
+    SetFilePointer(cpu_trace.file, 0, NULL, FILE_BEGIN);
+    WriteFile(cpu_trace.file, &cpu_trace.header, sizeof(cpu_trace_header_t), &bytes_written, NULL);
+    CloseHandle(cpu_trace.file);
+
+    Logf("CPU trace stopped after %llu instructions", LL_INFO, cpu_trace.header.count);
+}
+
+void trace_cpu_instruction()
+{
+    uint64_t index = cpu_trace.header.capacity > 0 ? cpu_trace.header.count % cpu_trace.header.capacity : cpu_trace.header.count;
+    // The header is the first record of the file
+    uint64_t slot = index + 1;
+
+    if (slot >= cpu_trace.view_first + cpu_trace.view_length)
+    {
+        if (!map_cpu_trace_view(slot & ~(uint64_t)(CPU_TRACE_CHUNK_RECORDS - 1), CPU_TRACE_CHUNK_RECORDS))
+        {
+            Log("Unable to map more of the cpu trace file, the trace is stopped", LL_ERROR);
+            stop_cpu_trace();
+            return;
+        }
+    }
+
+    fill_cpu_trace_record(&cpu_trace.view[slot - cpu_trace.view_first]);
+    cpu_trace.header.count++;
+}
+
+void fill_cpu_trace_record(cpu_trace_record_t *record)
+{
+    record->pc = cpu.registers.pc;
+    record->bytes[0] = mapper.read_memory(cpu.registers.pc);
+    for (uint8_t i = 1; i < instruction_set[record->bytes[0]].bytes; i++)
+    {
+        record->bytes[i] = mapper.read_memory(cpu.registers.pc + i);
+    }
+    record->ac = cpu.registers.ac;
+    record->x = cpu.registers.x;
+    record->y = cpu.registers.y;
+    // The cpu does not keep bit 5, which is always set when P is pushed, and so in the log of nestest
+    record->sr = cpu.registers.sr | BIT_5;
+    record->sp = cpu.registers.sp;
+    record->scanline = ppu_state.scanline;
+    record->dot = ppu_state.cycle % 341;
+    record->frame = ppu_state.frame_counter;
+    record->cycle = cpu.cycle;
+}
+
+BOOL read_cpu_trace_header(HANDLE file, cpu_trace_header_t *header)
+{
+    DWORD bytes_read;
+    if (!ReadFile(file, header, sizeof(cpu_trace_header_t), &bytes_read, NULL) || bytes_read != sizeof(cpu_trace_header_t))
+    {
+        return FALSE;
+    }
+
+    return header->magic == CPU_TRACE_MAGIC && header->record_size == sizeof(cpu_trace_record_t);
+}
+
+// Writes the record as a line of the nestest log, without the values at the addresses which the trace does not have
+// C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7
+void format_cpu_trace_record(const cpu_trace_record_t *record, char *line)
+{
+    instruction_t instruction = instruction_set[record->bytes[0]];
+    uint8_t LL = record->bytes[1];
+    uint16_t HHLL = (record->bytes[2] << 8) | LL;
+
+    char bytes[16];
+    switch (instruction.bytes)
+    {
+    case 2:
+        sprintf(bytes, "%02X %02X", record->bytes[0], LL);
+        break;
+    case 3:
+        sprintf(bytes, "%02X %02X %02X", record->bytes[0], LL, record->bytes[2]);
+        break;
+    default:
+        sprintf(bytes, "%02X", record->bytes[0]);
+        break;
+    }
+
+    char operand[16];
+    switch (instruction.addr_mode)
+    {
+    case ADDR_ACCUMULATOR:
+        sprintf(operand, "A");
+        break;
+    case ADDR_ABSOLUTE:
+        sprintf(operand, "$%04X", HHLL);
+        break;
+    case ADDR_ABSOLUTE_X:
+        sprintf(operand, "$%04X,X", HHLL);
+        break;
+    case ADDR_ABSOLUTE_Y:
+        sprintf(operand, "$%04X,Y", HHLL);
+        break;
+    case ADDR_IMMEDIATE:
+        sprintf(operand, "#$%02X", LL);
+        break;
+    case ADDR_INDIRECT:
+        sprintf(operand, "($%04X)", HHLL);
+        break;
+    case ADDR_X_INDIRECT:
+        sprintf(operand, "($%02X,X)", LL);
+        break;
+    case ADDR_INDIRECT_Y:
+        sprintf(operand, "($%02X),Y", LL);
+        break;
+    case ADDR_RELATIVE:
+        sprintf(operand, "$%04X", (uint16_t)(record->pc + 2 + (int8_t)LL));
+        break;
+    case ADDR_ZEROPAGE:
+        sprintf(operand, "$%02X", LL);
+        break;
+    case ADDR_ZEROPAGE_X:
+        sprintf(operand, "$%02X,X", LL);
+        break;
+    case ADDR_ZEROPAGE_Y:
+        sprintf(operand, "$%02X,Y", LL);
+        break;
+    default:
+        operand[0] = '\0';
+        break;
+    }
+
+    char disassembly[32];
+    sprintf(disassembly, "%s %s", opcode_to_string[instruction.operation], operand);
+
+    sprintf(line, "%04X  %-8s  %-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3d,%3d CYC:%llu",
+            record->pc, bytes, disassembly, record->ac, record->x, record->y, record->sr, record->sp, record->scanline, record->dot, record->cycle);
+}
@@ -0,0 +1,64 @@
+#ifndef CPU_TRACE_H
+
+#define CPU_TRACE_H
+
+#include "Windows.h"
+#include <stdint.h>
+
+#define CPU_TRACE_MAGIC 0x54555043 // "CPUT"
+#define CPU_TRACE_FILE "cpu_trace.cpt"
+// The file is mapped this many records at a time, a multiple of the 64 KB the views have to be aligned to
+#define CPU_TRACE_CHUNK_RECORDS 0x100000
+// Longest line of format_cpu_trace_record
+#define CPU_TRACE_LINE_SIZE 128
+
+// The state of the cpu before an instruction is performed, with the position of the ppu at that time
+typedef struct cpu_trace_record_t
+{
+    uint16_t pc;
+    uint8_t bytes[3]; // The opcode and its operands, only as many as the instruction has are valid
+    uint8_t ac;
+    uint8_t x;
+    uint8_t y;
+    uint8_t sr;
+    uint8_t sp;
+    uint16_t scanline;
+    uint16_t dot;
+    uint16_t frame; // The frame counter of the ppu
+    uint64_t cycle;
+    uint8_t reserved[8];
+} cpu_trace_record_t;
+
+// The trace file is this header followed by the records, the header has the size of a record so the records stay aligned
+typedef struct cpu_trace_header_t
+{
+    uint32_t magic;
+    uint32_t record_size;
+    uint64_t count;    // Number of instructions traced
+    uint64_t capacity; // Number of records in the ring, or 0 when every instruction is kept
+    uint8_t reserved[8];
+} cpu_trace_header_t;
+
+typedef struct cpu_trace_t
+{
+    BOOL enabled;
+    HANDLE file;
+    HANDLE mapping;
+    cpu_trace_header_t header;
+
+    // The mapped part of the file, in records of which the header is the first, the view of a ring is the whole file
+    cpu_trace_record_t *view;
+    uint64_t view_first;
+    uint64_t view_length;
+} cpu_trace_t;
+
+extern cpu_trace_t cpu_trace;
+
+BOOL start_cpu_trace(LPCSTR filename, uint64_t ring_capacity);
+void stop_cpu_trace();
+void trace_cpu_instruction();
+void fill_cpu_trace_record(cpu_trace_record_t *record);
+BOOL read_cpu_trace_header(HANDLE file, cpu_trace_header_t *header);
+void format_cpu_trace_record(const cpu_trace_record_t *record, char *line);
+
+#endif
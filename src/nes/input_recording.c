@@ -0,0 +1,136 @@
+#include <stdint.h>
+#include "../logger.h"
+#include "input_recording.h"
+#include "controller.h"
+
+/*
+    The buttons are recorded as the game latches them (the strobe of the controller is turned off),
+    numbered by how many latches came before, and only when they differ from the last ones recorded.
+    The emulation is deterministic, so a replay latches the same number of times at the same places,
+    and gets the same buttons regardless of how the frames of the window lined up with the frames of the game.
+*/
+
+input_recording_t input_recording;
+
+BOOL start_input_recording(LPCSTR filename)
+{
+    if (input_recording.mode != INPUT_RECORDING_OFF)
+    {
+        return FALSE;
+    }
+
+    input_recording.file = CreateFileA(filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (input_recording.file == INVALID_HANDLE_VALUE)
+    {
+        Logf("Unable to create the input recording %s", LL_ERROR, filename);
+        return FALSE;
+    }
+
+    // The header is written again with the count when the recording stops
+    input_recording_header_t header = {INPUT_RECORDING_MAGIC, 0};
+    DWORD bytes_written;
+    WriteFile(input_recording.file, &header, sizeof(input_recording_header_t), &bytes_written, NULL);
+
+    input_recording.latch = 0;
+    input_recording.count = 0;
+    input_recording.mode = INPUT_RECORDING_RECORD;
+
+    Logf("Input recording started: %s", LL_INFO, filename);
+    return TRUE;
+}
+
+BOOL start_input_replay(LPCSTR filename)
+{
+    if (input_recording.mode != INPUT_RECORDING_OFF)
+    {
+        return FALSE;
+    }
+
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        Logf("Unable to open the input recording %s", LL_ERROR, filename);
+        return FALSE;
+    }
+
+    input_recording_header_t header;
+    DWORD bytes_read;
+    if (!ReadFile(file, &header, sizeof(input_recording_header_t), &bytes_read, NULL) || bytes_read != sizeof(input_recording_header_t) ||
+        header.magic != INPUT_RECORDING_MAGIC)
+    {
+        Logf("%s is not an input recording", LL_ERROR, filename);
+        CloseHandle(file);
+        return FALSE;
+    }
+
+    input_recording.events = header.count > 0 ? VirtualAlloc(NULL, header.count * sizeof(input_event_t), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE) : NULL;
+    if (header.count > 0 &&
+        (input_recording.events == NULL ||
+         !ReadFile(file, input_recording.events, header.count * sizeof(input_event_t), &bytes_read, NULL) || bytes_read != header.count * sizeof(input_event_t)))
+    {
+        Logf("The input recording %s ends before its last event", LL_ERROR, filename);
+        VirtualFree(input_recording.events, 0, MEM_RELEASE);
+        input_recording.events = NULL;
+        CloseHandle(file);
+        return FALSE;
+    }
+    CloseHandle(file);
+
+    input_recording.latch = 0;
+    input_recording.buttons = 0;
+    input_recording.count = header.count;
+    input_recording.next = 0;
+    input_recording.mode = INPUT_RECORDING_REPLAY;
+
+    Logf("Input replay started: %s, %d events", LL_INFO, filename, header.count);
+    return TRUE;
+}
+
+void stop_input_recording()
+{
+    if (input_recording.mode == INPUT_RECORDING_RECORD)
+    {
+        input_recording_header_t header = {INPUT_RECORDING_MAGIC, input_recording.count};
+        DWORD bytes_written;
+        SetFilePointer(input_recording.file, 0, NULL, FILE_BEGIN);
+        WriteFile(input_recording.file, &header, sizeof(input_recording_header_t), &bytes_written, NULL);
+        CloseHandle(input_recording.file);
+
+        Logf("Input recording stopped after %d latches, %d events", LL_INFO, input_recording.latch, input_recording.count);
+    }
+    else if (input_recording.mode == INPUT_RECORDING_REPLAY)
+    {
+        VirtualFree(input_recording.events, 0, MEM_RELEASE);
+        input_recording.events = NULL;
+
+        Logf("Input replay stopped after %d latches", LL_INFO, input_recording.latch);
+    }
+
+    input_recording.mode = INPUT_RECORDING_OFF;
+}
+
+void latch_recorded_input(CONTROLLER *state)
+{
+    if (input_recording.mode == INPUT_RECORDING_RECORD)
+    {
+        if (input_recording.latch == 0 || state->bits != input_recording.buttons)
+        {
+            input_event_t event = {input_recording.latch, state->bits};
+            DWORD bytes_written;
+            WriteFile(input_recording.file, &event, sizeof(input_event_t), &bytes_written, NULL);
+            input_recording.buttons = state->bits;
+            input_recording.count++;
+        }
+    }
+    else
+    {
+        while (input_recording.next < input_recording.count && input_recording.events[input_recording.next].latch <= input_recording.latch)
+        {
+            input_recording.buttons = input_recording.events[input_recording.next].buttons;
+            input_recording.next++;
+        }
+        state->bits = input_recording.buttons;
+    }
+
+    input_recording.latch++;
+}
@@ -0,0 +1,54 @@
+#ifndef INPUT_RECORDING_H
+
+#define INPUT_RECORDING_H
+
+#include "Windows.h"
+#include <stdint.h>
+#include "controller.h"
+
+#define INPUT_RECORDING_MAGIC 0x524E5049 // "IPNR"
+#define INPUT_RECORDING_FILE "input.inr"
+
+typedef enum INPUT_RECORDING_MODE
+{
+    INPUT_RECORDING_OFF,
+    INPUT_RECORDING_RECORD, // The buttons latched by the game are written to the file
+    INPUT_RECORDING_REPLAY, // The buttons latched by the game are taken from the file instead of the keyboard
+} INPUT_RECORDING_MODE;
+
+// The file is this header followed by the events
+typedef struct input_recording_header_t
+{
+    uint32_t magic;
+    uint32_t count; // Number of events
+} input_recording_header_t;
+
+// The buttons latched from this latch on, until the next event
+typedef struct input_event_t
+{
+    uint32_t latch; // Number of times the game latched the controller before this one
+    uint8_t buttons;
+    uint8_t reserved[3];
+} input_event_t;
+
+typedef struct input_recording_t
+{
+    INPUT_RECORDING_MODE mode;
+    HANDLE file;
+    uint32_t latch; // Number of latches since the recording or replay started
+    uint8_t buttons;
+
+    // The events being replayed, and the next one to be used
+    input_event_t *events;
+    uint32_t count;
+    uint32_t next;
+} input_recording_t;
+
+extern input_recording_t input_recording;
+
+BOOL start_input_recording(LPCSTR filename);
+BOOL start_input_replay(LPCSTR filename);
+void stop_input_recording();
+void latch_recorded_input(CONTROLLER *state);
+
+#endif
@@ -94,6 +94,30 @@ LOAD_STATUS loadNESFile(HANDLE hfile)
             Log("Illegal character rom size", LL_WARNING);
         }
         
+        select_mapper(header.mapper_number);
+
+        // The 8KB of CHR memory is mapped directly, and the nametables are fixed by the header
+        for (uint8_t page = 0; page < PATTERN_PAGE_COUNT; page++)
+        {
+            map_ppu_page(page, ppu_memory + page * PPU_PAGE_SIZE);
+        }
+        set_nametable_mirroring(header.ignore_mirroring_control ? FOUR_SCREEN : header.mirroring);
+        
+        return SUCCESS;
+    }
+    else
+    {
+        Logf("Mapper not implemented: %d", LL_ERROR, header.mapper_number);
+        return FAILED;
+    }
+
+    return FAILED;
+}
+
+BOOL select_mapper(uint16_t mapper_number)
+{
+    if (mapper_number == 0)
+    {
         mapper.read_memory = &mapper0_read_memory;
         mapper.write_memory = &mapper0_write_memory;
         mapper.get_memory_pointer = &mapper0_get_memory_pointer;
@@ -103,16 +127,10 @@ LOAD_STATUS loadNESFile(HANDLE hfile)
         mapper.ppu_write_memory = &mapper0_ppu_write;
         mapper.oam_read = &mapper0_oam_read;
         mapper.oam_write = &mapper0_oam_write;
-        
-        return SUCCESS;
-    }
-    else
-    {
-        Logf("Mapper not implemented: %d", LL_ERROR, header.mapper_number);
-        return FAILED;
+        return TRUE;
     }
 
-    return FAILED;
+    return FALSE;
 }
 
 void logINESHeader()
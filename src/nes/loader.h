@@ -35,6 +35,9 @@ typedef enum MIRRORING
 {
     HORIZONTAL = 0,
     VERTICAL = 1,
+    SINGLE_SCREEN_LOW,  // Set by mappers controlling the mirroring
+    SINGLE_SCREEN_HIGH, // Set by mappers controlling the mirroring
+    FOUR_SCREEN,        // The cartridge has 2KB of extra VRAM, used when the header ignores the mirroring bit
 } MIRRORING;
 
 typedef enum TV_SYSTEM
@@ -87,6 +90,7 @@ extern uint8_t *cartrage;
 extern mapper_t mapper;
 
 LOAD_STATUS loadNESFile(HANDLE hfile);
+BOOL select_mapper(uint16_t mapper_number); // Sets the mapper functions, without loading any memory
 void logINESHeader();
 
 #endif
\ No newline at end of file
@@ -50,32 +50,7 @@ uint8_t mapper0_read_memory(uint16_t address)
     */
     else if (address < PPU_REGISTER_ADDRESS + PPU_REGISTER_SIZE)
     {
-        address = PPU_REGISTER_ADDRESS + (address % 0x0008);
-
-        switch (address)
-        {
-        case PPU_CTRL_ADDRESS:
-            Log("Illegal read of PPU Ctrl register", LL_WARNING);
-            return ppu_state.ctrl; // Write only
-        case PPU_MASK_ADDRESS:
-            Log("Illegal read of PPU Mask register", LL_WARNING);
-            return ppu_state.mask; // Write only
-        case PPU_STATUS_ADDRESS:
-            return ppu_state.status; // Read only
-        case OAM_ADDR_ADDRESS:
-            Log("Illegal read of PPU OAM register", LL_WARNING);
-            return ppu_state.oamaddr; // Write only
-        case OAM_DATA_ADDRESS:
-            return ppu_state.oamdata; // Read / Write
-        case PPU_SCROLL_ADDRESS:
-            Log("Illegal read of PPU Scroll register", LL_WARNING);
-            return ppu_state.scroll; // Write only x2
-        case PPU_ADDR_ADDRESS:
-            Log("Illegal read of PPU Addr register", LL_WARNING);
-            return ppu_state.ppuaddr; // Write only x2
-        case PPU_DATA_ADDRESS:
-            return ppu_state.ppudata; // Read / Write
-        }
+        return ppu_read_register(PPU_REGISTER_ADDRESS + (address % 0x0008));
     }
 
     /*
@@ -169,37 +144,7 @@ void mapper0_write_memory(uint16_t address, uint8_t value)
     */
     else if (address < PPU_REGISTER_ADDRESS + PPU_REGISTER_SIZE)
     {
-        address = PPU_REGISTER_ADDRESS + (address % 0x0008);
-        switch (address)
-        {
-        case PPU_CTRL_ADDRESS:
-            ppu_state.ctrl = value; // Write only
-            break;
-        case PPU_MASK_ADDRESS:
-            ppu_state.mask = value; // Write only
-            break;
-        case PPU_STATUS_ADDRESS:
-            ppu_state.status = value; // Read only
-            Log("Illegal write to PPU Status register", LL_WARNING);
-            break;
-        case OAM_ADDR_ADDRESS:
-            ppu_state.oamaddr = value; // Write only
-            break;
-        case OAM_DATA_ADDRESS:
-            ppu_state.oamdata = value; // Read / Write
-            break;
-        case PPU_SCROLL_ADDRESS:
-            ppu_state.scroll = value; // Write only x2
-            break;
-        case PPU_ADDR_ADDRESS:
-            ppu_state.ppuaddr = value; // Write only x2
-            ppu_state.ppuaddr_written = TRUE;
-            break;
-        case PPU_DATA_ADDRESS:
-            ppu_state.ppudata = value; // Read / Write
-            ppu_state.ppudata_written = TRUE;
-            break;
-        }
+        ppu_write_register(PPU_REGISTER_ADDRESS + (address % 0x0008), value);
     }
 
     /*
@@ -362,28 +307,21 @@ uint8_t *mapper0_get_memory_pointer(uint16_t address)
 
 void mapper0_write_to_pointer(uint8_t *ptr, uint8_t value)
 {
+    // The PPU registers are handled by the ppu
+    if (ptr >= &ppu_state.ctrl && ptr <= &ppu_state.ppudata)
+    {
+        ppu_write_register(PPU_REGISTER_ADDRESS + (ptr - &ppu_state.ctrl), value);
+        return;
+    }
+
     // Assign the vlaue
     *ptr = value;
 
     // Handle the special cases
-    if (ptr == &ppu_state.ppuaddr)
-    {
-        ppu_state.ppuaddr_written = TRUE;
-    }
-    else if (ptr == &ppu_state.ppudata)
-    {
-        ppu_state.ppudata_written = TRUE;
-    }
-    else if (ptr == &ppu_state.oamdma)
+    if (ptr == &ppu_state.oamdma)
     {
         perform_oam_dma(value);
     }
-    else if (ptr == &ppu_state.oamaddr)
-    {
-    }
-    else if (ptr == &ppu_state.oamdata)
-    {
-    }
     else if (ptr == &cpu_memory[CONTROLLER_PORT1])
     {
         Log("Controller write 2", LL_DEBUG);
@@ -394,7 +332,11 @@ void mapper0_write_to_pointer(uint8_t *ptr, uint8_t value)
 uint8_t mapper0_read_pointer(uint8_t *ptr)
 {
     // Handle the special cases
-    if (ptr == &cpu_memory[CONTROLLER_PORT1])
+    if (ptr >= &ppu_state.ctrl && ptr <= &ppu_state.ppudata)
+    {
+        return ppu_read_register(PPU_REGISTER_ADDRESS + (ptr - &ppu_state.ctrl));
+    }
+    else if (ptr == &cpu_memory[CONTROLLER_PORT1])
     {
         Log("Controller read 4", LL_DEBUG);
         return read_controller(CONTROLLER_PORT1);
@@ -405,31 +347,42 @@ uint8_t mapper0_read_pointer(uint8_t *ptr)
 
 uint8_t mapper0_ppu_read(uint16_t address)
 {
+    address &= PPU_MEMORY_SIZE - 1;
 
-    if (address >= 0x3000 && address <= 0x3EFF)
-    {
-        address -= 0x1000;
-    }
-    else if (address >= 0x3F20 && address <= 0x3FFF)
+    if (address >= PALETTE_ADDRESS)
     {
-        address = 0x3F00 | (address % 0x20);
+        return ppu_memory[PALETTE_ADDRESS + PALETTE_INDEX(address)];
     }
 
-    return ppu_memory[address];
+    // The pattern tables and the mirrored nametables are mapped in the page table
+    return PPU_PAGE_BYTE(address);
 }
 
 void mapper0_ppu_write(uint16_t address, uint8_t value)
 {
-    if (address >= 0x3000 && address <= 0x3EFF)
+    address &= PPU_MEMORY_SIZE - 1;
+
+    uint8_t *byte;
+    if (address >= PALETTE_ADDRESS)
     {
-        address -= 0x1000;
+        byte = &ppu_memory[PALETTE_ADDRESS + PALETTE_INDEX(address)];
+        ppu_state.palette_dirty = TRUE;
     }
-    else if (address >= 0x3F20 && address <= 0x3FFF)
+    else
     {
-        address = 0x3F00 | (address % 0x20);
+        byte = &PPU_PAGE_BYTE(address);
     }
 
-    ppu_memory[address] = value;
+    if (*byte != value)
+    {
+        *byte = value;
+        mark_ppu_dirty();
+
+        if (address < PALETTE_ADDRESS)
+        {
+            mark_background_dirty(address);
+        }
+    }
 }
 
 uint8_t mapper0_oam_read(uint8_t address)
@@ -439,7 +392,13 @@ uint8_t mapper0_oam_read(uint8_t address)
 
 void mapper0_oam_write(uint8_t address, uint8_t value)
 {
+    if (oam_memory[address] != value)
+    {
+        mark_ppu_dirty();
+    }
+
     oam_memory[address] = value;
+    oam_shadow[address & 0b11][address >> 2] = value;
 }
 
 #endif // MAPPER0_H
\ No newline at end of file
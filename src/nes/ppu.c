@@ -1,14 +1,37 @@
 #include <stdint.h>
+#include <string.h>
+#include <emmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "../main.h"
 #include "ppu.h"
 #include "cpu.h"
 #include "loader.h"
+#include "ppu_pipeline.h"
+#include "ppu_capture.h"
 #include "../logger.h"
+#include "../swapchain.h"
+#include "../videocapture.h"
+#include "../eventtrace.h"
 
 uint8_t ppu_memory[PPU_MEMORY_SIZE];
+
+// Pointer to the memory of each 1KB page of the ppu address space, set by the mapper and the nametable mirroring
+// Until a cartridge is loaded every page is mapped to its own address
+uint8_t *ppu_pages[PPU_PAGE_COUNT] =
+{
+    ppu_memory + 0x0000, ppu_memory + 0x0400, ppu_memory + 0x0800, ppu_memory + 0x0C00,
+    ppu_memory + 0x1000, ppu_memory + 0x1400, ppu_memory + 0x1800, ppu_memory + 0x1C00,
+    ppu_memory + 0x2000, ppu_memory + 0x2400, ppu_memory + 0x2800, ppu_memory + 0x2C00,
+    ppu_memory + 0x2000, ppu_memory + 0x2400, ppu_memory + 0x2800, ppu_memory + 0x2C00,
+};
 uint8_t oam_memory[OAM_SIZE];
 uint8_t oam2_memory[OAM2_SIZE];
 
+// Structure-of-arrays copy of the OAM (Y, tile, attribute and X rows) used for evaluating all sprites at once
+uint8_t oam_shadow[4][OAM_SPRITE_COUNT];
+
 ppu_state_t ppu_state;
 
 uint8_t nes_palette[] =
@@ -79,6 +102,27 @@ uint8_t nes_palette[] =
     0x00, 0x00, 0x00,
   };
 
+// The nes palette with each of the 8 combinations of the PPUMASK color emphasis bits applied
+PIXEL32 emphasis_palettes[EMPHASIS_COUNT][NES_COLOR_COUNT];
+
+// Maps each byte of the palette RAM (0x3F00 -> 0x3F1F) to the pixel value written to the backbuffer
+PIXEL32 palette_lut[PALETTE_SIZE];
+// Maps each byte of the palette RAM to the 6-bit nes color written to the indexed frame (grayscale applied)
+uint8_t palette_color_lut[PALETTE_SIZE];
+
+PPU_OUTPUT ppu_output = PPU_OUTPUT_BGRA;
+
+// In the indexed output mode, each pixel is one byte holding the nes color (row by row from the top)
+// The emphasis bits can not fit next to the color, and are stored once per scanline instead
+uint8_t indexed_frame[NES_PX_HEIGHT * NES_PX_WIDTH];
+uint8_t indexed_frame_emphasis[NES_PX_HEIGHT];
+
+// All four nametables drawn as palette RAM indices (0 for transparent pixels)
+// Tiles are only drawn again when they are changed, each scanline is then a copy from the plane at the scroll position
+uint8_t background_plane[BACKGROUND_PLANE_HEIGHT][BACKGROUND_PLANE_WIDTH];
+// One bit per tile of the background plane which has to be drawn again
+uint64_t background_tile_dirty[BACKGROUND_PLANE_TILES_Y];
+
 void ppu_power_up()
 {
     ppu_state.cycle = 0;
@@ -93,13 +137,23 @@ void ppu_power_up()
     ppu_state.ppudata = 0;
     ppu_state.oamdma = 0;
 
-    ppu_state.ppuaddr_latch = 0;
-    ppu_state.internal_ppu_addr = 0;
-    ppu_state.ppuaddr_written = FALSE;
-    ppu_state.ppudata_written = FALSE;
-    ppu_state.ppuaddr_high = TRUE;
+    ppu_state.v = 0;
+    ppu_state.t = 0;
+    ppu_state.fine_x = 0;
+    ppu_state.w = FALSE;
+    ppu_state.read_buffer = 0;
+    ppu_state.sprite0_hit_cycle = NO_PPU_EVENT;
+    ppu_state.sprite0_evaluated = FALSE;
+    ppu_state.status_poll_pc = 0;
+    ppu_state.status_poll_cycle = 0;
     ppu_state.frame_counter = 0;
     ppu_state.num_sprites = 0;
+    memset(ppu_state.scanline_scroll, 0xFF, sizeof(ppu_state.scanline_scroll));
+
+    build_emphasis_palettes();
+    ppu_state.palette_dirty = TRUE;
+    mark_ppu_dirty();
+    mark_background_dirty(0x0000);
 
     Log("PPU powered up", LL_INFO);
 }
@@ -107,6 +161,7 @@ void ppu_power_up()
 void perform_next_ppu_cycle()
 {
     uint16_t cycle = ppu_state.cycle % 341; // The cycle is 0 - 340 [including]
+    BOOL rendering_enabled = (SPRITE_ENABLE_BIT | BC_ENABLE_BIT) & ppu_state.mask;
 
     if (ppu_state.scanline < 240)
     {
@@ -117,167 +172,76 @@ void perform_next_ppu_cycle()
             return;
         }
 
-        if (cycle > 0 && cycle <= 256)
+        // Find the dot where sprite 0 hits the background on this scanline, if it does
+        if (cycle == 1)
         {
-            uint16_t nametable_base_addr;
-            switch (ppu_state.ctrl & NAMETABLE_BITS)
+            if (rendering_enabled)
             {
-            case 0:
-                nametable_base_addr = 0x2000;
-                break;
-            case 1:
-                nametable_base_addr = 0x2400;
-                break;
-            case 2:
-                nametable_base_addr = 0x2800;
-                break;
-            case 3:
-                nametable_base_addr = 0x2C00;
-                break;
+                schedule_sprite0_hit();
+            }
+        }
+        // The whole scanline is drawn at once at the end of the visible cycles
+        else if (cycle == 256)
+        {
+            // Games write the scroll registers every frame, often only to set them to what they were,
+            // so the frame is only dirty when a scanline is drawn with another scroll than in the last frame
+            uint32_t scroll = rendering_enabled ? ppu_state.v | (ppu_state.fine_x << 15) : SCANLINE_SCROLL_DISABLED;
+            if (scroll != ppu_state.scanline_scroll[ppu_state.scanline])
+            {
+                ppu_state.scanline_scroll[ppu_state.scanline] = scroll;
+                mark_ppu_dirty();
             }
 
-
-            // These are the tiles in the nametable
-            uint8_t tile_x = (cycle - 1) / 8;
-            uint8_t tile_y = ppu_state.scanline / 8;
-
-            // These are the pixel offsets within the tiles
-            uint8_t tile_offset_y = ppu_state.scanline % 8;
-
-            // Nametable byte
-            ppu_state.nametable_byte = mapper.ppu_read_memory(nametable_base_addr + tile_y * 32 + tile_x);
-            // Base address for the pattern table
-            uint16_t background_table_addr = ppu_state.ctrl & BC_TILESELECT_BIT ? 0x1000 : 0x0000;
-            // Pattern table low byte
-            ppu_state.low_pattern_byte = mapper.ppu_read_memory(background_table_addr + ppu_state.nametable_byte * 16 + tile_offset_y);
-            // Pattern table high byte
-            ppu_state.high_pattern_byte = mapper.ppu_read_memory(background_table_addr + ppu_state.nametable_byte * 16 + 8 + tile_offset_y);
-
-            for (uint8_t tile_offset_x = 0; tile_offset_x < 8; tile_offset_x++)
+            // Nothing affecting the output has changed since the last drawn frame, so the pixels from it are kept
+            if (ppu_state.dirty_frames && ppu_output != PPU_OUTPUT_NONE)
             {
-                uint8_t color = 0;
+                render_scanline();
+            }
 
-                // Draw background
-                if (BC_ENABLE_BIT & ppu_state.mask)
+            // Move v to the next row of pixels
+            if (rendering_enabled)
+            {
+                if ((ppu_state.v & FINE_Y_BITS) != FINE_Y_BITS)
                 {
-                    // Every whole tile is within the same attribute area
-                    // TODO: this might change when scroll comes into play
-                    uint8_t attribute_x = (cycle - 1 + tile_offset_x) / 32;
-                    uint8_t attribute_y = ppu_state.scanline / 32;
-                    ppu_state.attribute_byte = mapper.ppu_read_memory(nametable_base_addr + NAMETABLE_ATTRIBUTE_OFFSET + attribute_x + attribute_y * 8);
-
-
-                    uint8_t attribute_offset_x = (cycle - 1 + tile_offset_x) & 0b11111;
-                    uint8_t attribute_offset_y = ppu_state.scanline & 0xb11111;
-                    uint8_t offset = 7 - tile_offset_x;
-
-                    // The attribute area index of 32x32 area devided into four 16x16
-                    //  ----------------
-                    //  |  0   |   2   |
-                    //  ----------------
-                    //  |  4   |   6   |
-                    //  ----------------
-                    // Index of 2-bit areas in the attribute byte
-                    uint8_t attribute_area_index = ((attribute_offset_x >> 4) << 1) + ((attribute_offset_y >> 4) << 2);
-                    // Index of the color palette to use
-                    uint8_t color_palette_index = (ppu_state.attribute_byte >> attribute_area_index) & 0b11;
-                    // Index into the palette (which of the four colors to use)
-                    uint8_t color_index = (((ppu_state.high_pattern_byte >> offset) & 1) << 1) + ((ppu_state.low_pattern_byte >> offset) & 1);
-
-                    // Index in the nes-palette
-                    color = mapper.ppu_read_memory(PALETTE_ADDRESS + color_palette_index * 4 + color_index);
+                    ppu_state.v += 0x1000;
                 }
-
-                // Draw sprites
-                if (SPRITE_ENABLE_BIT & ppu_state.mask)
+                else
                 {
-                    for (uint8_t i = 0; i < ppu_state.num_sprites; i++)
+                    ppu_state.v &= ~FINE_Y_BITS;
+                    uint8_t coarse_y = (ppu_state.v & COARSE_Y_BITS) >> 5;
+                    if (coarse_y == NAME_TABLE_TILES_Y - 1)
                     {
-                        // Each sprite takes four bytes
-                        // Byte 0: Y position
-                        // Byte 1: Tile index number
-                        // Byte 2: Attributes
-                        // Byte 3: X position
-
-                        uint8_t vpos = oam2_memory[i * 4 + 0];
-                        uint8_t tile_index = oam2_memory[i * 4 + 1];
-                        uint8_t attribute = oam2_memory[i * 4 + 2];
-                        uint8_t hpos = oam2_memory[i * 4 + 3];
-
-                        int16_t offset_y = ppu_state.scanline - vpos;
-                        int16_t offset_x = (cycle - 1) + tile_offset_x - hpos;
-
-                        if (offset_x >= 0 && offset_x < 8)
-                        {
-                            uint8_t tile_bank;
-                            // In the case of 8x16 sprite size use the pattern table from the tile index
-                            if (ppu_state.ctrl & SPRITE_HIGHT_BIT)
-                            {
-                                tile_bank = tile_index & OAM_TILE_BANK_BIT;
-                            }
-                            // In 8x8 sprite mode use the sprite pattern table from the ctrl register
-                            else
-                            {
-                                tile_bank = (ppu_state.ctrl & SPRITE_PT_ADDRESS_BIT) >> 3;
-                            }
-
-                            uint16_t tile_addr = (tile_bank << 12) + 16 * (tile_index); // TODO: tile_indez >> 1 in the case of 8x16
-
-                            if (!(attribute & FLIP_H_BIT))
-                                offset_x = 7 - offset_x;
-
-                            if (attribute & FLIP_V_BIT)
-                                offset_y = 7 - offset_y;
-
-                            uint8_t pattern_low_byte = mapper.ppu_read_memory(tile_addr + 0 + offset_y);
-                            uint8_t pattern_high_byte = mapper.ppu_read_memory(tile_addr + 8 + offset_y);
-
-                            uint8_t palette = attribute & PALETTE_BITS;
-                            uint8_t color_index = (((pattern_high_byte >> offset_x) & 1) << 1) + ((pattern_low_byte >> offset_x) & 1);
-
-                            // Do not change the color for transparent pixels
-                            if (color_index != 0)
-                            {
-                                color = mapper.ppu_read_memory(PALETTE_ADDRESS + 0x10 + palette * 4 + color_index);
-                            }
-                        }
+                        coarse_y = 0;
+                        ppu_state.v ^= NAMETABLE_Y_BIT;
                     }
+                    // Row 30 and 31 are the attribute table, which wraps without switching nametable
+                    else if (coarse_y == 31)
+                    {
+                        coarse_y = 0;
+                    }
+                    else
+                    {
+                        coarse_y++;
+                    }
+                    ppu_state.v = (ppu_state.v & ~COARSE_Y_BITS) | (coarse_y << 5);
                 }
-
-                uint8_t r = nes_palette[color * 3 + 0];
-                uint8_t g = nes_palette[color * 3 + 1];
-                uint8_t b = nes_palette[color * 3 + 2];
-
-                set_px(cycle + tile_offset_x - 1, ppu_state.scanline, r, g, b);
             }
-
-            ppu_state.cycle += 7;
         }
         // Load sprite data of the next scanline into the secondary oam
-        else if (cycle >= 257 && cycle <= 320)
+        // All 64 sprites are evaluated at once on the first cycle, the remaining cycles are idle
+        else if (cycle == 257)
         {
-            // Reset the sprite count
-            if (cycle == 257)
-                ppu_state.num_sprites = 0;
-
-            if (ppu_state.num_sprites < 8)
+            // Reset the horizontal position to the left edge of the screen
+            if (rendering_enabled)
             {
-                // Each sprite takes four bytes, and the sprites are loaded for the next scanline
-                // A maximum of 8 sprites can be loaded into the secondary oam for each scanline
-                uint16_t next_scanline = ppu_state.scanline;
-                uint8_t candidate_index = (cycle - 257) * 4;
-                uint8_t vpos = mapper.oam_read(candidate_index);
-                int16_t vdelta = next_scanline - vpos;
-                if (vdelta >= 0 && vdelta < 8)
-                {
-                    oam2_memory[ppu_state.num_sprites * 4 + 0] = oam_memory[candidate_index + 0] + 1; // pushing the sprites 1 pixel down
-                    oam2_memory[ppu_state.num_sprites * 4 + 1] = oam_memory[candidate_index + 1];
-                    oam2_memory[ppu_state.num_sprites * 4 + 2] = oam_memory[candidate_index + 2];
-                    oam2_memory[ppu_state.num_sprites * 4 + 3] = oam_memory[candidate_index + 3];
-                    ppu_state.num_sprites++;
-                }
-
-                // TODO might need to set the sprite overflow flag
+                evaluate_sprites(ppu_state.scanline);
+                ppu_state.v = (ppu_state.v & ~HORIZONTAL_SCROLL_BITS) | (ppu_state.t & HORIZONTAL_SCROLL_BITS);
+            }
+            // No sprites are evaluated while rendering is disabled
+            else
+            {
+                ppu_state.num_sprites = 0;
+                ppu_state.sprite0_evaluated = FALSE;
             }
         }
     }
@@ -287,28 +251,63 @@ void perform_next_ppu_cycle()
     }
     else // Scanline <= 261
     {
+        // Each frame of a capture starts on the first cycle of the pre-render scanline
+        if (ppu_capture.enabled && ppu_state.scanline == 261 && cycle == 0)
+        {
+            capture_ppu_frame();
+        }
+
         // Generate NMI and set VBLANK flag if NMI generation is enabled
         if (ppu_state.scanline == 241 && cycle == 1)
         {
             ppu_state.status |= VBLANK;
-            if (ppu_state.ctrl & NMI_ENABLE_BIT)
+            TraceInstant(ppu_pipeline.enabled ? TRACE_STREAM_RENDER : TRACE_STREAM_EMULATION, TRACE_VBLANK, ppu_state.frame_counter);
+            // The pipelined cpu generates its own NMIs, as the render thread is behind
+            if (ppu_state.ctrl & NMI_ENABLE_BIT && !ppu_pipeline.enabled)
             {
                 cpu.nmi_requested = TRUE;
             }
+
+            if (ppu_state.dirty_frames)
+            {
+                ppu_state.dirty_frames--;
+            }
+
+            // The video capture records every frame, repeating the last one drawn when nothing was
+            if (videoCapture.Enabled)
+            {
+                CaptureVideoFrame();
+            }
+
+            // The frame is complete, and is handed over to be presented if anything was drawn
+            if (ppu_state.frame_updated)
+            {
+                PublishFrame();
+                ppu_state.frame_updated = FALSE;
+            }
+        }
+        // The pre-render scanline copies the vertical position to start the frame from the top (cycle 280 - 304)
+        else if (ppu_state.scanline == 261 && cycle == 280 && rendering_enabled)
+        {
+            ppu_state.v = (ppu_state.v & ~VERTICAL_SCROLL_BITS) | (ppu_state.t & VERTICAL_SCROLL_BITS);
         }
     }
 
-    // Only read and write from VRAM during VBLANK or when rendering is disabled
-    if (ppu_state.status & VBLANK || !((SPRITE_ENABLE_BIT | BC_ENABLE_BIT) & ppu_state.mask))
+    // The pre-render scanline resets VBLANK and the sprite flags
+    // No sprites are evaluated for the first scanline, so none are drawn on it
+    if (ppu_state.scanline == 261 && cycle == 1)
     {
-        handle_cpu_vram_reading();
+        ppu_state.status &= ~(VBLANK | SPRITE_0 | SPRITE_OVERFLOW);
+        ppu_state.num_sprites = 0;
+        ppu_state.sprite0_evaluated = FALSE;
+        ppu_state.frame_counter++;
     }
 
-    // Reset the scanline number and VBLANK
-    if (ppu_state.scanline == 260 && cycle == 1)
+    // The sprite 0 hit scheduled at the start of the scanline is reached
+    if (ppu_state.cycle >= ppu_state.sprite0_hit_cycle)
     {
-        ppu_state.status &= ~VBLANK;
-        ppu_state.frame_counter++;
+        ppu_state.status |= SPRITE_0;
+        ppu_state.sprite0_hit_cycle = NO_PPU_EVENT;
     }
 
     ppu_state.cycle++;
@@ -319,48 +318,717 @@ void perform_next_ppu_cycle()
     }
 }
 
-void set_px(uint8_t x, uint8_t y, uint8_t r, uint8_t g, uint8_t b)
+void render_scanline()
+{
+    ppu_state.frame_updated = TRUE;
+
+    if (ppu_state.palette_dirty || (ppu_state.mask & (BRG_BITS | GRAYSCALE_BIT)) != ppu_state.palette_mask)
+    {
+        rebuild_palette_lut();
+    }
+
+    indexed_frame_emphasis[ppu_state.scanline] = (ppu_state.mask & BRG_BITS) >> 5;
+
+    // Palette RAM index of each pixel in the scanline
+    uint8_t line[NES_PX_WIDTH];
+
+    // Draw background
+    if (BC_ENABLE_BIT & ppu_state.mask)
+    {
+        copy_background_line(line);
+    }
+    else
+    {
+        memset(line, 0, NES_PX_WIDTH);
+    }
+
+    // Draw sprites
+    if (SPRITE_ENABLE_BIT & ppu_state.mask)
+    {
+        for (uint8_t i = 0; i < ppu_state.num_sprites; i++)
+        {
+            // Each sprite takes four bytes
+            // Byte 0: Y position
+            // Byte 1: Tile index number
+            // Byte 2: Attributes
+            // Byte 3: X position
+
+            uint8_t attribute = oam2_memory[i * 4 + OAM_ATTRIBUTE];
+            uint8_t hpos = oam2_memory[i * 4 + OAM_X];
+
+            uint8_t pattern_low_byte, pattern_high_byte;
+            fetch_sprite_pattern(i, &pattern_low_byte, &pattern_high_byte);
+            uint8_t palette = attribute & PALETTE_BITS;
+
+            for (uint8_t offset_x = 0; offset_x < 8 && hpos + offset_x < NES_PX_WIDTH; offset_x++)
+            {
+                uint8_t bit = attribute & FLIP_H_BIT ? offset_x : 7 - offset_x;
+                uint8_t color_index = (((pattern_high_byte >> bit) & 1) << 1) + ((pattern_low_byte >> bit) & 1);
+
+                // Do not change the color for transparent pixels
+                if (color_index != 0)
+                {
+                    line[hpos + offset_x] = SPRITE_PALETTE_OFFSET + palette * 4 + color_index;
+                }
+            }
+        }
+    }
+
+    if (ppu_output == PPU_OUTPUT_INDEXED)
+    {
+        uint8_t *row = &indexed_frame[ppu_state.scanline * NES_PX_WIDTH];
+        for (uint16_t x = 0; x < NES_PX_WIDTH; x++)
+        {
+            row[x] = palette_color_lut[line[x]];
+        }
+    }
+    else
+    {
+        for (uint16_t x = 0; x < NES_PX_WIDTH; x++)
+        {
+            set_px(x, ppu_state.scanline, palette_lut[line[x]]);
+        }
+    }
+}
+
+void copy_background_line(uint8_t *line)
+{
+    if (ppu_state.background_dirty)
+    {
+        refresh_background_plane();
+    }
+
+    // The position in the plane of the first pixel, given by the scroll position in v and fine x
+    uint16_t plane_x = ((ppu_state.v & NAMETABLE_X_BIT) ? NES_PX_WIDTH : 0) + (ppu_state.v & COARSE_X_BITS) * 8 + ppu_state.fine_x;
+    uint16_t plane_y = ((ppu_state.v & NAMETABLE_Y_BIT) ? NES_PX_HEIGHT : 0) + ((ppu_state.v & COARSE_Y_BITS) >> 5) * 8 + ((ppu_state.v & FINE_Y_BITS) >> 12);
+    plane_y %= BACKGROUND_PLANE_HEIGHT;
+
+    // The scanline wraps around to the left side of the plane
+    uint16_t first_part = BACKGROUND_PLANE_WIDTH - plane_x < NES_PX_WIDTH ? BACKGROUND_PLANE_WIDTH - plane_x : NES_PX_WIDTH;
+    memcpy(line, &background_plane[plane_y][plane_x], first_part);
+    memcpy(line + first_part, &background_plane[plane_y][0], NES_PX_WIDTH - first_part);
+}
+
+void fetch_sprite_pattern(uint8_t i, uint8_t *low, uint8_t *high)
+{
+    uint8_t vpos = oam2_memory[i * 4 + OAM_Y];
+    uint8_t tile_index = oam2_memory[i * 4 + OAM_TILE];
+    uint8_t attribute = oam2_memory[i * 4 + OAM_ATTRIBUTE];
+
+    int16_t offset_y = ppu_state.scanline - vpos;
+
+    uint8_t tile_bank;
+    // In the case of 8x16 sprite size use the pattern table from the tile index
+    if (ppu_state.ctrl & SPRITE_HIGHT_BIT)
+    {
+        tile_bank = tile_index & OAM_TILE_BANK_BIT;
+
+        if (attribute & FLIP_V_BIT)
+            offset_y = 15 - offset_y;
+
+        // The top half uses the even tile and the bottom half the following odd tile
+        tile_index = (tile_index & ~OAM_TILE_BANK_BIT) + (offset_y >> 3);
+        offset_y &= 0b111;
+    }
+    // In 8x8 sprite mode use the sprite pattern table from the ctrl register
+    else
+    {
+        tile_bank = (ppu_state.ctrl & SPRITE_PT_ADDRESS_BIT) >> 3;
+
+        if (attribute & FLIP_V_BIT)
+            offset_y = 7 - offset_y;
+    }
+
+    uint16_t tile_addr = (tile_bank << 12) + 16 * (tile_index);
+
+    *low = PPU_PAGE_BYTE(tile_addr + 0 + offset_y);
+    *high = PPU_PAGE_BYTE(tile_addr + 8 + offset_y);
+}
+
+void schedule_sprite0_hit()
 {
-    *((PIXEL32 *)(backBuffer.Memory) + (x + ((NES_PX_HEIGHT - y - 1) * NES_PX_WIDTH))) = (PIXEL32){b, g, r, 0};
+    ppu_state.sprite0_hit_cycle = NO_PPU_EVENT;
+
+    // Sprite 0 hits at most once per frame, and only when both the background and the sprites are drawn
+    if (!ppu_state.sprite0_evaluated || ppu_state.status & SPRITE_0 ||
+        (ppu_state.mask & (BC_ENABLE_BIT | SPRITE_ENABLE_BIT)) != (BC_ENABLE_BIT | SPRITE_ENABLE_BIT))
+    {
+        return;
+    }
+
+    uint8_t attribute = oam2_memory[OAM_ATTRIBUTE];
+    uint8_t hpos = oam2_memory[OAM_X];
+
+    uint8_t pattern_low_byte, pattern_high_byte;
+    fetch_sprite_pattern(0, &pattern_low_byte, &pattern_high_byte);
+    uint8_t opaque = pattern_low_byte | pattern_high_byte;
+
+    // Bit i of the masks is the pixel at x = hpos + i
+    uint8_t sprite_mask = 0;
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        sprite_mask |= ((opaque >> (attribute & FLIP_H_BIT ? i : 7 - i)) & 1) << i;
+    }
+
+    if (!sprite_mask)
+    {
+        return;
+    }
+
+    // The line is padded with transparent pixels for sprites at the right edge
+    uint8_t line[NES_PX_WIDTH + 8] = {0};
+    copy_background_line(line);
+
+    __m128i pixels = _mm_loadl_epi64((__m128i *)&line[hpos]);
+    uint8_t background_mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(pixels, _mm_setzero_si128()));
+
+    uint8_t hit_mask = sprite_mask & background_mask;
+
+    // There is no hit at x = 255, or on the left 8 pixels if either of them are clipped
+    if (hpos > NES_PX_WIDTH - 9)
+    {
+        hit_mask &= 0xFF >> (hpos - (NES_PX_WIDTH - 9));
+    }
+    if ((ppu_state.mask & (BC_LC_ENABLE_BITS | SPRITE_LC_ENABLE_BIT)) != (BC_LC_ENABLE_BITS | SPRITE_LC_ENABLE_BIT) && hpos < 8)
+    {
+        hit_mask &= 0xFF << (8 - hpos);
+    }
+
+    // Pixel x is output on dot x + 1, and this is called on dot 1
+    if (hit_mask)
+    {
+        ppu_state.sprite0_hit_cycle = ppu_state.cycle + hpos + __builtin_ctz(hit_mask);
+    }
 }
 
-void handle_cpu_vram_reading()
+uint64_t next_status_change_cycle()
 {
-    // Handle PPU address writes
-    if (ppu_state.ppuaddr_written)
+    uint16_t cycle = ppu_state.cycle % 341;
+    uint64_t scanline_start = ppu_state.cycle - cycle;
+
+    // Until sprite 0 has hit, every visible scanline can be the one where it does (found when the scanline starts)
+    BOOL sprite0_pending = !(ppu_state.status & SPRITE_0) && (ppu_state.mask & (BC_ENABLE_BIT | SPRITE_ENABLE_BIT)) == (BC_ENABLE_BIT | SPRITE_ENABLE_BIT);
+    uint64_t next = ppu_state.sprite0_hit_cycle;
+
+    // The flags change on dot 1, VBLANK is set on scanline 241 and cleared on the pre-render scanline
+    for (uint16_t scanlines = 0; scanlines <= 262; scanlines++)
     {
-        if (ppu_state.ppuaddr_high)
+        uint16_t scanline = (ppu_state.scanline + scanlines) % 262;
+        uint64_t dot = scanline_start + scanlines * 341 + 1;
+
+        if (dot > ppu_state.cycle && (scanline == 241 || scanline == 261 || (sprite0_pending && scanline < NES_PX_HEIGHT)))
         {
-            ppu_state.ppuaddr_latch = ppu_state.ppuaddr;
-            ppu_state.ppuaddr_high = FALSE;
+            return dot < next ? dot : next;
         }
-        else
+    }
+
+    return next;
+}
+
+void ppu_write_register(uint16_t address, uint8_t value)
+{
+    // The render thread does the write when it reaches the same cycle
+    if (ppu_pipeline.enabled)
+    {
+        log_ppu_write(PPU_LOG_REGISTER, address, value);
+        return;
+    }
+
+    apply_ppu_register_write(address, value);
+}
+
+void apply_ppu_register_write(uint16_t address, uint8_t value)
+{
+    if (ppu_capture.enabled)
+    {
+        capture_ppu_access(PPU_LOG_REGISTER, address, value);
+    }
+
+    switch (address)
+    {
+    case PPU_CTRL_ADDRESS:
+        write_ppu_ctrl(value); // Write only
+        break;
+    case PPU_MASK_ADDRESS:
+        write_ppu_mask(value); // Write only
+        break;
+    case PPU_STATUS_ADDRESS:
+        ppu_state.status = value; // Read only
+        Log("Illegal write to PPU Status register", LL_WARNING);
+        break;
+    case OAM_ADDR_ADDRESS:
+        ppu_state.oamaddr = value; // Write only
+        break;
+    case OAM_DATA_ADDRESS:
+        write_oam_data(value); // Read / Write
+        break;
+    case PPU_SCROLL_ADDRESS:
+        write_ppu_scroll(value); // Write only x2
+        break;
+    case PPU_ADDR_ADDRESS:
+        write_ppu_addr(value); // Write only x2
+        break;
+    case PPU_DATA_ADDRESS:
+        write_ppu_data(value); // Read / Write
+        break;
+    }
+}
+
+uint8_t ppu_read_register(uint16_t address)
+{
+    // The values read depend on the rendering, so the render thread has to catch up with the cpu first
+    if (ppu_pipeline.enabled)
+    {
+        sync_ppu_pipeline();
+    }
+
+    // Reads change the state of the ppu as well (the write toggle, VBLANK and the read buffer)
+    if (ppu_capture.enabled)
+    {
+        capture_ppu_access(PPU_LOG_READ, address, 0);
+    }
+
+    switch (address)
+    {
+    case PPU_CTRL_ADDRESS:
+        Log("Illegal read of PPU Ctrl register", LL_WARNING);
+        return ppu_state.ctrl; // Write only
+    case PPU_MASK_ADDRESS:
+        Log("Illegal read of PPU Mask register", LL_WARNING);
+        return ppu_state.mask; // Write only
+    case PPU_STATUS_ADDRESS:
+        return read_ppu_status(); // Read only
+    case OAM_ADDR_ADDRESS:
+        Log("Illegal read of PPU OAM register", LL_WARNING);
+        return ppu_state.oamaddr; // Write only
+    case OAM_DATA_ADDRESS:
+        return read_oam_data(); // Read / Write
+    case PPU_SCROLL_ADDRESS:
+        Log("Illegal read of PPU Scroll register", LL_WARNING);
+        return ppu_state.scroll; // Write only x2
+    case PPU_ADDR_ADDRESS:
+        Log("Illegal read of PPU Addr register", LL_WARNING);
+        return ppu_state.ppuaddr; // Write only x2
+    default: // PPU_DATA_ADDRESS
+        return read_ppu_data(); // Read / Write
+    }
+}
+
+void write_ppu_ctrl(uint8_t value)
+{
+    if ((ppu_state.ctrl ^ value) & CTRL_OUTPUT_BITS)
+    {
+        mark_ppu_dirty();
+    }
+
+    // A different background pattern table changes every tile
+    if ((ppu_state.ctrl ^ value) & BC_TILESELECT_BIT)
+    {
+        mark_background_dirty(0x0000);
+    }
+
+    ppu_state.ctrl = value;
+    ppu_state.t = (ppu_state.t & ~(NAMETABLE_X_BIT | NAMETABLE_Y_BIT)) | ((value & NAMETABLE_BITS) << 10);
+}
+
+void write_ppu_mask(uint8_t value)
+{
+    if (ppu_state.mask != value)
+    {
+        mark_ppu_dirty();
+    }
+
+    ppu_state.mask = value;
+}
+
+void write_ppu_scroll(uint8_t value)
+{
+    ppu_state.scroll = value;
+
+    // The first write is the x scroll, the second write is the y scroll
+    if (!ppu_state.w)
+    {
+        ppu_state.t = (ppu_state.t & ~COARSE_X_BITS) | (value >> 3);
+        ppu_state.fine_x = value & 0b111;
+    }
+    else
+    {
+        ppu_state.t = (ppu_state.t & ~(COARSE_Y_BITS | FINE_Y_BITS)) | ((value & 0b11111000) << 2) | ((value & 0b111) << 12);
+    }
+
+    ppu_state.w = !ppu_state.w;
+}
+
+void write_ppu_addr(uint8_t value)
+{
+    ppu_state.ppuaddr = value;
+
+    // The first write is the upper byte (6 bits), the second write is the lower byte which also sets v
+    if (!ppu_state.w)
+    {
+        ppu_state.t = (ppu_state.t & 0x00FF) | ((value & 0b00111111) << 8);
+    }
+    else
+    {
+        ppu_state.t = (ppu_state.t & 0xFF00) | value;
+        ppu_state.v = ppu_state.t;
+    }
+
+    ppu_state.w = !ppu_state.w;
+}
+
+void write_ppu_data(uint8_t value)
+{
+    ppu_state.ppudata = value;
+    mapper.ppu_write_memory(ppu_state.v & 0x3FFF, value);
+    increment_ppu_addr();
+}
+
+void write_oam_data(uint8_t value)
+{
+    ppu_state.oamdata = value;
+    mapper.oam_write(ppu_state.oamaddr, value);
+    ppu_state.oamaddr++;
+}
+
+// The loop at the pc does nothing but read the status and branch back to the read,
+// so running it again changes nothing except the flags, which the read after the skip sets the same way
+static BOOL is_status_poll_loop(uint16_t pc)
+{
+    uint8_t opcode = mapper.read_memory(pc);
+    if ((opcode != STATUS_POLL_LDA_ABSOLUTE && opcode != STATUS_POLL_BIT_ABSOLUTE) ||
+        mapper.read_memory(pc + 1) != (PPU_STATUS_ADDRESS & 0xFF) || mapper.read_memory(pc + 2) != PPU_STATUS_ADDRESS >> 8)
+    {
+        return FALSE;
+    }
+
+    // Every branch opcode is xxx10000
+    return (mapper.read_memory(pc + 3) & 0x1F) == 0x10 && mapper.read_memory(pc + 4) == STATUS_POLL_BRANCH_OFFSET;
+}
+
+uint8_t read_ppu_status()
+{
+    uint8_t status = ppu_state.status;
+
+    // A loop only reading the same status again can only end when one of the flags changes
+    // Instead of running the loop until then, the cpu skips ahead to the first cycle after the next change
+    // Other loops reading the status, such as those counting their iterations, are run as they are
+    if (cpu.registers.pc == ppu_state.status_poll_pc && status == ppu_state.status_poll_value &&
+        cpu.cycle - ppu_state.status_poll_cycle <= STATUS_POLL_LOOP_CYCLES && is_status_poll_loop(cpu.registers.pc))
+    {
+        uint64_t cpu_cycle = (next_status_change_cycle() + 2) / 3;
+        if (cpu_cycle > cpu.cycle)
         {
-            // The ppuaddr register is already written when this is triggered
-            ppu_state.internal_ppu_addr = ((ppu_state.ppuaddr_latch << 8) | ppu_state.ppuaddr) & 0x3FFF;
-            ppu_state.ppuaddr_high = TRUE;
+            cpu.cycle = cpu_cycle;
         }
+    }
+
+    ppu_state.status_poll_pc = cpu.registers.pc;
+    ppu_state.status_poll_value = status;
+    ppu_state.status_poll_cycle = cpu.cycle;
+
+    // Reading the status clears the VBLANK flag and the write toggle
+    ppu_state.status &= ~VBLANK;
+    ppu_state.w = FALSE;
+
+    return status;
+}
+
+uint8_t read_ppu_data()
+{
+    uint16_t address = ppu_state.v & 0x3FFF;
+
+    if (address < PALETTE_ADDRESS)
+    {
+        ppu_state.ppudata = ppu_state.read_buffer;
+        ppu_state.read_buffer = mapper.ppu_read_memory(address);
+    }
+    // The palette is read directly, while the buffer is filled with the nametable byte "below" it
+    else
+    {
+        ppu_state.ppudata = mapper.ppu_read_memory(address);
+        ppu_state.read_buffer = mapper.ppu_read_memory(address - 0x1000);
+    }
+
+    increment_ppu_addr();
+    return ppu_state.ppudata;
+}
+
+uint8_t read_oam_data()
+{
+    ppu_state.oamdata = mapper.oam_read(ppu_state.oamaddr);
+    return ppu_state.oamdata;
+}
+
+void increment_ppu_addr()
+{
+    // If increment mode is set to 0, go across, if set to 1 go down (32)
+    ppu_state.v = (ppu_state.v + (ppu_state.ctrl & INC_MODE_BIT ? 32 : 1)) & 0x7FFF;
+}
 
-        ppu_state.ppuaddr_written = FALSE;
+void mark_background_dirty(uint16_t address)
+{
+    ppu_state.background_dirty = TRUE;
+
+    // The pattern tables are used by every tile
+    if (address < VRAM_ADDRESS)
+    {
+        memset(background_tile_dirty, 0xFF, sizeof(background_tile_dirty));
+        return;
     }
-    // Handle PPU data writes
-    else if (ppu_state.ppudata_written)
+
+    uint8_t *page = ppu_pages[(address / PPU_PAGE_SIZE) & (PPU_PAGE_COUNT - 1)];
+    uint16_t offset = address % NAME_TABLE_SIZE;
+
+    // With mirroring the same memory is shown by more than one of the nametables in the plane
+    for (uint8_t nametable = 0; nametable < NAME_TABLE_COUNT; nametable++)
     {
-        mapper.ppu_write_memory(ppu_state.internal_ppu_addr, ppu_state.ppudata);
+        if (ppu_pages[NAME_TABLE_PAGE + nametable] != page)
+        {
+            continue;
+        }
+
+        // Position of the nametable in the plane, in tiles
+        uint8_t base_x = (nametable & 1) * NAME_TABLE_TILES_X;
+        uint8_t base_y = (nametable >> 1) * NAME_TABLE_TILES_Y;
 
-        // If increment mode is set to 0, go across
-        if (!(ppu_state.ctrl & INC_MODE_BIT))
+        if (offset < NAMETABLE_ATTRIBUTE_OFFSET)
         {
-            ppu_state.internal_ppu_addr++;
+            background_tile_dirty[base_y + offset / NAME_TABLE_TILES_X] |= 1ULL << (base_x + offset % NAME_TABLE_TILES_X);
         }
-        // If increment mode is set to 1 go down (32)
         else
         {
-            ppu_state.internal_ppu_addr += 32;
+            // Each attribute byte covers an area of 4x4 tiles
+            uint8_t attribute_index = offset - NAMETABLE_ATTRIBUTE_OFFSET;
+            uint8_t tile_x = (attribute_index % 8) * 4;
+            uint8_t tile_y = (attribute_index / 8) * 4;
+
+            for (uint8_t y = tile_y; y < tile_y + 4 && y < NAME_TABLE_TILES_Y; y++)
+            {
+                background_tile_dirty[base_y + y] |= 0b1111ULL << (base_x + tile_x);
+            }
+        }
+    }
+}
+
+void map_ppu_page(uint8_t page, uint8_t *memory)
+{
+    if (ppu_pages[page] == memory)
+    {
+        return;
+    }
+
+    ppu_pages[page] = memory;
+    mark_ppu_dirty();
+
+    // Switching a pattern page can change any tile, switching a nametable changes all of its tiles
+    if (page < PATTERN_PAGE_COUNT)
+    {
+        mark_background_dirty(0x0000);
+    }
+    else if (page < NAME_TABLE_PAGE + NAME_TABLE_COUNT)
+    {
+        uint8_t nametable = page - NAME_TABLE_PAGE;
+        uint8_t base_x = (nametable & 1) * NAME_TABLE_TILES_X;
+        uint8_t base_y = (nametable >> 1) * NAME_TABLE_TILES_Y;
+
+        for (uint8_t y = 0; y < NAME_TABLE_TILES_Y; y++)
+        {
+            background_tile_dirty[base_y + y] |= 0xFFFFFFFFULL << base_x;
+        }
+        ppu_state.background_dirty = TRUE;
+    }
+}
+
+void set_nametable_mirroring(MIRRORING mirroring)
+{
+    // The 1KB bank of VRAM shown by each of the four nametables, indexed by the mirroring
+    static const uint8_t nametable_banks[][NAME_TABLE_COUNT] =
+    {
+        [HORIZONTAL] = {0, 0, 1, 1},
+        [VERTICAL] = {0, 1, 0, 1},
+        [SINGLE_SCREEN_LOW] = {0, 0, 0, 0},
+        [SINGLE_SCREEN_HIGH] = {1, 1, 1, 1},
+        [FOUR_SCREEN] = {0, 1, 2, 3},
+    };
+
+    Logf("Nametable mirroring: %d", LL_INFO, mirroring);
+
+    for (uint8_t nametable = 0; nametable < NAME_TABLE_COUNT; nametable++)
+    {
+        uint8_t *bank = ppu_memory + VRAM_ADDRESS + nametable_banks[mirroring][nametable] * NAME_TABLE_SIZE;
+
+        // 0x3000 -> 0x3EFF mirrors the nametables
+        map_ppu_page(NAME_TABLE_PAGE + nametable, bank);
+        map_ppu_page(NAME_TABLE_PAGE + NAME_TABLE_COUNT + nametable, bank);
+    }
+}
+
+void refresh_background_plane()
+{
+    uint16_t background_table_addr = ppu_state.ctrl & BC_TILESELECT_BIT ? 0x1000 : 0x0000;
+
+    for (uint8_t plane_tile_y = 0; plane_tile_y < BACKGROUND_PLANE_TILES_Y; plane_tile_y++)
+    {
+        uint64_t dirty = background_tile_dirty[plane_tile_y];
+        background_tile_dirty[plane_tile_y] = 0;
+
+        while (dirty)
+        {
+            uint8_t plane_tile_x = __builtin_ctzll(dirty);
+            dirty &= dirty - 1;
+
+            // The tiles position within its nametable
+            uint8_t tile_x = plane_tile_x % NAME_TABLE_TILES_X;
+            uint8_t tile_y = plane_tile_y % NAME_TABLE_TILES_Y;
+            uint8_t *nametable = ppu_pages[NAME_TABLE_PAGE + (plane_tile_y / NAME_TABLE_TILES_Y) * 2 + plane_tile_x / NAME_TABLE_TILES_X];
+
+            uint8_t nametable_byte = nametable[tile_y * NAME_TABLE_TILES_X + tile_x];
+            uint8_t attribute_byte = nametable[NAMETABLE_ATTRIBUTE_OFFSET + (tile_y / 4) * 8 + tile_x / 4];
+
+            // The attribute area index of 32x32 area devided into four 16x16
+            //  ----------------
+            //  |  0   |   2   |
+            //  ----------------
+            //  |  4   |   6   |
+            //  ----------------
+            // Index of 2-bit areas in the attribute byte
+            uint8_t attribute_area_index = (tile_x & 0b10) + ((tile_y & 0b10) << 1);
+            // Index of the color palette to use
+            uint8_t color_palette_index = (attribute_byte >> attribute_area_index) & 0b11;
+
+            // A tile is 16 bytes, which never crosses a page
+            uint16_t tile_addr = background_table_addr + nametable_byte * 16;
+            uint8_t *pattern = &PPU_PAGE_BYTE(tile_addr);
+
+            for (uint8_t tile_offset_y = 0; tile_offset_y < 8; tile_offset_y++)
+            {
+                uint8_t low_pattern_byte = pattern[tile_offset_y];
+                uint8_t high_pattern_byte = pattern[tile_offset_y + 8];
+                uint8_t *px = &background_plane[plane_tile_y * 8 + tile_offset_y][plane_tile_x * 8];
+
+                for (uint8_t tile_offset_x = 0; tile_offset_x < 8; tile_offset_x++)
+                {
+                    uint8_t offset = 7 - tile_offset_x;
+                    // Index into the palette (which of the four colors to use)
+                    uint8_t color_index = (((high_pattern_byte >> offset) & 1) << 1) + ((low_pattern_byte >> offset) & 1);
+                    // Index in the palette RAM, all transparent pixels use the backdrop color at 0x3F00
+                    px[tile_offset_x] = color_index ? color_palette_index * 4 + color_index : 0;
+                }
+            }
+        }
+    }
+
+    ppu_state.background_dirty = FALSE;
+}
+
+void mark_ppu_dirty()
+{
+    // A change in the middle of a frame only affects the rest of that frame, so the next whole frame is drawn as well
+    ppu_state.dirty_frames = 2;
+}
+
+void evaluate_sprites(uint8_t scanline)
+{
+    uint8_t height = ppu_state.ctrl & SPRITE_HIGHT_BIT ? 16 : 8;
+
+    // A sprite is on the scanline if (scanline - height) < y <= scanline
+    // The y-positions are clamped to this range, and the sprites whose position is unchanged by the clamping are in range
+    // Unsigned byte min / max is used as SSE2 has no unsigned byte compare
+    uint8_t low = scanline < height ? 0 : scanline - height + 1;
+    uint64_t in_range = 0;
+
+#ifdef __AVX2__
+    __m256i low_vec = _mm256_set1_epi8((char)low);
+    __m256i high_vec = _mm256_set1_epi8((char)scanline);
+    for (uint8_t i = 0; i < OAM_SPRITE_COUNT; i += 32)
+    {
+        __m256i y = _mm256_loadu_si256((__m256i *)&oam_shadow[OAM_Y][i]);
+        __m256i clamped = _mm256_min_epu8(_mm256_max_epu8(y, low_vec), high_vec);
+        in_range |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(clamped, y)) << i;
+    }
+#else
+    __m128i low_vec = _mm_set1_epi8((char)low);
+    __m128i high_vec = _mm_set1_epi8((char)scanline);
+    for (uint8_t i = 0; i < OAM_SPRITE_COUNT; i += 16)
+    {
+        __m128i y = _mm_loadu_si128((__m128i *)&oam_shadow[OAM_Y][i]);
+        __m128i clamped = _mm_min_epu8(_mm_max_epu8(y, low_vec), high_vec);
+        in_range |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(clamped, y)) << i;
+    }
+#endif
+
+    // Sprite 0 is always the first sprite in the secondary OAM when it is in range
+    ppu_state.sprite0_evaluated = in_range & 1;
+
+    // Each set bit is a sprite on the scanline, the lowest bits have priority
+    ppu_state.num_sprites = 0;
+    while (in_range && ppu_state.num_sprites < OAM2_SPRITE_COUNT)
+    {
+        uint8_t i = __builtin_ctzll(in_range);
+        in_range &= in_range - 1;
+
+        oam2_memory[ppu_state.num_sprites * 4 + OAM_Y] = oam_shadow[OAM_Y][i] + 1; // pushing the sprites 1 pixel down
+        oam2_memory[ppu_state.num_sprites * 4 + OAM_TILE] = oam_shadow[OAM_TILE][i];
+        oam2_memory[ppu_state.num_sprites * 4 + OAM_ATTRIBUTE] = oam_shadow[OAM_ATTRIBUTE][i];
+        oam2_memory[ppu_state.num_sprites * 4 + OAM_X] = oam_shadow[OAM_X][i];
+        ppu_state.num_sprites++;
+    }
+
+    // Any sprites left after the secondary OAM is full overflows
+    if (in_range)
+    {
+        ppu_state.status |= SPRITE_OVERFLOW;
+    }
+}
+
+void refresh_oam_shadow()
+{
+    for (uint16_t i = 0; i < OAM_SIZE; i++)
+    {
+        oam_shadow[i & 0b11][i >> 2] = oam_memory[i];
+    }
+}
+
+void build_emphasis_palettes()
+{
+    for (uint8_t emphasis = 0; emphasis < EMPHASIS_COUNT; emphasis++)
+    {
+        // Each emphasis bit (red, green, blue) darkens the two other color channels to about 75%
+        uint16_t r_scale = emphasis & 0b110 ? 191 : 256;
+        uint16_t g_scale = emphasis & 0b101 ? 191 : 256;
+        uint16_t b_scale = emphasis & 0b011 ? 191 : 256;
+
+        for (uint8_t color = 0; color < NES_COLOR_COUNT; color++)
+        {
+            emphasis_palettes[emphasis][color].BGRA.Red = nes_palette[color * 3 + 0] * r_scale >> 8;
+            emphasis_palettes[emphasis][color].BGRA.Green = nes_palette[color * 3 + 1] * g_scale >> 8;
+            emphasis_palettes[emphasis][color].BGRA.Blue = nes_palette[color * 3 + 2] * b_scale >> 8;
+            emphasis_palettes[emphasis][color].BGRA.Alpha = 0;
         }
+    }
+}
+
+void rebuild_palette_lut()
+{
+    ppu_state.palette_mask = ppu_state.mask & (BRG_BITS | GRAYSCALE_BIT);
+
+    PIXEL32 *palette = emphasis_palettes[(ppu_state.mask & BRG_BITS) >> 5];
+    // Grayscale only keeps the brightness (column 0) of the colors
+    uint8_t color_bits = ppu_state.mask & GRAYSCALE_BIT ? GRAYSCALE_COLOR_BITS : NES_COLOR_COUNT - 1;
 
-        ppu_state.ppudata_written = FALSE;
+    for (uint8_t i = 0; i < PALETTE_SIZE; i++)
+    {
+        palette_color_lut[i] = ppu_memory[PALETTE_ADDRESS + i] & color_bits;
+        palette_lut[i] = palette[palette_color_lut[i]];
     }
+
+    ppu_state.palette_dirty = FALSE;
+}
+
+void set_px(uint8_t x, uint8_t y, PIXEL32 px)
+{
+    *((PIXEL32 *)(backBuffer.Memory) + (x + ((NES_PX_HEIGHT - y - 1) * NES_PX_WIDTH))) = px;
 }
 
 void log_ppu_memory()
@@ -3,6 +3,8 @@
 #define PPU_H
 
 #include "Windows.h"
+#include "../main.h"
+#include "loader.h"
 
 #define PPU_CTRL_ADDRESS 0x2000
 #define PPU_MASK_ADDRESS 0x2001
@@ -22,6 +24,8 @@
 #define SPRITE_PT_ADDRESS_BIT 0b00001000
 #define INC_MODE_BIT 0b00000100
 #define NAMETABLE_BITS 0b00000011
+// The PPUCTRL bits which change what is drawn
+#define CTRL_OUTPUT_BITS (SPRITE_HIGHT_BIT | BC_TILESELECT_BIT | SPRITE_PT_ADDRESS_BIT | NAMETABLE_BITS)
 
 // Bits for PPUMASK
 #define BRG_BITS 0b11100000
@@ -36,9 +40,22 @@
 #define SPRITE_0 0b01000000
 #define SPRITE_OVERFLOW 0b00100000
 
+// Timestamp of a status change which is not scheduled
+#define NO_PPU_EVENT UINT64_MAX
+// The longest loop (in cpu cycles) between two reads of PPUSTATUS which is skipped ahead when waiting for a flag
+#define STATUS_POLL_LOOP_CYCLES 16
+// The only loop skipped: LDA or BIT $2002, followed by a branch back to it (opcodes and the branch offset)
+#define STATUS_POLL_LDA_ABSOLUTE 0xAD
+#define STATUS_POLL_BIT_ABSOLUTE 0x2C
+#define STATUS_POLL_BRANCH_OFFSET 0xFB
+// The scroll of a scanline drawn with rendering disabled, which only shows the backdrop
+#define SCANLINE_SCROLL_DISABLED 0xFFFFFFFF
+
 #define PPU_MEMORY_SIZE 0x4000
 #define OAM_SIZE 0x100
 #define OAM2_SIZE 0x20
+#define OAM_SPRITE_COUNT 64
+#define OAM2_SPRITE_COUNT 8
 
 #define PATTERN_TABLE_SIZE 0x1000
 #define NAME_TABLE_SIZE 0x0400
@@ -46,6 +63,39 @@
 #define ATTRIBUTE_TABLE_SIZE 0x40 // This is the last 64 bytes of the nametable
 #define NAMETABLE_ATTRIBUTE_OFFSET 0x03C0
 #define PALETTE_ADDRESS 0x3F00
+#define NAME_TABLE_TILES_X 32
+#define NAME_TABLE_TILES_Y 30
+#define PALETTE_SIZE 0x20
+#define SPRITE_PALETTE_OFFSET 0x10
+#define NES_COLOR_COUNT 64
+#define EMPHASIS_COUNT 8
+#define GRAYSCALE_COLOR_BITS 0x30
+
+// The ppu address space is mapped in pages of 1KB, the four nametables are each one page
+#define PPU_PAGE_SIZE 0x0400
+#define PPU_PAGE_COUNT (PPU_MEMORY_SIZE / PPU_PAGE_SIZE)
+#define PATTERN_PAGE_COUNT (PATTERN_TABLE_SIZE * 2 / PPU_PAGE_SIZE)
+#define NAME_TABLE_PAGE (VRAM_ADDRESS / PPU_PAGE_SIZE)
+#define NAME_TABLE_COUNT 4
+// Reads or writes the byte at a ppu address below the palette through the page table
+#define PPU_PAGE_BYTE(address) (ppu_pages[((address) >> 10) & (PPU_PAGE_COUNT - 1)][(address) & (PPU_PAGE_SIZE - 1)])
+// The palette RAM is mirrored every 32 bytes, and the backdrop entry of each sprite palette is the one of the background palette
+#define PALETTE_INDEX(address) (((address) & 0x13) == 0x10 ? (address) & 0x0F : (address) & 0x1F)
+
+// Fields of the v and t registers
+#define COARSE_X_BITS 0x001F
+#define COARSE_Y_BITS 0x03E0
+#define NAMETABLE_X_BIT 0x0400
+#define NAMETABLE_Y_BIT 0x0800
+#define FINE_Y_BITS 0x7000
+#define HORIZONTAL_SCROLL_BITS (COARSE_X_BITS | NAMETABLE_X_BIT)
+#define VERTICAL_SCROLL_BITS (COARSE_Y_BITS | NAMETABLE_Y_BIT | FINE_Y_BITS)
+
+// The background plane holds all four nametables pre-rendered (2x2 screens)
+#define BACKGROUND_PLANE_WIDTH (NES_PX_WIDTH * 2)
+#define BACKGROUND_PLANE_HEIGHT (NES_PX_HEIGHT * 2)
+#define BACKGROUND_PLANE_TILES_X (NAME_TABLE_TILES_X * 2)
+#define BACKGROUND_PLANE_TILES_Y (NAME_TABLE_TILES_Y * 2)
 
 // OAM attribute bytes
 #define FLIP_V_BIT 0b10000000
@@ -55,11 +105,26 @@
 
 #define OAM_TILE_BANK_BIT 0b1
 
+// Index of each sprite byte, used both as the offset within an OAM entry and as the row of the OAM shadow
+#define OAM_Y 0
+#define OAM_TILE 1
+#define OAM_ATTRIBUTE 2
+#define OAM_X 3
+
+// Format of the pixels written by the ppu
+typedef enum PPU_OUTPUT
+{
+    PPU_OUTPUT_BGRA,    // 32-bit pixels written directly to the bottom-up backbuffer
+    PPU_OUTPUT_INDEXED, // 6-bit nes colors written to the top-down indexed frame, converted when presented
+    PPU_OUTPUT_NONE,    // No pixels are drawn, used while the ppu is captured to be drawn later
+} PPU_OUTPUT;
+
 typedef struct ppu_state_t
 {
     uint64_t cycle;    // The cylces go from 0 to 340
     uint16_t scanline; // The scanlines go from 0 to 240 (260 including)
 
+    // The registers are kept in the order of their addresses, the bus maps pointers to them back to the address
     uint8_t ctrl;          // 0x2000
     uint8_t mask;          // 0x2001
     uint8_t status;        // 0c2002
@@ -67,34 +132,84 @@ typedef struct ppu_state_t
     uint8_t oamdata;       // 0x2004
     uint8_t scroll;        // 0x2005
     uint8_t ppuaddr;       // 0x2006
-    uint8_t ppuaddr_latch; // Upper byte of the ppuaddr
     uint8_t ppudata;       // 0x2007
     uint8_t oamdma;        // 0x4014
 
-    uint8_t nametable_byte;
-    uint8_t attribute_byte;
-    uint8_t low_pattern_byte;
-    uint8_t high_pattern_byte;
+    // Internal registers shared by scrolling and VRAM access (named after loopy's description)
+    uint16_t v;     // Current VRAM address (15 bits)
+    uint16_t t;     // Temporary VRAM address, the address of the top left tile on screen
+    uint8_t fine_x; // Fine x scroll (3 bits)
+    BOOL w;         // Write toggle of PPUSCROLL and PPUADDR, cleared by reading PPUSTATUS
+
+    uint8_t read_buffer; // PPUDATA reads below the palette return the byte read by the previous access
 
-    BOOL ppuaddr_high;
-    BOOL ppuaddr_written;
-    BOOL ppudata_written;
+    uint64_t sprite0_hit_cycle; // The ppu cycle where sprite 0 hits the background on the current scanline
+    BOOL sprite0_evaluated;     // Sprite 0 is the first sprite of the secondary OAM
+
+    // The last read of PPUSTATUS, used to detect the cpu waiting for a flag in a loop
+    uint16_t status_poll_pc;
+    uint8_t status_poll_value;
+    uint64_t status_poll_cycle;
 
-    uint16_t internal_ppu_addr;
     uint8_t num_sprites;
     uint16_t frame_counter;
+
+    BOOL palette_dirty;   // Set when the palette RAM is written, the palette lookup table is then rebuilt before use
+    uint8_t palette_mask; // The emphasis and grayscale bits of the mask used when building the palette lookup table
+
+    uint8_t dirty_frames; // Number of frames left to draw since the last change to anything affecting the output
+    // The scroll each visible scanline was drawn with (v and fine x) in the last frame, a change of it marks the ppu dirty
+    uint32_t scanline_scroll[240];
+    BOOL frame_updated;   // Set when pixels are drawn, cleared when the frame is published
+
+    BOOL background_dirty; // Set when any tile of the background plane has to be drawn again
 } ppu_state_t;
 
 extern uint8_t nes_palette[192];
+extern PIXEL32 emphasis_palettes[EMPHASIS_COUNT][NES_COLOR_COUNT];
+extern PIXEL32 palette_lut[PALETTE_SIZE];
+extern uint8_t palette_color_lut[PALETTE_SIZE];
+extern PPU_OUTPUT ppu_output;
+extern uint8_t indexed_frame[NES_PX_HEIGHT * NES_PX_WIDTH];
+extern uint8_t indexed_frame_emphasis[NES_PX_HEIGHT];
 extern ppu_state_t ppu_state;
 extern uint8_t ppu_memory[PPU_MEMORY_SIZE];
+extern uint8_t *ppu_pages[PPU_PAGE_COUNT];
 extern uint8_t oam_memory[OAM_SIZE];
 extern uint8_t oam2_memory[OAM2_SIZE];
+extern uint8_t oam_shadow[4][OAM_SPRITE_COUNT];
+extern uint8_t background_plane[BACKGROUND_PLANE_HEIGHT][BACKGROUND_PLANE_WIDTH];
 
 void ppu_power_up();
-void handle_cpu_vram_reading();
 void perform_next_ppu_cycle();
-void set_px(uint8_t x, uint8_t y, uint8_t r, uint8_t g, uint8_t b);
+void render_scanline();
+void copy_background_line(uint8_t *line);
+void fetch_sprite_pattern(uint8_t i, uint8_t *low, uint8_t *high);
+void schedule_sprite0_hit();
+uint64_t next_status_change_cycle();
+void ppu_write_register(uint16_t address, uint8_t value);
+void apply_ppu_register_write(uint16_t address, uint8_t value);
+uint8_t ppu_read_register(uint16_t address);
+void write_ppu_ctrl(uint8_t value);
+void write_ppu_mask(uint8_t value);
+void write_ppu_scroll(uint8_t value);
+void write_ppu_addr(uint8_t value);
+void write_ppu_data(uint8_t value);
+void write_oam_data(uint8_t value);
+uint8_t read_ppu_status();
+uint8_t read_ppu_data();
+uint8_t read_oam_data();
+void increment_ppu_addr();
+void map_ppu_page(uint8_t page, uint8_t *memory);
+void set_nametable_mirroring(MIRRORING mirroring);
+void mark_background_dirty(uint16_t address);
+void refresh_background_plane();
+void mark_ppu_dirty();
+void evaluate_sprites(uint8_t scanline);
+void refresh_oam_shadow();
+void build_emphasis_palettes();
+void rebuild_palette_lut();
+void set_px(uint8_t x, uint8_t y, PIXEL32 px);
 void log_ppu_memory();
 
 #endif
\ No newline at end of file
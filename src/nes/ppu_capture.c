@@ -0,0 +1,191 @@
+#include <stdint.h>
+#include <string.h>
+#include "../logger.h"
+#include "ppu_capture.h"
+#include "ppu_pipeline.h"
+#include "ppu.h"
+#include "loader.h"
+
+/*
+    While capturing, the emulation runs without drawing any pixels, recording what is needed to draw the frames later
+
+    On the first cycle of each frame a snapshot of the ppu is taken (state, memory, OAM and the page mapping),
+    and every access to the ppu after it is logged with its cycle, until the next frame starts.
+    A frame can then be drawn on its own by restoring the snapshot and running the ppu for one frame,
+    doing the logged accesses on the same cycles. This is what the ppurender tool does, with many frames at once.
+*/
+
+ppu_capture_t ppu_capture;
+
+void start_ppu_capture(LPCSTR filename)
+{
+    if (ppu_capture.enabled)
+    {
+        return;
+    }
+
+    ppu_capture.file = CreateFileA(
+        filename,
+        GENERIC_WRITE,
+        0,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+
+    if (ppu_capture.file == INVALID_HANDLE_VALUE)
+    {
+        Logf("Unable to create the ppu capture file %s", LL_ERROR, filename);
+        return;
+    }
+
+    if (ppu_capture.entries == NULL)
+    {
+        ppu_capture.entries = VirtualAlloc(NULL, PPU_CAPTURE_MAX_ENTRIES * sizeof(ppu_log_entry_t), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+
+    // Nothing is logged until the first frame starts, as its snapshot holds everything done before it
+    ppu_capture.has_frame = FALSE;
+    ppu_capture.frame.frame = 0;
+    ppu_capture.previous_output = ppu_output;
+    ppu_output = PPU_OUTPUT_NONE;
+    ppu_capture.enabled = TRUE;
+
+    Logf("PPU capture started: %s", LL_INFO, filename);
+}
+
+void stop_ppu_capture()
+{
+    if (!ppu_capture.enabled)
+    {
+        return;
+    }
+
+    // The frame being captured is not complete, and is left out
+    ppu_capture.enabled = FALSE;
+    CloseHandle(ppu_capture.file);
+
+    ppu_output = ppu_capture.previous_output;
+    mark_ppu_dirty();
+
+    Logf("PPU capture stopped after %d frames", LL_INFO, ppu_capture.has_frame ? ppu_capture.frame.frame : 0);
+}
+
+void capture_ppu_frame()
+{
+    if (ppu_capture.has_frame)
+    {
+        DWORD bytesWritten;
+        WriteFile(ppu_capture.file, &ppu_capture.frame, sizeof(ppu_capture_frame_t), &bytesWritten, NULL);
+        WriteFile(ppu_capture.file, ppu_capture.entries, ppu_capture.frame.entry_count * sizeof(ppu_log_entry_t), &bytesWritten, NULL);
+        ppu_capture.frame.frame++;
+    }
+
+    ppu_capture_frame_t *frame = &ppu_capture.frame;
+    frame->magic = PPU_CAPTURE_MAGIC;
+    frame->entry_count = 0;
+    frame->mapper_number = header.mapper_number;
+    for (uint8_t page = 0; page < PPU_PAGE_COUNT; page++)
+    {
+        frame->page_offsets[page] = ppu_pages[page] - ppu_memory;
+    }
+    frame->state = ppu_state;
+    memcpy(frame->ppu_memory, ppu_memory, PPU_MEMORY_SIZE);
+    memcpy(frame->oam_memory, oam_memory, OAM_SIZE);
+
+    ppu_capture.has_frame = TRUE;
+}
+
+void capture_ppu_access(PPU_LOG_KIND kind, uint16_t address, uint8_t value)
+{
+    if (!ppu_capture.has_frame)
+    {
+        return;
+    }
+
+    if (ppu_capture.frame.entry_count >= PPU_CAPTURE_MAX_ENTRIES)
+    {
+        Log("PPU capture log is full, the access is left out", LL_WARNING);
+        return;
+    }
+
+    // The ppu is always at the cycle of the access when it is done
+    ppu_log_entry_t *entry = &ppu_capture.entries[ppu_capture.frame.entry_count++];
+    entry->cycle = ppu_state.cycle;
+    entry->address = address;
+    entry->value = value;
+    entry->kind = kind;
+}
+
+BOOL read_ppu_capture_frame(HANDLE file, ppu_capture_frame_t *frame, ppu_log_entry_t *entries)
+{
+    DWORD bytesRead;
+    if (!ReadFile(file, frame, sizeof(ppu_capture_frame_t), &bytesRead, NULL) || bytesRead != sizeof(ppu_capture_frame_t))
+    {
+        return FALSE;
+    }
+
+    if (frame->magic != PPU_CAPTURE_MAGIC || frame->entry_count > PPU_CAPTURE_MAX_ENTRIES)
+    {
+        Log("Invalid frame in the ppu capture", LL_ERROR);
+        return FALSE;
+    }
+
+    DWORD size = frame->entry_count * sizeof(ppu_log_entry_t);
+    return ReadFile(file, entries, size, &bytesRead, NULL) && bytesRead == size;
+}
+
+BOOL skip_ppu_capture_frame(HANDLE file)
+{
+    // Only the part of the snapshot before the memory is needed to find the next frame
+    ppu_capture_frame_t frame;
+    DWORD bytesRead;
+    if (!ReadFile(file, &frame, sizeof(ppu_capture_frame_t), &bytesRead, NULL) || bytesRead != sizeof(ppu_capture_frame_t))
+    {
+        return FALSE;
+    }
+
+    if (frame.magic != PPU_CAPTURE_MAGIC || frame.entry_count > PPU_CAPTURE_MAX_ENTRIES)
+    {
+        Log("Invalid frame in the ppu capture", LL_ERROR);
+        return FALSE;
+    }
+
+    return SetFilePointer(file, frame.entry_count * sizeof(ppu_log_entry_t), NULL, FILE_CURRENT) != INVALID_SET_FILE_POINTER;
+}
+
+void restore_ppu_capture_frame(ppu_capture_frame_t *frame)
+{
+    memcpy(ppu_memory, frame->ppu_memory, PPU_MEMORY_SIZE);
+    memcpy(oam_memory, frame->oam_memory, OAM_SIZE);
+    refresh_oam_shadow();
+
+    for (uint8_t page = 0; page < PPU_PAGE_COUNT; page++)
+    {
+        map_ppu_page(page, ppu_memory + frame->page_offsets[page]);
+    }
+
+    // Nothing drawn before is valid for the restored memory
+    ppu_state = frame->state;
+    ppu_state.palette_dirty = TRUE;
+    mark_ppu_dirty();
+    mark_background_dirty(0x0000);
+}
+
+void replay_ppu_capture_frame(ppu_capture_frame_t *frame, ppu_log_entry_t *entries)
+{
+    uint64_t end = frame->state.cycle + PPU_CYCLES_PER_FRAME;
+    uint32_t next = 0;
+
+    while (ppu_state.cycle < end)
+    {
+        // An access is done before the cycle it was made on
+        while (next < frame->entry_count && entries[next].cycle <= ppu_state.cycle)
+        {
+            apply_log_entry(&entries[next]);
+            next++;
+        }
+
+        perform_next_ppu_cycle();
+    }
+}
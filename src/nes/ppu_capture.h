@@ -0,0 +1,52 @@
+#ifndef PPU_CAPTURE_H
+
+#define PPU_CAPTURE_H
+
+#include "Windows.h"
+#include <stdint.h>
+#include "ppu.h"
+#include "ppu_pipeline.h"
+
+#define PPU_CAPTURE_MAGIC 0x50504C47 // "GLPP"
+// Number of log entries kept for a single frame, more than a frame can have with OAM DMA on every scanline
+#define PPU_CAPTURE_MAX_ENTRIES 0x10000
+#define PPU_CAPTURE_FILE "ppu_capture.ppl"
+
+// The capture file is a sequence of frames, each being this snapshot followed by its log entries
+// The snapshot is taken on the first cycle of the pre-render scanline, the frame runs until the same cycle of the next one
+typedef struct ppu_capture_frame_t
+{
+    uint32_t magic;
+    uint32_t frame;       // Number of the frame since the capture started
+    uint32_t entry_count; // Number of ppu_log_entry_t following the snapshot
+    uint16_t mapper_number;
+    uint16_t page_offsets[PPU_PAGE_COUNT]; // Offset of the memory of each page in the ppu memory
+    ppu_state_t state;
+    uint8_t ppu_memory[PPU_MEMORY_SIZE];
+    uint8_t oam_memory[OAM_SIZE];
+} ppu_capture_frame_t;
+
+typedef struct ppu_capture_t
+{
+    BOOL enabled;
+    HANDLE file;
+    PPU_OUTPUT previous_output; // Restored when the capture is stopped, no pixels are drawn while capturing
+
+    // The frame being captured, written when the next one starts
+    BOOL has_frame;
+    ppu_capture_frame_t frame;
+    ppu_log_entry_t *entries;
+} ppu_capture_t;
+
+extern ppu_capture_t ppu_capture;
+
+void start_ppu_capture(LPCSTR filename);
+void stop_ppu_capture();
+void capture_ppu_frame();
+void capture_ppu_access(PPU_LOG_KIND kind, uint16_t address, uint8_t value);
+BOOL read_ppu_capture_frame(HANDLE file, ppu_capture_frame_t *frame, ppu_log_entry_t *entries);
+BOOL skip_ppu_capture_frame(HANDLE file);
+void restore_ppu_capture_frame(ppu_capture_frame_t *frame);
+void replay_ppu_capture_frame(ppu_capture_frame_t *frame, ppu_log_entry_t *entries);
+
+#endif
@@ -0,0 +1,224 @@
+#include <stdint.h>
+#include "../logger.h"
+#include "../eventtrace.h"
+#include "ppu_pipeline.h"
+#include "ppu_capture.h"
+#include "ppu.h"
+#include "cpu.h"
+#include "loader.h"
+
+/*
+    In the pipelined mode the ppu runs on its own thread, behind the cpu
+
+    The cpu thread does not step the ppu, it logs every write the ppu can see (registers and OAM DMA)
+    with the ppu cycle it is made on. The render thread steps the ppu up to the cycle the cpu has reached,
+    doing the logged writes on the same cycles as when the ppu runs in step with the cpu.
+
+    The cpu only needs values from the ppu when reading its registers, which waits for the render thread to catch up.
+    VBLANK starts on a fixed schedule, so the NMI is generated by the cpu thread itself.
+*/
+
+ppu_pipeline_t ppu_pipeline;
+
+void publish_cpu_cycle(uint64_t ppu_cycle)
+{
+    InterlockedExchange64(&ppu_pipeline.cpu_cycle, ppu_cycle);
+
+    if (ppu_pipeline.waiting)
+    {
+        SetEvent(ppu_pipeline.wake_event);
+    }
+}
+
+void apply_log_entry(ppu_log_entry_t *entry)
+{
+    switch (entry->kind)
+    {
+    case PPU_LOG_REGISTER:
+        apply_ppu_register_write(entry->address, entry->value);
+        break;
+    case PPU_LOG_OAM:
+        if (ppu_capture.enabled)
+        {
+            capture_ppu_access(PPU_LOG_OAM, entry->address, entry->value);
+        }
+        mapper.oam_write(entry->address, entry->value);
+        break;
+    case PPU_LOG_READ:
+        ppu_read_register(entry->address);
+        break;
+    }
+}
+
+DWORD WINAPI ppu_pipeline_thread(LPVOID param)
+{
+    while (!ppu_pipeline.stop)
+    {
+        // Every entry logged before the cpu cycle was published is visible after reading it
+        uint64_t target = ppu_pipeline.cpu_cycle;
+        MemoryBarrier();
+        LONG64 head = ppu_pipeline.head;
+        LONG64 tail = ppu_pipeline.tail;
+        int64_t batchSpan = StartTraceSpan();
+
+        while (TRUE)
+        {
+            // A write is done before the cycle it was made on
+            while (tail < head && ppu_pipeline.log[tail % PPU_LOG_SIZE].cycle <= ppu_state.cycle)
+            {
+                apply_log_entry(&ppu_pipeline.log[tail % PPU_LOG_SIZE]);
+                tail++;
+            }
+
+            if (ppu_state.cycle >= target)
+            {
+                break;
+            }
+
+            perform_next_ppu_cycle();
+        }
+
+        InterlockedExchange64(&ppu_pipeline.tail, tail);
+        InterlockedExchange64(&ppu_pipeline.ppu_cycle, ppu_state.cycle);
+        EndTraceSpan(TRACE_STREAM_RENDER, TRACE_PPU_BATCH, batchSpan, ppu_state.scanline);
+
+        // Sleep until the cpu has moved on, checking again after setting the flag in case it did so in the meantime
+        if (ppu_state.cycle >= (uint64_t)ppu_pipeline.cpu_cycle && ppu_pipeline.head == tail)
+        {
+            InterlockedExchange(&ppu_pipeline.waiting, TRUE);
+
+            if (ppu_state.cycle >= (uint64_t)ppu_pipeline.cpu_cycle && ppu_pipeline.head == tail && !ppu_pipeline.stop)
+            {
+                WaitForSingleObject(ppu_pipeline.wake_event, INFINITE);
+            }
+
+            InterlockedExchange(&ppu_pipeline.waiting, FALSE);
+        }
+    }
+
+    return 0;
+}
+
+void start_ppu_pipeline()
+{
+    if (ppu_pipeline.enabled)
+    {
+        return;
+    }
+
+    ppu_pipeline.head = 0;
+    ppu_pipeline.tail = 0;
+    ppu_pipeline.cpu_cycle = ppu_state.cycle;
+    ppu_pipeline.ppu_cycle = ppu_state.cycle;
+    ppu_pipeline.ctrl = ppu_state.ctrl;
+    ppu_pipeline.waiting = FALSE;
+    ppu_pipeline.stop = FALSE;
+
+    // VBLANK starts on dot 1 of scanline 241
+    uint16_t cycle = ppu_state.cycle % 341;
+    ppu_pipeline.next_vblank_cycle = ppu_state.cycle - cycle + ((241 + 262 - ppu_state.scanline) % 262) * 341 + 1;
+    if (ppu_pipeline.next_vblank_cycle < ppu_state.cycle)
+    {
+        ppu_pipeline.next_vblank_cycle += PPU_CYCLES_PER_FRAME;
+    }
+
+    ppu_pipeline.wake_event = CreateEventA(NULL, FALSE, FALSE, NULL);
+    ppu_pipeline.enabled = TRUE;
+    ppu_pipeline.thread = CreateThread(NULL, 0, ppu_pipeline_thread, NULL, 0, NULL);
+
+    if (ppu_pipeline.thread == NULL)
+    {
+        Log("Unable to create the ppu render thread", LL_ERROR);
+        CloseHandle(ppu_pipeline.wake_event);
+        ppu_pipeline.enabled = FALSE;
+        return;
+    }
+
+    Log("PPU pipeline started", LL_INFO);
+}
+
+void stop_ppu_pipeline()
+{
+    if (!ppu_pipeline.enabled)
+    {
+        return;
+    }
+
+    sync_ppu_pipeline();
+
+    ppu_pipeline.stop = TRUE;
+    SetEvent(ppu_pipeline.wake_event);
+    WaitForSingleObject(ppu_pipeline.thread, INFINITE);
+
+    CloseHandle(ppu_pipeline.thread);
+    CloseHandle(ppu_pipeline.wake_event);
+    ppu_pipeline.enabled = FALSE;
+
+    Log("PPU pipeline stopped", LL_INFO);
+}
+
+void log_ppu_write(PPU_LOG_KIND kind, uint16_t address, uint8_t value)
+{
+    uint64_t cycle = cpu.cycle * 3;
+
+    if (kind == PPU_LOG_REGISTER && address == PPU_CTRL_ADDRESS)
+    {
+        ppu_pipeline.ctrl = value;
+    }
+
+    // When the log is full the render thread has to apply some of it first
+    while (ppu_pipeline.head - ppu_pipeline.tail >= PPU_LOG_SIZE)
+    {
+        publish_cpu_cycle(cycle);
+        SwitchToThread();
+    }
+
+    ppu_log_entry_t *entry = &ppu_pipeline.log[ppu_pipeline.head % PPU_LOG_SIZE];
+    entry->cycle = cycle;
+    entry->address = address;
+    entry->value = value;
+    entry->kind = kind;
+
+    InterlockedExchange64(&ppu_pipeline.head, ppu_pipeline.head + 1);
+}
+
+void advance_ppu_pipeline(uint64_t ppu_cycle)
+{
+    if (ppu_cycle > ppu_pipeline.next_vblank_cycle)
+    {
+        if (ppu_pipeline.ctrl & NMI_ENABLE_BIT)
+        {
+            cpu.nmi_requested = TRUE;
+        }
+
+        ppu_pipeline.next_vblank_cycle += PPU_CYCLES_PER_FRAME;
+    }
+
+    // The render thread is let go in batches, to not pay for the synchronization on every instruction
+    if (ppu_cycle - ppu_pipeline.cpu_cycle >= PPU_PIPELINE_BATCH_CYCLES)
+    {
+        publish_cpu_cycle(ppu_cycle);
+    }
+}
+
+void sync_ppu_pipeline()
+{
+    uint64_t cycle = cpu.cycle * 3;
+    publish_cpu_cycle(cycle);
+
+    // The render thread stops at the published cycle, so the ppu state is not changed by it until the cpu moves on
+    // Spinning is only worth it for a short while, after that the time slice is given away in case the threads share a core
+    for (uint32_t spins = 0; (uint64_t)ppu_pipeline.ppu_cycle < cycle || ppu_pipeline.tail != ppu_pipeline.head; spins++)
+    {
+        if (spins < PPU_PIPELINE_SPINS)
+        {
+            YieldProcessor();
+        }
+        else
+        {
+            SwitchToThread();
+        }
+    }
+
+    MemoryBarrier();
+}
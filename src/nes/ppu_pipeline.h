@@ -0,0 +1,63 @@
+#ifndef PPU_PIPELINE_H
+
+#define PPU_PIPELINE_H
+
+#include "Windows.h"
+#include <stdint.h>
+
+// Number of entries in the write log (a power of two)
+#define PPU_LOG_SIZE 0x4000
+// The cpu lets the render thread move on after this many ppu cycles (one scanline)
+#define PPU_PIPELINE_BATCH_CYCLES 341
+#define PPU_CYCLES_PER_FRAME (341 * 262)
+// Number of times the cpu checks if the render thread has caught up before yielding its time slice
+#define PPU_PIPELINE_SPINS 1000
+
+typedef enum PPU_LOG_KIND
+{
+    PPU_LOG_REGISTER, // A write to one of the registers 0x2000 -> 0x2007
+    PPU_LOG_OAM,      // A byte copied to the OAM by OAM DMA
+    PPU_LOG_READ,     // A read of one of the registers, only recorded by the capture as the ppu runs ahead of the cpu
+} PPU_LOG_KIND;
+
+typedef struct ppu_log_entry_t
+{
+    uint64_t cycle;   // The ppu cycle when the write is done
+    uint16_t address; // The register address or the OAM address
+    uint8_t value;
+    uint8_t kind;
+} ppu_log_entry_t;
+
+typedef struct ppu_pipeline_t
+{
+    BOOL enabled;
+    HANDLE thread;
+    HANDLE wake_event;   // Set by the cpu when the render thread is waiting for it
+    volatile LONG waiting; // The render thread has caught up and is waiting for the event
+    volatile BOOL stop;
+
+    // Single producer (cpu) single consumer (render thread) ring buffer
+    ppu_log_entry_t log[PPU_LOG_SIZE];
+    volatile LONG64 head; // Number of entries written by the cpu
+    volatile LONG64 tail; // Number of entries applied by the render thread
+
+    volatile LONG64 cpu_cycle; // The ppu cycle the cpu has reached, the render thread does not go past it
+    volatile LONG64 ppu_cycle; // The ppu cycle the render thread has reached, with every entry up to it applied
+
+    // State kept on the cpu thread
+    uint8_t ctrl;               // The last value written to PPUCTRL, used for generating NMIs
+    uint64_t next_vblank_cycle; // The ppu cycle where the next VBLANK starts
+} ppu_pipeline_t;
+
+extern ppu_pipeline_t ppu_pipeline;
+
+DWORD WINAPI ppu_pipeline_thread(LPVOID param);
+void apply_log_entry(ppu_log_entry_t *entry);
+void publish_cpu_cycle(uint64_t ppu_cycle);
+void start_ppu_pipeline();
+void stop_ppu_pipeline();
+void log_ppu_write(PPU_LOG_KIND kind, uint16_t address, uint8_t value);
+void advance_ppu_pipeline(uint64_t ppu_cycle);
+void sync_ppu_pipeline();
+
+#endif
@@ -0,0 +1,194 @@
+#include <windows.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <emmintrin.h>
+#include "main.h"
+#include "logger.h"
+#include "ntsc.h"
+#include "scaler.h"
+#include "./nes/ppu.h"
+
+/*
+    NTSC composite video filter, working from the palette indices and emphasis bits of the indexed output
+
+    The ppu outputs a square wave for each pixel, 8 samples at 12 samples per color cycle, with its levels given by
+    the color and the phase of the hue. Decoding it is linear: the luma is the average of the samples around an output pixel,
+    the chroma is the samples multiplied by the carrier averaged the same way, converted from YIQ to RGB.
+    The RGB each nes pixel adds to the 4 output pixels it reaches only depends on its color, emphasis and starting phase,
+    so it is computed once for every combination, and a row is the sum of these kernels.
+    The levels are not gamma corrected.
+*/
+
+#define NTSC_ACC_PADDING 4
+#define NTSC_BLACK 0.518f
+#define NTSC_WHITE 1.962f
+#define NTSC_EMPHASIS_ATTENUATION 0.746f
+#define NTSC_CHROMA_GAIN 2.0f
+
+BOOL ntscEnabled;
+PIXEL32 *ntscFrame;
+
+// The BGRA (alpha unused) values added to each of the 4 output pixels, for each phase, emphasis and color
+static int16_t ntscKernels[NTSC_PHASES][EMPHASIS_COUNT * NES_COLOR_COUNT][NTSC_KERNEL_PIXELS * 4] __attribute__((aligned(16)));
+
+static const uint8_t *ntscSource;
+static const uint8_t *ntscEmphasis;
+
+// The signal level of a sample of the color, relative to black (0) and white (1)
+static float NtscSignal(uint8_t color, uint8_t emphasis, uint8_t phase)
+{
+    static const float levels[8] = {0.350f, 0.518f, 0.962f, 1.550f, 1.094f, 1.506f, 1.962f, 1.962f};
+
+    uint8_t hue = color & 0x0F;
+    // Hue 14 and 15 are black
+    uint8_t level = hue > 13 ? 1 : (color >> 4) & 0b11;
+    float low = levels[level];
+    float high = levels[4 + level];
+
+    // Hue 0 is gray at the high level, hue 13 -> 15 at the low level
+    if (hue == 0)
+    {
+        low = high;
+    }
+    else if (hue > 12)
+    {
+        high = low;
+    }
+
+#define IN_COLOR_PHASE(c) (((c) + phase) % NTSC_SAMPLES_PER_CYCLE < NTSC_SAMPLES_PER_CYCLE / 2)
+
+    float signal = IN_COLOR_PHASE(hue) ? high : low;
+
+    // Each emphasis bit lowers the signal during a third of the color cycle (red, green, blue)
+    if (hue < 14 && ((emphasis & 0b001 && IN_COLOR_PHASE(0)) || (emphasis & 0b010 && IN_COLOR_PHASE(4)) || (emphasis & 0b100 && IN_COLOR_PHASE(8))))
+    {
+        signal *= NTSC_EMPHASIS_ATTENUATION;
+    }
+
+#undef IN_COLOR_PHASE
+
+    return (signal - NTSC_BLACK) / (NTSC_WHITE - NTSC_BLACK);
+}
+
+static int16_t NtscKernelValue(float value)
+{
+    return (int16_t)lroundf(value * 255.0f * (1 << NTSC_KERNEL_SHIFT));
+}
+
+static void BuildNtscKernel(uint8_t phase, uint16_t colorEmphasis, int16_t *kernel)
+{
+    uint8_t startPhase = phase * (NTSC_SAMPLES_PER_CYCLE / NTSC_PHASES);
+    float signal[NTSC_SAMPLES_PER_PIXEL];
+
+    for (uint8_t s = 0; s < NTSC_SAMPLES_PER_PIXEL; s++)
+    {
+        signal[s] = NtscSignal(colorEmphasis % NES_COLOR_COUNT, colorEmphasis / NES_COLOR_COUNT, startPhase + s);
+    }
+
+    // The first output pixel is the one left of the two of the nes pixel, each output pixel is 4 samples
+    for (uint8_t j = 0; j < NTSC_KERNEL_PIXELS; j++)
+    {
+        int8_t center = (j - 1) * 4 + 2;
+        float y = 0, i = 0, q = 0;
+
+        for (int8_t s = 0; s < NTSC_SAMPLES_PER_PIXEL; s++)
+        {
+            int8_t distance = s - center;
+
+            if (distance >= -NTSC_LUMA_WINDOW / 2 && distance < NTSC_LUMA_WINDOW / 2)
+            {
+                y += signal[s];
+            }
+
+            if (distance >= -NTSC_CHROMA_WINDOW / 2 && distance < NTSC_CHROMA_WINDOW / 2)
+            {
+                float angle = M_PI * (startPhase + s + NTSC_CARRIER_OFFSET) / (NTSC_SAMPLES_PER_CYCLE / 2);
+                i += signal[s] * cosf(angle);
+                q += signal[s] * sinf(angle);
+            }
+        }
+
+        y /= NTSC_LUMA_WINDOW;
+        i *= NTSC_CHROMA_GAIN / NTSC_CHROMA_WINDOW;
+        q *= NTSC_CHROMA_GAIN / NTSC_CHROMA_WINDOW;
+
+        kernel[j * 4 + 0] = NtscKernelValue(y - 1.108545f * i + 1.709007f * q); // Blue
+        kernel[j * 4 + 1] = NtscKernelValue(y - 0.274788f * i - 0.635691f * q); // Green
+        kernel[j * 4 + 2] = NtscKernelValue(y + 0.946882f * i + 0.623557f * q); // Red
+        kernel[j * 4 + 3] = 0;
+    }
+}
+
+BOOL InitNtscFilter(void)
+{
+    ntscFrame = VirtualAlloc(NULL, NTSC_FRAME_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+    if (ntscFrame == NULL)
+    {
+        Log("Unable to allocate the NTSC frame", LL_ERROR);
+        return FALSE;
+    }
+
+    for (uint8_t phase = 0; phase < NTSC_PHASES; phase++)
+    {
+        for (uint16_t colorEmphasis = 0; colorEmphasis < EMPHASIS_COUNT * NES_COLOR_COUNT; colorEmphasis++)
+        {
+            BuildNtscKernel(phase, colorEmphasis, ntscKernels[phase][colorEmphasis]);
+        }
+    }
+
+    return TRUE;
+}
+
+void FreeNtscFilter(void)
+{
+    VirtualFree(ntscFrame, 0, MEM_RELEASE);
+}
+
+// Each output pixel is reached by the second half of the kernel of one nes pixel and the first half of the next,
+// so the sums are made in registers and the row is only stored, never read back while it is built
+static void SumRowKernels(const uint8_t *src, uint16_t colorBase, uint8_t phase, int16_t *acc)
+{
+    __m128i carry = _mm_setzero_si128();
+
+    for (uint16_t x = 0; x < NES_PX_WIDTH; x++)
+    {
+        const __m128i *kernel = (const __m128i *)ntscKernels[phase][colorBase | src[x]];
+        _mm_storeu_si128((__m128i *)(acc + (2 * x - 1 + NTSC_ACC_PADDING) * 4), _mm_adds_epi16(carry, _mm_load_si128(kernel)));
+        carry = _mm_load_si128(kernel + 1);
+
+        // Each pixel starts 8 samples (2 phases forward, or one back) after the previous one
+        phase = phase == 0 ? 2 : phase - 1;
+    }
+
+    _mm_storeu_si128((__m128i *)(acc + (NTSC_WIDTH - 1 + NTSC_ACC_PADDING) * 4), carry);
+}
+
+static void NtscBand(const PIXEL32 *src, PIXEL32 *dst, uint8_t scale, uint16_t firstRow, uint16_t lastRow)
+{
+    int16_t acc[(NTSC_WIDTH + 2 * NTSC_ACC_PADDING) * 4] __attribute__((aligned(16)));
+
+    for (uint16_t y = firstRow; y < lastRow; y++)
+    {
+        // A scanline is 341 * 8 samples, so each starts 4 samples (1 phase) after the previous one
+        SumRowKernels(ntscSource + y * NES_PX_WIDTH, ntscEmphasis[y] * NES_COLOR_COUNT, y % NTSC_PHASES, acc);
+
+        // The output is bottom-up, while the indexed frame is top-down
+        PIXEL32 *dstRow = dst + (NES_PX_HEIGHT - y - 1) * NTSC_WIDTH;
+        for (uint16_t x = 0; x < NTSC_WIDTH; x += 4)
+        {
+            __m128i low = _mm_srai_epi16(_mm_load_si128((const __m128i *)(acc + (x + NTSC_ACC_PADDING) * 4)), NTSC_KERNEL_SHIFT);
+            __m128i high = _mm_srai_epi16(_mm_load_si128((const __m128i *)(acc + (x + NTSC_ACC_PADDING) * 4 + 8)), NTSC_KERNEL_SHIFT);
+            _mm_storeu_si128((__m128i *)(dstRow + x), _mm_packus_epi16(low, high));
+        }
+    }
+}
+
+// Filters the indexed frame (one byte per pixel, top-down) into dst, which is NTSC_WIDTH pixels wide and bottom-up
+void FilterNtsc(const uint8_t *indexed, const uint8_t *emphasis, PIXEL32 *dst)
+{
+    ntscSource = indexed;
+    ntscEmphasis = emphasis;
+    RunScalerBands(NtscBand, NULL, dst, 2, TRUE);
+}
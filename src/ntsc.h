@@ -0,0 +1,33 @@
+#ifndef NTSC_H
+
+#define NTSC_H
+
+#include <windows.h>
+#include <stdint.h>
+#include "main.h"
+
+// Two output pixels for each nes pixel, four samples of the composite signal each
+#define NTSC_WIDTH (NES_PX_WIDTH * 2)
+#define NTSC_FRAME_SIZE (NTSC_WIDTH * NES_PX_HEIGHT * 4)
+// A nes pixel is 8 samples of the 12 sample color cycle, so it starts on one of 3 phases
+#define NTSC_PHASES 3
+#define NTSC_SAMPLES_PER_PIXEL 8
+#define NTSC_SAMPLES_PER_CYCLE 12
+// Number of samples averaged for the luma and the chroma, a whole color cycle removes the carrier from flat colors
+#define NTSC_LUMA_WINDOW 12
+#define NTSC_CHROMA_WINDOW 12
+// Output pixels reached by the signal of one nes pixel, starting one pixel to the left of its own two
+#define NTSC_KERNEL_PIXELS 4
+// Phase of the reference carrier of the decoder in samples, which lines the decoded hues up with the palette
+#define NTSC_CARRIER_OFFSET 4
+// Fractional bits of the kernel values
+#define NTSC_KERNEL_SHIFT 5
+
+extern BOOL ntscEnabled;
+extern PIXEL32 *ntscFrame;
+
+BOOL InitNtscFilter(void);
+void FreeNtscFilter(void);
+void FilterNtsc(const uint8_t *indexed, const uint8_t *emphasis, PIXEL32 *dst);
+
+#endif
@@ -0,0 +1,350 @@
+#include <windows.h>
+#include <stdint.h>
+#include <string.h>
+#include "main.h"
+#include "logger.h"
+#include "overlay.h"
+#include "scaler.h"
+#include "frameprofile.h"
+#include "./nes/cpu.h"
+#include "./nes/ppu.h"
+
+/*
+    Debug overlay, drawn with a built-in bitmap font into a small bitmap of its own
+
+    Formatting and drawing the text only happens a few times a second. Each presented frame gets the finished bitmap blitted into it,
+    which is a few row copies, so the debug info costs about the same whether it is shown or not.
+    The cpu state is read while the emulation runs, so it can be from different instructions.
+*/
+
+#define OVERLAY_BACKGROUND 0x202020
+#define OVERLAY_TEXT 0xFFFFFF
+#define OVERLAY_GRAPH 0x40C040
+#define OVERLAY_GRAPH_SLOW 0xE04040
+#define OVERLAY_GRAPH_TARGET 0xE0E040
+
+static const DWORD sectionColors[FRAME_SECTION_COUNT] =
+{
+    [FRAME_SECTION_CPU] = 0x4080E0,
+    [FRAME_SECTION_PPU] = 0xE08040,
+    [FRAME_SECTION_INPUT] = 0x40C0C0,
+    [FRAME_SECTION_PRESENT] = 0xC060C0,
+    [FRAME_SECTION_SLEEP] = 0x808080,
+};
+
+static const char *sectionLabels[FRAME_SECTION_COUNT] =
+{
+    [FRAME_SECTION_CPU] = "CPU",
+    [FRAME_SECTION_PPU] = "PPU",
+    [FRAME_SECTION_INPUT] = "INPUT",
+    [FRAME_SECTION_PRESENT] = "PRESENT",
+    [FRAME_SECTION_SLEEP] = "SLEEP",
+};
+
+// Rows of each glyph from the top, with the leftmost pixel in bit 4
+static const uint8_t font[FONT_LAST_CHAR - FONT_FIRST_CHAR + 1][FONT_GLYPH_HEIGHT] =
+{
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ' '
+    {0x04, 0x04, 0x04, 0x04, 0x00, 0x00, 0x04}, // !
+    {0x0A, 0x0A, 0x0A, 0x00, 0x00, 0x00, 0x00}, // "
+    {0x0A, 0x0A, 0x1F, 0x0A, 0x1F, 0x0A, 0x0A}, // #
+    {0x04, 0x0F, 0x14, 0x0E, 0x05, 0x1E, 0x04}, // $
+    {0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03}, // %
+    {0x0C, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0D}, // &
+    {0x0C, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00}, // '
+    {0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02}, // (
+    {0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08}, // )
+    {0x00, 0x04, 0x15, 0x0E, 0x15, 0x04, 0x00}, // *
+    {0x00, 0x04, 0x04, 0x1F, 0x04, 0x04, 0x00}, // +
+    {0x00, 0x00, 0x00, 0x00, 0x0C, 0x04, 0x08}, // ,
+    {0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00}, // -
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C}, // .
+    {0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00}, // /
+    {0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E}, // 0
+    {0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E}, // 1
+    {0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F}, // 2
+    {0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E}, // 3
+    {0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02}, // 4
+    {0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E}, // 5
+    {0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E}, // 6
+    {0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08}, // 7
+    {0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E}, // 8
+    {0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C}, // 9
+    {0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00}, // :
+    {0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x04, 0x08}, // ;
+    {0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02}, // <
+    {0x00, 0x00, 0x1F, 0x00, 0x1F, 0x00, 0x00}, // =
+    {0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08}, // >
+    {0x0E, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04}, // ?
+    {0x0E, 0x11, 0x01, 0x0D, 0x15, 0x15, 0x0E}, // @
+    {0x0E, 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11}, // A
+    {0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E}, // B
+    {0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E}, // C
+    {0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C}, // D
+    {0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F}, // E
+    {0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10}, // F
+    {0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F}, // G
+    {0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11}, // H
+    {0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E}, // I
+    {0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C}, // J
+    {0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11}, // K
+    {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F}, // L
+    {0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11}, // M
+    {0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11}, // N
+    {0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E}, // O
+    {0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10}, // P
+    {0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D}, // Q
+    {0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11}, // R
+    {0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E}, // S
+    {0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04}, // T
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E}, // U
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04}, // V
+    {0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A}, // W
+    {0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11}, // X
+    {0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04}, // Y
+    {0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F}, // Z
+};
+
+// Top-down, unlike the frames it is blitted into
+static PIXEL32 overlay[OVERLAY_HEIGHT][OVERLAY_WIDTH];
+static int64_t lastUpdate;
+
+static void FillRect(uint16_t x, uint16_t y, uint16_t width, uint16_t height, DWORD color)
+{
+    for (uint16_t row = y; row < y + height && row < OVERLAY_HEIGHT; row++)
+    {
+        for (uint16_t col = x; col < x + width && col < OVERLAY_WIDTH; col++)
+        {
+            overlay[row][col].Bytes = color;
+        }
+    }
+}
+
+static uint16_t DrawChar(uint16_t x, uint16_t y, char c, DWORD color)
+{
+    if (c >= 'a' && c <= 'z')
+    {
+        c -= 'a' - 'A';
+    }
+
+    if (c < FONT_FIRST_CHAR || c > FONT_LAST_CHAR || x + FONT_GLYPH_WIDTH > OVERLAY_WIDTH || y + FONT_GLYPH_HEIGHT > OVERLAY_HEIGHT)
+    {
+        return x + FONT_ADVANCE;
+    }
+
+    const uint8_t *glyph = font[c - FONT_FIRST_CHAR];
+    for (uint8_t row = 0; row < FONT_GLYPH_HEIGHT; row++)
+    {
+        for (uint8_t col = 0; col < FONT_GLYPH_WIDTH; col++)
+        {
+            if (glyph[row] & (0x10 >> col))
+            {
+                overlay[y + row][x + col].Bytes = color;
+            }
+        }
+    }
+
+    return x + FONT_ADVANCE;
+}
+
+// Each of the draw functions return the x position after what has been drawn
+static uint16_t DrawString(uint16_t x, uint16_t y, const char *text, DWORD color)
+{
+    while (*text)
+    {
+        x = DrawChar(x, y, *text++, color);
+    }
+    return x;
+}
+
+// Draws the value with at least minDigits digits, padded with zeros
+static uint16_t DrawNumber(uint16_t x, uint16_t y, uint64_t value, uint8_t base, uint8_t minDigits, DWORD color)
+{
+    char digits[24];
+    uint8_t count = 0;
+
+    do
+    {
+        uint8_t digit = value % base;
+        digits[count++] = digit < 10 ? '0' + digit : 'A' + digit - 10;
+        value /= base;
+    } while (value > 0 || count < minDigits);
+
+    while (count > 0)
+    {
+        x = DrawChar(x, y, digits[--count], color);
+    }
+    return x;
+}
+
+static uint16_t DrawFixed(uint16_t x, uint16_t y, float value, DWORD color)
+{
+    uint32_t hundredths = value > 0 ? (uint32_t)(value * 100.0f + 0.5f) : 0;
+    x = DrawNumber(x, y, hundredths / 100, 10, 1, color);
+    x = DrawChar(x, y, '.', color);
+    return DrawNumber(x, y, hundredths % 100, 10, 2, color);
+}
+
+// Raw frame times of the last FRAME_TIME_HISTORY frames, the line is the target frame time at half the height
+static void DrawFrameTimeGraph(uint16_t x, uint16_t y)
+{
+    uint64_t newest = perfData.TotalFramesRendered;
+
+    for (uint16_t i = 0; i < FRAME_TIME_HISTORY; i++)
+    {
+        uint16_t frameTime = perfData.FrameTimes[(newest + 1 + i) % FRAME_TIME_HISTORY];
+        uint32_t height = frameTime * (OVERLAY_GRAPH_HEIGHT / 2) / TARGET_MICROSECONDS_PER_FRAME;
+
+        if (height > OVERLAY_GRAPH_HEIGHT)
+        {
+            height = OVERLAY_GRAPH_HEIGHT;
+        }
+
+        FillRect(x + i, y + OVERLAY_GRAPH_HEIGHT - height, 1, height, frameTime > TARGET_MICROSECONDS_PER_FRAME ? OVERLAY_GRAPH_SLOW : OVERLAY_GRAPH);
+    }
+
+    FillRect(x, y + OVERLAY_GRAPH_HEIGHT / 2, FRAME_TIME_HISTORY, 1, OVERLAY_GRAPH_TARGET);
+}
+
+// The average time of each section over the target frame time, followed by the average and the p99 of each in milliseconds
+// The present runs on its own thread, next to the others, so it is left out of the bar
+static uint16_t DrawFrameBreakdown(uint16_t x, uint16_t y)
+{
+    uint16_t barX = x;
+    for (FRAME_SECTION section = 0; section < FRAME_SECTION_COUNT; section++)
+    {
+        if (section == FRAME_SECTION_PRESENT)
+        {
+            continue;
+        }
+
+        uint16_t width = FrameSectionAverage(section, OVERLAY_PROFILE_FRAMES) * FRAME_TIME_HISTORY / TARGET_MICROSECONDS_PER_FRAME;
+        if (barX + width > x + FRAME_TIME_HISTORY)
+        {
+            width = x + FRAME_TIME_HISTORY - barX;
+        }
+        FillRect(barX, y, width, OVERLAY_SPLIT_HEIGHT, sectionColors[section]);
+        barX += width;
+    }
+
+    y += OVERLAY_SPLIT_HEIGHT + 2;
+    for (FRAME_SECTION section = 0; section < FRAME_SECTION_COUNT; section++)
+    {
+        DWORD color = sectionColors[section];
+        DrawString(x, y, sectionLabels[section], color);
+        DrawFixed(x + 8 * FONT_ADVANCE, y, FrameSectionAverage(section, OVERLAY_PROFILE_FRAMES) / 1000.0f, color);
+        uint16_t p99X = DrawString(x + 14 * FONT_ADVANCE, y, "P99 ", color);
+        DrawFixed(p99X, y, FrameSectionPercentile(section, OVERLAY_PROFILE_FRAMES, 99) / 1000.0f, color);
+        y += FONT_LINE_HEIGHT;
+    }
+
+    return y;
+}
+
+// The cpu usage of the whole process, its handles and the resolution of the system timer in milliseconds
+static void DrawProcessCounters(uint16_t x, uint16_t y)
+{
+    x = DrawString(x, y, "PROC ", OVERLAY_TEXT);
+    x = DrawNumber(x, y, (uint64_t)(perfData.CPUPercent + 0.5), 10, 1, OVERLAY_TEXT);
+    x = DrawString(x, y, "% HND ", OVERLAY_TEXT);
+    x = DrawNumber(x, y, perfData.HandleCount, 10, 1, OVERLAY_TEXT);
+    x = DrawString(x, y, " TMR ", OVERLAY_TEXT);
+    DrawFixed(x, y, perfData.CurrentTimerResolution / 10000.0f, OVERLAY_TEXT);
+}
+
+// Draws the overlay again when it is time to, returns TRUE if it has changed
+BOOL UpdateOverlay(void)
+{
+    int64_t now;
+    QueryPerformanceCounter((LARGE_INTEGER *)&now);
+
+    if (lastUpdate != 0 && (now - lastUpdate) * 1000 / perfData.PerfFrequency < OVERLAY_UPDATE_MS)
+    {
+        return FALSE;
+    }
+    lastUpdate = now;
+
+    RECT windowRect;
+    GetClientRect(window, &windowRect);
+
+    FillRect(0, 0, OVERLAY_WIDTH, OVERLAY_HEIGHT, OVERLAY_BACKGROUND);
+
+    uint16_t x = 2;
+    uint16_t y = 2;
+    x = DrawString(x, y, "FPS ", OVERLAY_TEXT);
+    x = DrawFixed(x, y, perfData.CookedFPSAverage, OVERLAY_TEXT);
+    x = DrawString(x, y, " RAW ", OVERLAY_TEXT);
+    DrawFixed(x, y, perfData.RawFPSAverage, OVERLAY_TEXT);
+
+    x = 2;
+    y += FONT_LINE_HEIGHT;
+    x = DrawString(x, y, "W ", OVERLAY_TEXT);
+    x = DrawNumber(x, y, windowRect.right - windowRect.left, 10, 1, OVERLAY_TEXT);
+    x = DrawString(x, y, " H ", OVERLAY_TEXT);
+    x = DrawNumber(x, y, windowRect.bottom - windowRect.top, 10, 1, OVERLAY_TEXT);
+    x = DrawString(x, y, " X", OVERLAY_TEXT);
+    DrawNumber(x, y, perfData.CurrentScaleFactor, 10, 1, OVERLAY_TEXT);
+
+    x = 2;
+    y += FONT_LINE_HEIGHT;
+    x = DrawString(x, y, "PC ", OVERLAY_TEXT);
+    x = DrawNumber(x, y, cpu.registers.pc, 16, 4, OVERLAY_TEXT);
+    x = DrawChar(x, y, ' ', OVERLAY_TEXT);
+    x = DrawString(x, y, opcode_to_string[cpu.current_instruction.operation], OVERLAY_TEXT);
+
+    for (uint8_t i = 1; i < cpu.current_instruction.bytes && i < 3; i++)
+    {
+        x = DrawChar(x, y, ' ', OVERLAY_TEXT);
+        x = DrawNumber(x, y, cpu_memory[(uint16_t)(cpu.registers.pc + i)], 16, 2, OVERLAY_TEXT);
+    }
+
+    x = 2;
+    y += FONT_LINE_HEIGHT;
+    x = DrawString(x, y, "CYC ", OVERLAY_TEXT);
+    DrawNumber(x, y, cpu.cycle, 10, 1, OVERLAY_TEXT);
+
+    x = 2;
+    y += FONT_LINE_HEIGHT;
+    x = DrawString(x, y, "PPU CYC ", OVERLAY_TEXT);
+    DrawNumber(x, y, ppu_state.cycle, 10, 1, OVERLAY_TEXT);
+
+    y += FONT_LINE_HEIGHT + 2;
+    DrawFrameTimeGraph(2, y);
+
+    y += OVERLAY_GRAPH_HEIGHT + 3;
+    y = DrawFrameBreakdown(2, y);
+    DrawProcessCounters(2, y);
+
+    return TRUE;
+}
+
+// Blits the overlay into the bottom-up frame, which is width x height pixels with each nes pixel being the same number of them
+void BlitOverlay(PIXEL32 *frame, LONG width, LONG height)
+{
+    uint8_t xScale = width / NES_PX_WIDTH;
+    uint8_t yScale = height / NES_PX_HEIGHT;
+    PIXEL32 scaledRow[OVERLAY_WIDTH * SCALER_MAX_SCALE];
+
+    for (uint16_t row = 0; row < OVERLAY_HEIGHT; row++)
+    {
+        const PIXEL32 *src = overlay[row];
+
+        if (xScale > 1)
+        {
+            for (uint16_t x = 0; x < OVERLAY_WIDTH; x++)
+            {
+                for (uint8_t i = 0; i < xScale; i++)
+                {
+                    scaledRow[x * xScale + i] = overlay[row][x];
+                }
+            }
+            src = scaledRow;
+        }
+
+        for (uint8_t i = 0; i < yScale; i++)
+        {
+            LONG y = (OVERLAY_MARGIN + row) * yScale + i;
+            memcpy(frame + (height - 1 - y) * width + OVERLAY_MARGIN * xScale, src, OVERLAY_WIDTH * xScale * sizeof(PIXEL32));
+        }
+    }
+}
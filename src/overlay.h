@@ -0,0 +1,32 @@
+#ifndef OVERLAY_H
+
+#define OVERLAY_H
+
+#include <windows.h>
+#include <stdint.h>
+#include "main.h"
+
+// The overlay is drawn in nes pixels at the top left of the frame, and scaled with the frame it is blitted into
+#define OVERLAY_WIDTH 160
+#define OVERLAY_HEIGHT 140
+#define OVERLAY_MARGIN 4
+// The contents are only drawn again this often, the frames in between get the same overlay blitted
+#define OVERLAY_UPDATE_MS 250
+
+// Glyphs of 5 x 7 pixels, for the characters ' ' -> 'Z' (lower case is drawn as upper case)
+#define FONT_GLYPH_WIDTH 5
+#define FONT_GLYPH_HEIGHT 7
+#define FONT_FIRST_CHAR ' '
+#define FONT_LAST_CHAR 'Z'
+#define FONT_ADVANCE 6
+#define FONT_LINE_HEIGHT 9
+
+#define OVERLAY_GRAPH_HEIGHT 24
+#define OVERLAY_SPLIT_HEIGHT 5
+// The breakdown of the frame time is of this many of the latest frames
+#define OVERLAY_PROFILE_FRAMES 120
+
+BOOL UpdateOverlay(void);
+void BlitOverlay(PIXEL32 *frame, LONG width, LONG height);
+
+#endif
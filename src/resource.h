@@ -6,6 +6,18 @@
 #define ID_FILE_EXIT 9003
 
 #define ID_OPTIONS_TOGGLE_DEBUG 8001
+#define ID_OPTIONS_TOGGLE_INDEXED 8002
+#define ID_OPTIONS_TOGGLE_PIPELINE 8003
+#define ID_OPTIONS_TOGGLE_CAPTURE 8004
+#define ID_OPTIONS_NEXT_SCALER 8005
+#define ID_OPTIONS_BENCHMARK_SCALERS 8006
+#define ID_OPTIONS_TOGGLE_NTSC 8007
+#define ID_OPTIONS_TOGGLE_VIDEO 8008
+#define ID_OPTIONS_TOGGLE_CPU_TRACE 8009
+#define ID_OPTIONS_TOGGLE_INPUT_RECORDING 8010
+#define ID_OPTIONS_DUMP_FRAME_PROFILE 8011
+#define ID_OPTIONS_TOGGLE_EVENT_TRACE 8012
+#define ID_OPTIONS_TOGGLE_CPU_PROFILE 8013
 
 #define ID_WINDOW_SET_MAX_SCALE 7001
 #define ID_WINDOW_SET_MIN_SCALE 7002
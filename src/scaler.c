@@ -0,0 +1,494 @@
+#include <windows.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include "main.h"
+#include "logger.h"
+#include "scaler.h"
+
+/*
+    Software scaling of the presented frame, so GDI only has to copy it
+
+    Both the frame and the scaled frame are bottom-up DIBs. All the filters are symmetric, so they are run
+    on the rows in memory order, which gives the same result as running them top-down and flipping it.
+*/
+
+#define PADDED_WIDTH (NES_PX_WIDTH + 2 * SCALER_PADDING)
+#define PADDED_HEIGHT (NES_PX_HEIGHT + 2 * SCALER_PADDING)
+#define PADDED_ROW(y) (paddedFrame[(y) + SCALER_PADDING] + SCALER_PADDING)
+#define PADDED_YUV_ROW(y) (paddedYuv[(y) + SCALER_PADDING] + SCALER_PADDING)
+
+typedef struct YUV
+{
+    int16_t Y;
+    int16_t U;
+    int16_t V;
+} YUV;
+
+SCALER currentScaler = SCALER_GDI;
+PIXEL32 *scaledFrame;
+
+const char *scalerNames[SCALER_COUNT] =
+{
+    [SCALER_GDI] = "GDI",
+    [SCALER_NEAREST] = "Nearest",
+    [SCALER_SCALE2X] = "Scale2x",
+    [SCALER_SCALE3X] = "Scale3x",
+    [SCALER_XBR] = "2xBR",
+};
+
+// The frame with its edges repeated, so the filters can read the neighbours of every pixel without checks
+static PIXEL32 paddedFrame[PADDED_HEIGHT][PADDED_WIDTH];
+static YUV paddedYuv[PADDED_HEIGHT][PADDED_WIDTH];
+
+// Each group of 8 pixels in a scaled row is a permutation of 8 pixels in the source row, starting at the base
+// The base is kept inside the row, so the offsets go up to 7
+static uint16_t nearestBase[SCALER_MAX_SCALE + 1][NES_PX_WIDTH * SCALER_MAX_SCALE / 8];
+static uint8_t nearestOffsets[SCALER_MAX_SCALE + 1][NES_PX_WIDTH * SCALER_MAX_SCALE / 8][8];
+
+static BOOL scalerUseAVX2;
+
+// The band of rows given to each worker, the thread presenting does the first band itself
+static SCALER_WORKER scalerWorkers[SCALER_MAX_THREADS];
+static HANDLE scalerDoneEvents[SCALER_MAX_THREADS];
+static uint8_t numScalerWorkers;
+static volatile BOOL scalerStop;
+
+static struct
+{
+    SCALE_BAND_FUNC Func;
+    const PIXEL32 *Src;
+    PIXEL32 *Dst;
+    uint8_t Scale;
+} scalerJob;
+
+static DWORD WINAPI ScalerWorkerProc(LPVOID param)
+{
+    uint8_t i = (uint8_t)(uintptr_t)param;
+
+    while (TRUE)
+    {
+        WaitForSingleObject(scalerWorkers[i].StartEvent, INFINITE);
+
+        if (scalerStop)
+        {
+            return 0;
+        }
+
+        scalerJob.Func(scalerJob.Src, scalerJob.Dst, scalerJob.Scale, scalerWorkers[i].FirstRow, scalerWorkers[i].LastRow);
+        SetEvent(scalerDoneEvents[i]);
+    }
+}
+
+BOOL InitScalers(void)
+{
+    scaledFrame = VirtualAlloc(NULL, DRAW_AREA_MEMORY_SIZE * SCALER_MAX_SCALE * SCALER_MAX_SCALE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+    if (scaledFrame == NULL)
+    {
+        Log("Unable to allocate the scaled frame", LL_ERROR);
+        return FALSE;
+    }
+
+    for (uint8_t scale = 1; scale <= SCALER_MAX_SCALE; scale++)
+    {
+        for (uint16_t group = 0; group < NES_PX_WIDTH * scale / 8; group++)
+        {
+            uint16_t x = group * 8;
+            uint16_t base = x / scale < NES_PX_WIDTH - 8 ? x / scale : NES_PX_WIDTH - 8;
+            nearestBase[scale][group] = base;
+
+            for (uint8_t i = 0; i < 8; i++)
+            {
+                nearestOffsets[scale][group][i] = (x + i) / scale - base;
+            }
+        }
+    }
+
+    __builtin_cpu_init();
+    scalerUseAVX2 = __builtin_cpu_supports("avx2");
+
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    numScalerWorkers = systemInfo.dwNumberOfProcessors - 1 < SCALER_MAX_THREADS ? systemInfo.dwNumberOfProcessors - 1 : SCALER_MAX_THREADS;
+    scalerStop = FALSE;
+
+    for (uint8_t i = 0; i < numScalerWorkers; i++)
+    {
+        scalerWorkers[i].StartEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+        scalerDoneEvents[i] = CreateEventA(NULL, FALSE, FALSE, NULL);
+        scalerWorkers[i].Thread = CreateThread(NULL, 0, ScalerWorkerProc, (LPVOID)(uintptr_t)i, 0, NULL);
+
+        if (scalerWorkers[i].Thread == NULL)
+        {
+            Log("Unable to create a scaler thread", LL_WARNING);
+            CloseHandle(scalerWorkers[i].StartEvent);
+            CloseHandle(scalerDoneEvents[i]);
+            numScalerWorkers = i;
+            break;
+        }
+    }
+
+    Logf("Scalers use %d threads", LL_INFO, numScalerWorkers + 1);
+    return TRUE;
+}
+
+void FreeScalers(void)
+{
+    scalerStop = TRUE;
+
+    for (uint8_t i = 0; i < numScalerWorkers; i++)
+    {
+        SetEvent(scalerWorkers[i].StartEvent);
+        WaitForSingleObject(scalerWorkers[i].Thread, INFINITE);
+        CloseHandle(scalerWorkers[i].Thread);
+        CloseHandle(scalerWorkers[i].StartEvent);
+        CloseHandle(scalerDoneEvents[i]);
+    }
+
+    numScalerWorkers = 0;
+    VirtualFree(scaledFrame, 0, MEM_RELEASE);
+}
+
+// Runs the band function over all rows, split between the worker threads when threaded
+void RunScalerBands(SCALE_BAND_FUNC func, const PIXEL32 *src, PIXEL32 *dst, uint8_t scale, BOOL threaded)
+{
+    uint8_t numBands = threaded ? numScalerWorkers + 1 : 1;
+
+    scalerJob.Func = func;
+    scalerJob.Src = src;
+    scalerJob.Dst = dst;
+    scalerJob.Scale = scale;
+
+    for (uint8_t i = 0; i < numBands - 1; i++)
+    {
+        scalerWorkers[i].FirstRow = NES_PX_HEIGHT * (i + 1) / numBands;
+        scalerWorkers[i].LastRow = NES_PX_HEIGHT * (i + 2) / numBands;
+        SetEvent(scalerWorkers[i].StartEvent);
+    }
+
+    func(src, dst, scale, 0, NES_PX_HEIGHT / numBands);
+
+    if (numBands > 1)
+    {
+        WaitForMultipleObjects(numBands - 1, scalerDoneEvents, TRUE, INFINITE);
+    }
+}
+
+static void PadFrame(const PIXEL32 *src, BOOL withYuv)
+{
+    for (int16_t y = -SCALER_PADDING; y < NES_PX_HEIGHT + SCALER_PADDING; y++)
+    {
+        const PIXEL32 *srcRow = src + (y < 0 ? 0 : y >= NES_PX_HEIGHT ? NES_PX_HEIGHT - 1 : y) * NES_PX_WIDTH;
+        PIXEL32 *row = PADDED_ROW(y);
+
+        memcpy(row, srcRow, NES_PX_WIDTH * sizeof(PIXEL32));
+        for (int8_t x = 1; x <= SCALER_PADDING; x++)
+        {
+            row[-x] = srcRow[0];
+            row[NES_PX_WIDTH - 1 + x] = srcRow[NES_PX_WIDTH - 1];
+        }
+
+        if (!withYuv)
+        {
+            continue;
+        }
+
+        YUV *yuvRow = PADDED_YUV_ROW(y);
+        for (int16_t x = -SCALER_PADDING; x < NES_PX_WIDTH + SCALER_PADDING; x++)
+        {
+            int16_t r = row[x].BGRA.Red;
+            int16_t g = row[x].BGRA.Green;
+            int16_t b = row[x].BGRA.Blue;
+            yuvRow[x].Y = (77 * r + 150 * g + 29 * b) >> 8;
+            yuvRow[x].U = (-43 * r - 85 * g + 128 * b) >> 8;
+            yuvRow[x].V = (128 * r - 107 * g - 21 * b) >> 8;
+        }
+    }
+}
+
+__attribute__((target("avx2"))) static void NearestRowAVX2(const PIXEL32 *src, PIXEL32 *dst, uint8_t scale)
+{
+    for (uint16_t group = 0; group < NES_PX_WIDTH * scale / 8; group++)
+    {
+        __m256i pixels = _mm256_loadu_si256((const __m256i *)(src + nearestBase[scale][group]));
+        __m256i offsets = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)nearestOffsets[scale][group]));
+        _mm256_storeu_si256((__m256i *)(dst + group * 8), _mm256_permutevar8x32_epi32(pixels, offsets));
+    }
+}
+
+static void NearestRow(const PIXEL32 *src, PIXEL32 *dst, uint8_t scale)
+{
+    for (uint16_t group = 0; group < NES_PX_WIDTH * scale / 8; group++)
+    {
+        const PIXEL32 *base = src + nearestBase[scale][group];
+        for (uint8_t i = 0; i < 8; i++)
+        {
+            dst[group * 8 + i] = base[nearestOffsets[scale][group][i]];
+        }
+    }
+}
+
+static void NearestBand(const PIXEL32 *src, PIXEL32 *dst, uint8_t scale, uint16_t firstRow, uint16_t lastRow)
+{
+    uint16_t width = NES_PX_WIDTH * scale;
+
+    for (uint16_t y = firstRow; y < lastRow; y++)
+    {
+        PIXEL32 *dstRow = dst + y * scale * width;
+
+        if (scalerUseAVX2)
+        {
+            NearestRowAVX2(src + y * NES_PX_WIDTH, dstRow, scale);
+        }
+        else
+        {
+            NearestRow(src + y * NES_PX_WIDTH, dstRow, scale);
+        }
+
+        // The other rows of the pixel are copies of the first one
+        for (uint8_t i = 1; i < scale; i++)
+        {
+            memcpy(dstRow + i * width, dstRow, width * sizeof(PIXEL32));
+        }
+    }
+}
+
+static inline __m128i Select(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Four pixels at a time, with the neighbours above (B), left (D), right (F) and below (H) compared as whole pixels
+//  E0 E1
+//  E2 E3
+static void Scale2xBand(const PIXEL32 *src, PIXEL32 *dst, uint8_t scale, uint16_t firstRow, uint16_t lastRow)
+{
+    uint16_t width = NES_PX_WIDTH * 2;
+
+    for (uint16_t y = firstRow; y < lastRow; y++)
+    {
+        const PIXEL32 *above = PADDED_ROW(y - 1);
+        const PIXEL32 *row = PADDED_ROW(y);
+        const PIXEL32 *below = PADDED_ROW(y + 1);
+        PIXEL32 *dstRow0 = dst + 2 * y * width;
+        PIXEL32 *dstRow1 = dstRow0 + width;
+
+        for (uint16_t x = 0; x < NES_PX_WIDTH; x += 4)
+        {
+            __m128i b = _mm_loadu_si128((const __m128i *)(above + x));
+            __m128i d = _mm_loadu_si128((const __m128i *)(row + x - 1));
+            __m128i e = _mm_loadu_si128((const __m128i *)(row + x));
+            __m128i f = _mm_loadu_si128((const __m128i *)(row + x + 1));
+            __m128i h = _mm_loadu_si128((const __m128i *)(below + x));
+
+            __m128i db = _mm_cmpeq_epi32(d, b);
+            __m128i bf = _mm_cmpeq_epi32(b, f);
+            __m128i dh = _mm_cmpeq_epi32(d, h);
+            __m128i hf = _mm_cmpeq_epi32(h, f);
+
+            __m128i e0 = Select(_mm_andnot_si128(_mm_or_si128(bf, dh), db), d, e); // D == B && B != F && D != H
+            __m128i e1 = Select(_mm_andnot_si128(_mm_or_si128(db, hf), bf), f, e); // B == F && B != D && F != H
+            __m128i e2 = Select(_mm_andnot_si128(_mm_or_si128(db, hf), dh), d, e); // D == H && D != B && H != F
+            __m128i e3 = Select(_mm_andnot_si128(_mm_or_si128(dh, bf), hf), f, e); // H == F && D != H && B != F
+
+            _mm_storeu_si128((__m128i *)(dstRow0 + 2 * x), _mm_unpacklo_epi32(e0, e1));
+            _mm_storeu_si128((__m128i *)(dstRow0 + 2 * x + 4), _mm_unpackhi_epi32(e0, e1));
+            _mm_storeu_si128((__m128i *)(dstRow1 + 2 * x), _mm_unpacklo_epi32(e2, e3));
+            _mm_storeu_si128((__m128i *)(dstRow1 + 2 * x + 4), _mm_unpackhi_epi32(e2, e3));
+        }
+    }
+}
+
+//  A B C     E0 E1 E2
+//  D E F ->  E3 E4 E5
+//  G H I     E6 E7 E8
+static void Scale3xBand(const PIXEL32 *src, PIXEL32 *dst, uint8_t scale, uint16_t firstRow, uint16_t lastRow)
+{
+    uint16_t width = NES_PX_WIDTH * 3;
+
+    for (uint16_t y = firstRow; y < lastRow; y++)
+    {
+        const PIXEL32 *above = PADDED_ROW(y - 1);
+        const PIXEL32 *row = PADDED_ROW(y);
+        const PIXEL32 *below = PADDED_ROW(y + 1);
+        PIXEL32 *dstRow0 = dst + 3 * y * width;
+        PIXEL32 *dstRow1 = dstRow0 + width;
+        PIXEL32 *dstRow2 = dstRow1 + width;
+
+        for (uint16_t x = 0; x < NES_PX_WIDTH; x++)
+        {
+            DWORD a = above[x - 1].Bytes, b = above[x].Bytes, c = above[x + 1].Bytes;
+            DWORD d = row[x - 1].Bytes, e = row[x].Bytes, f = row[x + 1].Bytes;
+            DWORD g = below[x - 1].Bytes, h = below[x].Bytes, i = below[x + 1].Bytes;
+
+            // Most pixels are inside an area of one color, and are just repeated
+            if (b == h || d == f)
+            {
+                dstRow0[3 * x].Bytes = dstRow0[3 * x + 1].Bytes = dstRow0[3 * x + 2].Bytes = e;
+                dstRow1[3 * x].Bytes = dstRow1[3 * x + 1].Bytes = dstRow1[3 * x + 2].Bytes = e;
+                dstRow2[3 * x].Bytes = dstRow2[3 * x + 1].Bytes = dstRow2[3 * x + 2].Bytes = e;
+                continue;
+            }
+
+            BOOL topLeft = d == b;
+            BOOL topRight = b == f;
+            BOOL bottomLeft = d == h;
+            BOOL bottomRight = h == f;
+
+            dstRow0[3 * x].Bytes = topLeft ? d : e;
+            dstRow0[3 * x + 1].Bytes = (topLeft && e != c) || (topRight && e != a) ? b : e;
+            dstRow0[3 * x + 2].Bytes = topRight ? f : e;
+            dstRow1[3 * x].Bytes = (topLeft && e != g) || (bottomLeft && e != a) ? d : e;
+            dstRow1[3 * x + 1].Bytes = e;
+            dstRow1[3 * x + 2].Bytes = (topRight && e != i) || (bottomRight && e != c) ? f : e;
+            dstRow2[3 * x].Bytes = bottomLeft ? d : e;
+            dstRow2[3 * x + 1].Bytes = (bottomLeft && e != i) || (bottomRight && e != g) ? h : e;
+            dstRow2[3 * x + 2].Bytes = bottomRight ? f : e;
+        }
+    }
+}
+
+static inline int32_t YuvDistance(const YUV *a, const YUV *b)
+{
+    return 48 * abs(a->Y - b->Y) + 7 * abs(a->U - b->U) + 6 * abs(a->V - b->V);
+}
+
+// The corner of the pixel at x, y in the direction sx, sy
+// With the corner to the bottom right, the neighbourhood is
+//        .  .  .
+//     .  A  B  C  .
+//     .  D  E  F  F4
+//     .  G  H  I  I4
+//        .  H5 I5
+// An edge goes through the corner when the colors change less along the B -> D direction than along E -> I
+static inline PIXEL32 XbrCorner(int16_t x, int16_t y, int8_t sx, int8_t sy)
+{
+#define PX(dx, dy) PADDED_ROW(y + (dy))[x + (dx)]
+#define DIST(ax, ay, bx, by) YuvDistance(&PADDED_YUV_ROW(y + (ay))[x + (ax)], &PADDED_YUV_ROW(y + (by))[x + (bx)])
+
+    PIXEL32 e = PX(0, 0);
+    PIXEL32 f = PX(sx, 0);
+    PIXEL32 h = PX(0, sy);
+
+    if (e.Bytes == f.Bytes || e.Bytes == h.Bytes)
+    {
+        return e;
+    }
+
+    int32_t edge = DIST(0, 0, sx, -sy) + DIST(0, 0, -sx, sy) + DIST(sx, sy, 2 * sx, 0) + DIST(sx, sy, 0, 2 * sy) + 4 * DIST(0, sy, sx, 0);
+    int32_t across = DIST(0, sy, -sx, 0) + DIST(0, sy, sx, 2 * sy) + DIST(sx, 0, 2 * sx, sy) + DIST(sx, 0, 0, -sy) + 4 * DIST(0, 0, sx, sy);
+
+    if (edge >= across)
+    {
+        return e;
+    }
+
+    // The corner is blended with the closest of the two neighbours along the edge
+    PIXEL32 n = DIST(0, 0, sx, 0) <= DIST(0, 0, 0, sy) ? f : h;
+    PIXEL32 px;
+    px.Bytes = ((e.Bytes & 0xFEFEFEFE) >> 1) + ((n.Bytes & 0xFEFEFEFE) >> 1);
+    return px;
+
+#undef PX
+#undef DIST
+}
+
+static void XbrBand(const PIXEL32 *src, PIXEL32 *dst, uint8_t scale, uint16_t firstRow, uint16_t lastRow)
+{
+    uint16_t width = NES_PX_WIDTH * 2;
+
+    for (uint16_t y = firstRow; y < lastRow; y++)
+    {
+        PIXEL32 *dstRow0 = dst + 2 * y * width;
+        PIXEL32 *dstRow1 = dstRow0 + width;
+
+        for (uint16_t x = 0; x < NES_PX_WIDTH; x++)
+        {
+            dstRow0[2 * x] = XbrCorner(x, y, -1, -1);
+            dstRow0[2 * x + 1] = XbrCorner(x, y, 1, -1);
+            dstRow1[2 * x] = XbrCorner(x, y, -1, 1);
+            dstRow1[2 * x + 1] = XbrCorner(x, y, 1, 1);
+        }
+    }
+}
+
+// Returns the scale factor of the scaled frame, which is 1 when the frame is left to GDI
+uint8_t ScaleFrame(SCALER scaler, const PIXEL32 *src, PIXEL32 *dst, uint8_t scale)
+{
+    if (scale > SCALER_MAX_SCALE)
+    {
+        scale = SCALER_MAX_SCALE;
+    }
+
+    // The fixed scale filters are used when they fit the window, any remaining scaling is done by GDI
+    switch (scaler)
+    {
+    case SCALER_NEAREST:
+        if (scale < 2)
+        {
+            return 1;
+        }
+        RunScalerBands(NearestBand, src, dst, scale, scale >= SCALER_THREAD_MIN_SCALE);
+        return scale;
+    case SCALER_SCALE2X:
+        if (scale < 2)
+        {
+            return 1;
+        }
+        PadFrame(src, FALSE);
+        RunScalerBands(Scale2xBand, src, dst, 2, FALSE);
+        return 2;
+    case SCALER_SCALE3X:
+        if (scale < 3)
+        {
+            return 1;
+        }
+        PadFrame(src, FALSE);
+        RunScalerBands(Scale3xBand, src, dst, 3, FALSE);
+        return 3;
+    case SCALER_XBR:
+        if (scale < 2)
+        {
+            return 1;
+        }
+        PadFrame(src, TRUE);
+        RunScalerBands(XbrBand, src, dst, 2, TRUE);
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+void BenchmarkScalers(const PIXEL32 *src, PIXEL32 *dst)
+{
+    int64_t frequency;
+    QueryPerformanceFrequency((LARGE_INTEGER *)&frequency);
+
+    for (SCALER scaler = SCALER_NEAREST; scaler < SCALER_COUNT; scaler++)
+    {
+        for (uint8_t scale = 2; scale <= SCALER_MAX_SCALE; scale++)
+        {
+            // The fixed scale filters are only measured at their own scale
+            if (ScaleFrame(scaler, src, dst, scale) != scale)
+            {
+                continue;
+            }
+
+            int64_t start, end;
+            QueryPerformanceCounter((LARGE_INTEGER *)&start);
+
+            for (uint16_t i = 0; i < SCALER_BENCHMARK_FRAMES; i++)
+            {
+                ScaleFrame(scaler, src, dst, scale);
+            }
+
+            QueryPerformanceCounter((LARGE_INTEGER *)&end);
+
+            double seconds = (double)(end - start) / frequency;
+            double megapixels = (double)NES_PX_WIDTH * NES_PX_HEIGHT * scale * scale * SCALER_BENCHMARK_FRAMES / 1000000.0;
+            Logf("Scaler %s x%d: %.1f MP/s (%.3f ms per frame)", LL_INFO, scalerNames[scaler], scale, megapixels / seconds, seconds * 1000.0 / SCALER_BENCHMARK_FRAMES);
+        }
+    }
+}
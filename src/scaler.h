@@ -0,0 +1,48 @@
+#ifndef SCALER_H
+
+#define SCALER_H
+
+#include <windows.h>
+#include <stdint.h>
+#include "main.h"
+
+#define SCALER_MAX_SCALE 8
+// Nearest neighbour scaling is split into bands on more threads from this scale factor (xBR always is)
+#define SCALER_THREAD_MIN_SCALE 4
+#define SCALER_MAX_THREADS 7
+// Rows and columns of replicated edge pixels around the frame, for the filters looking at neighbours
+#define SCALER_PADDING 2
+#define SCALER_BENCHMARK_FRAMES 200
+
+typedef enum SCALER
+{
+    SCALER_GDI,     // Scaled by StretchDIBits
+    SCALER_NEAREST, // Integer nearest neighbour, to the scale factor of the window
+    SCALER_SCALE2X,
+    SCALER_SCALE3X,
+    SCALER_XBR,     // 2xBR
+    SCALER_COUNT,
+} SCALER;
+
+// Scales the rows firstRow -> lastRow (excluding) of the frame
+typedef void (*SCALE_BAND_FUNC)(const PIXEL32 *src, PIXEL32 *dst, uint8_t scale, uint16_t firstRow, uint16_t lastRow);
+
+typedef struct SCALER_WORKER
+{
+    HANDLE Thread;
+    HANDLE StartEvent;
+    uint16_t FirstRow;
+    uint16_t LastRow;
+} SCALER_WORKER;
+
+extern SCALER currentScaler;
+extern PIXEL32 *scaledFrame;
+extern const char *scalerNames[SCALER_COUNT];
+
+BOOL InitScalers(void);
+void FreeScalers(void);
+void RunScalerBands(SCALE_BAND_FUNC func, const PIXEL32 *src, PIXEL32 *dst, uint8_t scale, BOOL threaded);
+uint8_t ScaleFrame(SCALER scaler, const PIXEL32 *src, PIXEL32 *dst, uint8_t scale);
+void BenchmarkScalers(const PIXEL32 *src, PIXEL32 *dst);
+
+#endif
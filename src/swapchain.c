@@ -0,0 +1,108 @@
+#include <windows.h>
+#include <stdint.h>
+#include <string.h>
+#include "main.h"
+#include "logger.h"
+#include "swapchain.h"
+#include "video.h"
+#include "./nes/ppu.h"
+
+/*
+    The ppu and the present thread never wait for each other
+
+    When the ppu has completed a frame, it swaps the frame it has drawn with the waiting one and carries on in that one.
+    The present thread swaps the frame it has shown with the waiting one, when that is newer than the one it has.
+    A frame is therefore never written while it is presented, and the newest complete frame is always the one presented next.
+*/
+
+SWAP_CHAIN swapChain;
+
+BOOL InitSwapChain(void)
+{
+    uint32_t size = (DRAW_AREA_MEMORY_SIZE + INDEXED_FRAME_SIZE) * SWAP_CHAIN_LENGTH;
+    uint8_t *memory = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+    if (memory == NULL)
+    {
+        Logf("Unable to allocate swap chain memory of %d bytes", LL_ERROR, size);
+        return FALSE;
+    }
+
+    for (uint8_t i = 0; i < SWAP_CHAIN_LENGTH; i++)
+    {
+        swapChain.Frames[i] = memory + i * DRAW_AREA_MEMORY_SIZE;
+        swapChain.IndexedFrames[i] = memory + SWAP_CHAIN_LENGTH * DRAW_AREA_MEMORY_SIZE + i * INDEXED_FRAME_SIZE;
+        swapChain.HasIndexed[i] = FALSE;
+    }
+
+    swapChain.Drawing = 0;
+    swapChain.Ready = 1;
+    swapChain.Presenting = 2;
+    swapChain.FrameEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+
+    backBuffer.Memory = swapChain.Frames[swapChain.Drawing];
+    return TRUE;
+}
+
+void FreeSwapChain(void)
+{
+    CloseHandle(swapChain.FrameEvent);
+    VirtualFree(swapChain.Frames[0], 0, MEM_RELEASE);
+    swapChain.Frames[0] = NULL;
+    backBuffer.Memory = NULL;
+}
+
+// Called by the ppu (on the render thread when it is pipelined) when a frame has been drawn
+void PublishFrame(void)
+{
+    // Nothing is presented without a window (the render tool)
+    if (swapChain.Frames[0] == NULL)
+    {
+        return;
+    }
+
+    // Only the indices of an indexed frame are copied, the present thread converts the frames it takes (ConvertTakenFrame)
+    // Frames replaced before they are presented are never converted
+    swapChain.HasIndexed[swapChain.Drawing] = ppu_output == PPU_OUTPUT_INDEXED;
+    if (ppu_output == PPU_OUTPUT_INDEXED)
+    {
+        memcpy(swapChain.IndexedFrames[swapChain.Drawing], indexed_frame, NES_PX_WIDTH * NES_PX_HEIGHT);
+        memcpy(swapChain.IndexedFrames[swapChain.Drawing] + NES_PX_WIDTH * NES_PX_HEIGHT, indexed_frame_emphasis, NES_PX_HEIGHT);
+    }
+
+    void *drawn = backBuffer.Memory;
+    LONG ready = InterlockedExchange(&swapChain.Ready, swapChain.Drawing | SWAP_CHAIN_FRESH_BIT);
+    swapChain.Drawing = ready & SWAP_CHAIN_INDEX_BITS;
+    backBuffer.Memory = swapChain.Frames[swapChain.Drawing];
+
+    // Scanlines are only drawn while the ppu is dirty, so the frame drawn next might only have some of them
+    // The others are the same as in this frame, which the ppu no longer has (the indexed frame is never swapped)
+    if (ppu_output == PPU_OUTPUT_BGRA && !ppu_state.dirty_frames)
+    {
+        memcpy(backBuffer.Memory, drawn, DRAW_AREA_MEMORY_SIZE);
+    }
+
+    SetEvent(swapChain.FrameEvent);
+}
+
+// Called by the present thread, returns TRUE if a newer frame is taken
+BOOL TakeFrame(void)
+{
+    if (!(swapChain.Ready & SWAP_CHAIN_FRESH_BIT))
+    {
+        return FALSE;
+    }
+
+    swapChain.Presenting = InterlockedExchange(&swapChain.Ready, swapChain.Presenting) & SWAP_CHAIN_INDEX_BITS;
+    return TRUE;
+}
+
+// Called by the present thread after taking a frame, so the BGRA frame is complete for the scalers and the overlay
+void ConvertTakenFrame(void)
+{
+    if (swapChain.HasIndexed[swapChain.Presenting])
+    {
+        uint8_t *indexed = swapChain.IndexedFrames[swapChain.Presenting];
+        ConvertIndexedToBGRA(indexed, indexed + NES_PX_WIDTH * NES_PX_HEIGHT, swapChain.Frames[swapChain.Presenting], TRUE);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef SWAPCHAIN_H
+
+#define SWAPCHAIN_H
+
+#include <windows.h>
+#include <stdint.h>
+#include "main.h"
+
+// One frame being drawn by the ppu, one complete frame waiting and one being presented
+#define SWAP_CHAIN_LENGTH 3
+#define SWAP_CHAIN_INDEX_BITS 0x3
+// Set with the index of the waiting frame when it has not been taken by the present thread yet
+#define SWAP_CHAIN_FRESH_BIT 0x4
+// The palette indices of a frame followed by the emphasis of each row, converted to BGRA by the present thread and read by the NTSC filter
+#define INDEXED_FRAME_SIZE (NES_PX_WIDTH * NES_PX_HEIGHT + NES_PX_HEIGHT)
+
+typedef struct SWAP_CHAIN
+{
+    void *Frames[SWAP_CHAIN_LENGTH];
+    uint8_t *IndexedFrames[SWAP_CHAIN_LENGTH];
+    BOOL HasIndexed[SWAP_CHAIN_LENGTH]; // Set when the frame was drawn in the indexed output
+    HANDLE FrameEvent; // Set when a frame is published
+
+    // Each index is owned by one thread, and they only trade indices through the waiting one
+    LONG Drawing;         // The frame the ppu draws into (backBuffer.Memory)
+    volatile LONG Ready;  // The latest complete frame, with the fresh bit
+    LONG Presenting;      // The frame shown by the present thread
+} SWAP_CHAIN;
+
+extern SWAP_CHAIN swapChain;
+
+BOOL InitSwapChain(void);
+void FreeSwapChain(void);
+void PublishFrame(void);
+BOOL TakeFrame(void);
+void ConvertTakenFrame(void);
+
+#endif
@@ -0,0 +1,988 @@
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../main.h"
+#include "../logger.h"
+#include "../nes/loader.h"
+#include "../nes/cpu.h"
+
+/*
+    Runs random instructions on both perform_instruction and a simple reference 6502, and compares the results
+
+    cpufuzz <instructions> [seed] [workers]
+
+    Each case is one of the 151 legal opcodes with random operands, registers and memory. After it has run on both,
+    the registers, the flags (except B and bit 5, which only exist on the stack), every byte written and the cycles are compared.
+    The cpu is global state, so the cases are split between worker processes, one per core unless given,
+    each testing its own share of the opcodes so a mismatch is reported once.
+
+    On the first mismatch of an opcode the case is made smaller (registers and bytes set to 0 while it still fails)
+    and printed with every byte it reads, so it can be replayed on its own. The other mismatches are only counted.
+    The cycles are compared exactly, with those of page crossings and taken branches shown apart when printing a case.
+*/
+
+#define WORKER_ARGUMENT "--worker"
+#define NUM_LEGAL_OPCODES 151
+// The memory is filled with new random bytes every so many cases
+#define REFILL_INTERVAL 0x1000
+// Reads and writes an instruction can do, BRK has the most with 3 writes and 5 reads
+#define MAX_ACCESSES 16
+
+typedef struct REFERENCE_OPCODE
+{
+    uint8_t Opcode;
+    OPERATION Operation;
+    ADDR_MODE AddrMode;
+    uint8_t Cycles;
+    BOOL PagePenalty; // One more cycle when the indexed address is on another page
+} REFERENCE_OPCODE;
+
+// From the 6502 datasheet, independent of instruction_set
+static const REFERENCE_OPCODE referenceOpcodes[NUM_LEGAL_OPCODES] = {
+    {0x69, ADC, ADDR_IMMEDIATE, 2, 0}, {0x65, ADC, ADDR_ZEROPAGE, 3, 0}, {0x75, ADC, ADDR_ZEROPAGE_X, 4, 0}, {0x6D, ADC, ADDR_ABSOLUTE, 4, 0},
+    {0x7D, ADC, ADDR_ABSOLUTE_X, 4, 1}, {0x79, ADC, ADDR_ABSOLUTE_Y, 4, 1}, {0x61, ADC, ADDR_X_INDIRECT, 6, 0}, {0x71, ADC, ADDR_INDIRECT_Y, 5, 1},
+    {0x29, AND, ADDR_IMMEDIATE, 2, 0}, {0x25, AND, ADDR_ZEROPAGE, 3, 0}, {0x35, AND, ADDR_ZEROPAGE_X, 4, 0}, {0x2D, AND, ADDR_ABSOLUTE, 4, 0},
+    {0x3D, AND, ADDR_ABSOLUTE_X, 4, 1}, {0x39, AND, ADDR_ABSOLUTE_Y, 4, 1}, {0x21, AND, ADDR_X_INDIRECT, 6, 0}, {0x31, AND, ADDR_INDIRECT_Y, 5, 1},
+    {0x0A, ASL, ADDR_ACCUMULATOR, 2, 0}, {0x06, ASL, ADDR_ZEROPAGE, 5, 0}, {0x16, ASL, ADDR_ZEROPAGE_X, 6, 0}, {0x0E, ASL, ADDR_ABSOLUTE, 6, 0},
+    {0x1E, ASL, ADDR_ABSOLUTE_X, 7, 0},
+    {0x90, BCC, ADDR_RELATIVE, 2, 0}, {0xB0, BCS, ADDR_RELATIVE, 2, 0}, {0xF0, BEQ, ADDR_RELATIVE, 2, 0}, {0x30, BMI, ADDR_RELATIVE, 2, 0},
+    {0xD0, BNE, ADDR_RELATIVE, 2, 0}, {0x10, BPL, ADDR_RELATIVE, 2, 0}, {0x50, BVC, ADDR_RELATIVE, 2, 0}, {0x70, BVS, ADDR_RELATIVE, 2, 0},
+    {0x24, BIT, ADDR_ZEROPAGE, 3, 0}, {0x2C, BIT, ADDR_ABSOLUTE, 4, 0},
+    {0x00, BRK, ADDR_IMPLIED, 7, 0},
+    {0x18, CLC, ADDR_IMPLIED, 2, 0}, {0xD8, CLD, ADDR_IMPLIED, 2, 0}, {0x58, CLI, ADDR_IMPLIED, 2, 0}, {0xB8, CLV, ADDR_IMPLIED, 2, 0},
+    {0xC9, CMP, ADDR_IMMEDIATE, 2, 0}, {0xC5, CMP, ADDR_ZEROPAGE, 3, 0}, {0xD5, CMP, ADDR_ZEROPAGE_X, 4, 0}, {0xCD, CMP, ADDR_ABSOLUTE, 4, 0},
+    {0xDD, CMP, ADDR_ABSOLUTE_X, 4, 1}, {0xD9, CMP, ADDR_ABSOLUTE_Y, 4, 1}, {0xC1, CMP, ADDR_X_INDIRECT, 6, 0}, {0xD1, CMP, ADDR_INDIRECT_Y, 5, 1},
+    {0xE0, CPX, ADDR_IMMEDIATE, 2, 0}, {0xE4, CPX, ADDR_ZEROPAGE, 3, 0}, {0xEC, CPX, ADDR_ABSOLUTE, 4, 0},
+    {0xC0, CPY, ADDR_IMMEDIATE, 2, 0}, {0xC4, CPY, ADDR_ZEROPAGE, 3, 0}, {0xCC, CPY, ADDR_ABSOLUTE, 4, 0},
+    {0xC6, DEC, ADDR_ZEROPAGE, 5, 0}, {0xD6, DEC, ADDR_ZEROPAGE_X, 6, 0}, {0xCE, DEC, ADDR_ABSOLUTE, 6, 0}, {0xDE, DEC, ADDR_ABSOLUTE_X, 7, 0},
+    {0xCA, DEX, ADDR_IMPLIED, 2, 0}, {0x88, DEY, ADDR_IMPLIED, 2, 0},
+    {0x49, EOR, ADDR_IMMEDIATE, 2, 0}, {0x45, EOR, ADDR_ZEROPAGE, 3, 0}, {0x55, EOR, ADDR_ZEROPAGE_X, 4, 0}, {0x4D, EOR, ADDR_ABSOLUTE, 4, 0},
+    {0x5D, EOR, ADDR_ABSOLUTE_X, 4, 1}, {0x59, EOR, ADDR_ABSOLUTE_Y, 4, 1}, {0x41, EOR, ADDR_X_INDIRECT, 6, 0}, {0x51, EOR, ADDR_INDIRECT_Y, 5, 1},
+    {0xE6, INC, ADDR_ZEROPAGE, 5, 0}, {0xF6, INC, ADDR_ZEROPAGE_X, 6, 0}, {0xEE, INC, ADDR_ABSOLUTE, 6, 0}, {0xFE, INC, ADDR_ABSOLUTE_X, 7, 0},
+    {0xE8, INX, ADDR_IMPLIED, 2, 0}, {0xC8, INY, ADDR_IMPLIED, 2, 0},
+    {0x4C, JMP, ADDR_ABSOLUTE, 3, 0}, {0x6C, JMP, ADDR_INDIRECT, 5, 0},
+    {0x20, JSR, ADDR_ABSOLUTE, 6, 0},
+    {0xA9, LDA, ADDR_IMMEDIATE, 2, 0}, {0xA5, LDA, ADDR_ZEROPAGE, 3, 0}, {0xB5, LDA, ADDR_ZEROPAGE_X, 4, 0}, {0xAD, LDA, ADDR_ABSOLUTE, 4, 0},
+    {0xBD, LDA, ADDR_ABSOLUTE_X, 4, 1}, {0xB9, LDA, ADDR_ABSOLUTE_Y, 4, 1}, {0xA1, LDA, ADDR_X_INDIRECT, 6, 0}, {0xB1, LDA, ADDR_INDIRECT_Y, 5, 1},
+    {0xA2, LDX, ADDR_IMMEDIATE, 2, 0}, {0xA6, LDX, ADDR_ZEROPAGE, 3, 0}, {0xB6, LDX, ADDR_ZEROPAGE_Y, 4, 0}, {0xAE, LDX, ADDR_ABSOLUTE, 4, 0},
+    {0xBE, LDX, ADDR_ABSOLUTE_Y, 4, 1},
+    {0xA0, LDY, ADDR_IMMEDIATE, 2, 0}, {0xA4, LDY, ADDR_ZEROPAGE, 3, 0}, {0xB4, LDY, ADDR_ZEROPAGE_X, 4, 0}, {0xAC, LDY, ADDR_ABSOLUTE, 4, 0},
+    {0xBC, LDY, ADDR_ABSOLUTE_X, 4, 1},
+    {0x4A, LSR, ADDR_ACCUMULATOR, 2, 0}, {0x46, LSR, ADDR_ZEROPAGE, 5, 0}, {0x56, LSR, ADDR_ZEROPAGE_X, 6, 0}, {0x4E, LSR, ADDR_ABSOLUTE, 6, 0},
+    {0x5E, LSR, ADDR_ABSOLUTE_X, 7, 0},
+    {0xEA, NOP, ADDR_IMPLIED, 2, 0},
+    {0x09, ORA, ADDR_IMMEDIATE, 2, 0}, {0x05, ORA, ADDR_ZEROPAGE, 3, 0}, {0x15, ORA, ADDR_ZEROPAGE_X, 4, 0}, {0x0D, ORA, ADDR_ABSOLUTE, 4, 0},
+    {0x1D, ORA, ADDR_ABSOLUTE_X, 4, 1}, {0x19, ORA, ADDR_ABSOLUTE_Y, 4, 1}, {0x01, ORA, ADDR_X_INDIRECT, 6, 0}, {0x11, ORA, ADDR_INDIRECT_Y, 5, 1},
+    {0x48, PHA, ADDR_IMPLIED, 3, 0}, {0x08, PHP, ADDR_IMPLIED, 3, 0}, {0x68, PLA, ADDR_IMPLIED, 4, 0}, {0x28, PLP, ADDR_IMPLIED, 4, 0},
+    {0x2A, ROL, ADDR_ACCUMULATOR, 2, 0}, {0x26, ROL, ADDR_ZEROPAGE, 5, 0}, {0x36, ROL, ADDR_ZEROPAGE_X, 6, 0}, {0x2E, ROL, ADDR_ABSOLUTE, 6, 0},
+    {0x3E, ROL, ADDR_ABSOLUTE_X, 7, 0},
+    {0x6A, ROR, ADDR_ACCUMULATOR, 2, 0}, {0x66, ROR, ADDR_ZEROPAGE, 5, 0}, {0x76, ROR, ADDR_ZEROPAGE_X, 6, 0}, {0x6E, ROR, ADDR_ABSOLUTE, 6, 0},
+    {0x7E, ROR, ADDR_ABSOLUTE_X, 7, 0},
+    {0x40, RTI, ADDR_IMPLIED, 6, 0}, {0x60, RTS, ADDR_IMPLIED, 6, 0},
+    {0xE9, SBC, ADDR_IMMEDIATE, 2, 0}, {0xE5, SBC, ADDR_ZEROPAGE, 3, 0}, {0xF5, SBC, ADDR_ZEROPAGE_X, 4, 0}, {0xED, SBC, ADDR_ABSOLUTE, 4, 0},
+    {0xFD, SBC, ADDR_ABSOLUTE_X, 4, 1}, {0xF9, SBC, ADDR_ABSOLUTE_Y, 4, 1}, {0xE1, SBC, ADDR_X_INDIRECT, 6, 0}, {0xF1, SBC, ADDR_INDIRECT_Y, 5, 1},
+    {0x38, SEC, ADDR_IMPLIED, 2, 0}, {0xF8, SED, ADDR_IMPLIED, 2, 0}, {0x78, SEI, ADDR_IMPLIED, 2, 0},
+    {0x85, STA, ADDR_ZEROPAGE, 3, 0}, {0x95, STA, ADDR_ZEROPAGE_X, 4, 0}, {0x8D, STA, ADDR_ABSOLUTE, 4, 0}, {0x9D, STA, ADDR_ABSOLUTE_X, 5, 0},
+    {0x99, STA, ADDR_ABSOLUTE_Y, 5, 0}, {0x81, STA, ADDR_X_INDIRECT, 6, 0}, {0x91, STA, ADDR_INDIRECT_Y, 6, 0},
+    {0x86, STX, ADDR_ZEROPAGE, 3, 0}, {0x96, STX, ADDR_ZEROPAGE_Y, 4, 0}, {0x8E, STX, ADDR_ABSOLUTE, 4, 0},
+    {0x84, STY, ADDR_ZEROPAGE, 3, 0}, {0x94, STY, ADDR_ZEROPAGE_X, 4, 0}, {0x8C, STY, ADDR_ABSOLUTE, 4, 0},
+    {0xAA, TAX, ADDR_IMPLIED, 2, 0}, {0xA8, TAY, ADDR_IMPLIED, 2, 0}, {0xBA, TSX, ADDR_IMPLIED, 2, 0}, {0x8A, TXA, ADDR_IMPLIED, 2, 0},
+    {0x9A, TXS, ADDR_IMPLIED, 2, 0}, {0x98, TYA, ADDR_IMPLIED, 2, 0},
+};
+
+typedef struct FUZZ_REGISTERS
+{
+    uint16_t Pc;
+    uint8_t Ac;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t Sr;
+    uint8_t Sp;
+} FUZZ_REGISTERS;
+
+typedef struct FUZZ_ACCESS
+{
+    uint16_t Address;
+    uint8_t Value;
+} FUZZ_ACCESS;
+
+// The memory of one side of a case, with the bytes it read and wrote
+typedef struct FUZZ_MEMORY
+{
+    uint8_t *Bytes;
+    FUZZ_ACCESS Reads[MAX_ACCESSES];
+    uint32_t NumReads;
+    FUZZ_ACCESS Writes[MAX_ACCESSES];
+    uint32_t NumWrites;
+} FUZZ_MEMORY;
+
+typedef struct FUZZ_RESULT
+{
+    FUZZ_REGISTERS Registers;
+    uint64_t Cycles;
+    uint64_t PenaltyCycles; // The part of the cycles from page crossings and taken branches
+} FUZZ_RESULT;
+
+// The flags which are only pushed to the stack, not kept by the cpu
+#define FLAGS_MASK ((uint8_t) ~(BIT_B | BIT_5))
+
+// The tool does not draw, the ppu is only linked with the cpu
+NES_BITMAP backBuffer;
+
+static const REFERENCE_OPCODE *referenceTable[256];
+static uint8_t *baseMemory;
+static FUZZ_MEMORY emulatorMemory;
+static FUZZ_MEMORY referenceMemory;
+static uint64_t randomState;
+
+static uint64_t Random(void)
+{
+    // xorshift64*
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return randomState * 0x2545F4914F6CDD1DULL;
+}
+
+// Random bytes with more of the values which are edge cases
+static uint8_t RandomRegister(void)
+{
+    static const uint8_t edges[] = {0x00, 0x01, 0x7F, 0x80, 0xFF};
+    uint64_t r = Random();
+    return (r & 0x7) == 0 ? edges[(r >> 3) % sizeof(edges)] : r >> 32;
+}
+
+static void RecordAccess(FUZZ_ACCESS *accesses, uint32_t *count, uint16_t address, uint8_t value)
+{
+    if (*count < MAX_ACCESSES)
+    {
+        accesses[*count].Address = address;
+        accesses[*count].Value = value;
+        (*count)++;
+    }
+}
+
+/* The mapper of the emulator side, the whole address space is memory */
+
+static uint8_t *FuzzGetMemoryPointer(uint16_t address)
+{
+    return &emulatorMemory.Bytes[address];
+}
+
+static BOOL IsMemoryPointer(uint8_t *ptr)
+{
+    return ptr >= emulatorMemory.Bytes && ptr < emulatorMemory.Bytes + CPU_MEMORY_SIZE;
+}
+
+static uint8_t FuzzReadPointer(uint8_t *ptr)
+{
+    if (IsMemoryPointer(ptr))
+    {
+        RecordAccess(emulatorMemory.Reads, &emulatorMemory.NumReads, ptr - emulatorMemory.Bytes, *ptr);
+    }
+    return *ptr;
+}
+
+static void FuzzWriteToPointer(uint8_t *ptr, uint8_t value)
+{
+    if (IsMemoryPointer(ptr))
+    {
+        RecordAccess(emulatorMemory.Writes, &emulatorMemory.NumWrites, ptr - emulatorMemory.Bytes, value);
+    }
+    *ptr = value;
+}
+
+static uint8_t FuzzReadMemory(uint16_t address)
+{
+    return FuzzReadPointer(&emulatorMemory.Bytes[address]);
+}
+
+static void FuzzWriteMemory(uint16_t address, uint8_t value)
+{
+    FuzzWriteToPointer(&emulatorMemory.Bytes[address], value);
+}
+
+static void RunEmulator(const FUZZ_REGISTERS *registers, FUZZ_RESULT *result)
+{
+    cpu.registers.pc = registers->Pc;
+    cpu.registers.ac = registers->Ac;
+    cpu.registers.x = registers->X;
+    cpu.registers.y = registers->Y;
+    cpu.registers.sr = registers->Sr;
+    cpu.registers.sp = registers->Sp;
+    cpu.cycle = 0;
+
+    // The cycles and the addressing mode of JMP are taken from the current instruction
+    cpu.current_instruction = instruction_set[emulatorMemory.Bytes[registers->Pc]];
+    perform_instruction(cpu.current_instruction);
+
+    result->Registers.Pc = cpu.registers.pc;
+    result->Registers.Ac = cpu.registers.ac;
+    result->Registers.X = cpu.registers.x;
+    result->Registers.Y = cpu.registers.y;
+    result->Registers.Sr = cpu.registers.sr;
+    result->Registers.Sp = cpu.registers.sp;
+    result->Cycles = cpu.cycle;
+    result->PenaltyCycles = 0;
+}
+
+/* The reference, written from the datasheet for clarity rather than speed */
+
+static uint8_t ReferenceRead(uint16_t address)
+{
+    uint8_t value = referenceMemory.Bytes[address];
+    RecordAccess(referenceMemory.Reads, &referenceMemory.NumReads, address, value);
+    return value;
+}
+
+static void ReferenceWrite(uint16_t address, uint8_t value)
+{
+    RecordAccess(referenceMemory.Writes, &referenceMemory.NumWrites, address, value);
+    referenceMemory.Bytes[address] = value;
+}
+
+static void Push(FUZZ_REGISTERS *r, uint8_t value)
+{
+    ReferenceWrite(STACK_BASE | r->Sp, value);
+    r->Sp--;
+}
+
+static uint8_t Pull(FUZZ_REGISTERS *r)
+{
+    r->Sp++;
+    return ReferenceRead(STACK_BASE | r->Sp);
+}
+
+static void SetNZ(FUZZ_REGISTERS *r, uint8_t value)
+{
+    SET_N(r->Sr, value >> 7);
+    SET_Z(r->Sr, value == 0);
+}
+
+static void Compare(FUZZ_REGISTERS *r, uint8_t a, uint8_t b)
+{
+    SET_C(r->Sr, a >= b);
+    SetNZ(r, a - b);
+}
+
+static void Add(FUZZ_REGISTERS *r, uint8_t value)
+{
+    // The nes has no decimal mode
+    uint16_t sum = r->Ac + value + (r->Sr & BIT_C);
+    SET_V(r->Sr, (~(r->Ac ^ value) & (r->Ac ^ sum) & 0x80) != 0);
+    SET_C(r->Sr, sum > 0xFF);
+    r->Ac = sum;
+    SetNZ(r, r->Ac);
+}
+
+static void RunReference(const FUZZ_REGISTERS *registers, FUZZ_RESULT *result)
+{
+    FUZZ_REGISTERS r = *registers;
+    const REFERENCE_OPCODE *opcode = referenceTable[ReferenceRead(r.Pc)];
+    uint64_t penalty = 0;
+
+    // Bytes after the opcode, read as they are needed
+    uint16_t operandPc = r.Pc + 1;
+    uint16_t address = 0;
+    BOOL hasAddress = TRUE;
+
+    switch (opcode->AddrMode)
+    {
+    case ADDR_IMMEDIATE:
+        address = operandPc;
+        r.Pc += 2;
+        break;
+    case ADDR_ZEROPAGE:
+        address = ReferenceRead(operandPc);
+        r.Pc += 2;
+        break;
+    case ADDR_ZEROPAGE_X:
+        address = (uint8_t)(ReferenceRead(operandPc) + r.X);
+        r.Pc += 2;
+        break;
+    case ADDR_ZEROPAGE_Y:
+        address = (uint8_t)(ReferenceRead(operandPc) + r.Y);
+        r.Pc += 2;
+        break;
+    case ADDR_ABSOLUTE:
+        address = ReferenceRead(operandPc) | (ReferenceRead(operandPc + 1) << 8);
+        r.Pc += 3;
+        break;
+    case ADDR_ABSOLUTE_X:
+    case ADDR_ABSOLUTE_Y:
+    {
+        uint16_t base = ReferenceRead(operandPc) | (ReferenceRead(operandPc + 1) << 8);
+        address = base + (opcode->AddrMode == ADDR_ABSOLUTE_X ? r.X : r.Y);
+        penalty += opcode->PagePenalty && (address & 0xFF00) != (base & 0xFF00);
+        r.Pc += 3;
+    }
+    break;
+    case ADDR_X_INDIRECT:
+    {
+        uint8_t pointer = ReferenceRead(operandPc) + r.X;
+        address = ReferenceRead(pointer) | (ReferenceRead((uint8_t)(pointer + 1)) << 8);
+        r.Pc += 2;
+    }
+    break;
+    case ADDR_INDIRECT_Y:
+    {
+        uint8_t pointer = ReferenceRead(operandPc);
+        uint16_t base = ReferenceRead(pointer) | (ReferenceRead((uint8_t)(pointer + 1)) << 8);
+        address = base + r.Y;
+        penalty += opcode->PagePenalty && (address & 0xFF00) != (base & 0xFF00);
+        r.Pc += 2;
+    }
+    break;
+    case ADDR_INDIRECT:
+    {
+        // The high byte of the pointer is read without carry from the low byte
+        uint16_t pointer = ReferenceRead(operandPc) | (ReferenceRead(operandPc + 1) << 8);
+        address = ReferenceRead(pointer) | (ReferenceRead((pointer & 0xFF00) | (uint8_t)(pointer + 1)) << 8);
+        r.Pc += 3;
+    }
+    break;
+    case ADDR_RELATIVE:
+        address = r.Pc + 2 + (int8_t)ReferenceRead(operandPc);
+        r.Pc += 2;
+        break;
+    default:
+        hasAddress = FALSE;
+        r.Pc += 1;
+        break;
+    }
+
+    BOOL branch = FALSE;
+    uint8_t value;
+
+    switch (opcode->Operation)
+    {
+    case ADC:
+        Add(&r, ReferenceRead(address));
+        break;
+    case SBC:
+        Add(&r, ~ReferenceRead(address));
+        break;
+    case AND:
+        r.Ac &= ReferenceRead(address);
+        SetNZ(&r, r.Ac);
+        break;
+    case ORA:
+        r.Ac |= ReferenceRead(address);
+        SetNZ(&r, r.Ac);
+        break;
+    case EOR:
+        r.Ac ^= ReferenceRead(address);
+        SetNZ(&r, r.Ac);
+        break;
+    case ASL:
+    case LSR:
+    case ROL:
+    case ROR:
+    {
+        value = hasAddress ? ReferenceRead(address) : r.Ac;
+        uint8_t carry = r.Sr & BIT_C;
+        uint8_t result;
+        if (opcode->Operation == ASL || opcode->Operation == ROL)
+        {
+            result = (value << 1) | (opcode->Operation == ROL ? carry : 0);
+            SET_C(r.Sr, value >> 7);
+        }
+        else
+        {
+            result = (value >> 1) | (opcode->Operation == ROR ? carry << 7 : 0);
+            SET_C(r.Sr, value & 1);
+        }
+        SetNZ(&r, result);
+
+        if (hasAddress)
+            ReferenceWrite(address, result);
+        else
+            r.Ac = result;
+    }
+    break;
+    case BCC:
+        branch = !(r.Sr & BIT_C);
+        break;
+    case BCS:
+        branch = r.Sr & BIT_C;
+        break;
+    case BNE:
+        branch = !(r.Sr & BIT_Z);
+        break;
+    case BEQ:
+        branch = r.Sr & BIT_Z;
+        break;
+    case BPL:
+        branch = !(r.Sr & BIT_N);
+        break;
+    case BMI:
+        branch = r.Sr & BIT_N;
+        break;
+    case BVC:
+        branch = !(r.Sr & BIT_V);
+        break;
+    case BVS:
+        branch = r.Sr & BIT_V;
+        break;
+    case BIT:
+        value = ReferenceRead(address);
+        SET_N(r.Sr, value >> 7);
+        SET_V(r.Sr, value >> 6);
+        SET_Z(r.Sr, (r.Ac & value) == 0);
+        break;
+    case BRK:
+    {
+        // The byte after BRK is skipped
+        uint16_t ret = registers->Pc + 2;
+        Push(&r, ret >> 8);
+        Push(&r, ret & 0xFF);
+        Push(&r, r.Sr | BIT_B | BIT_5);
+        SET_I(r.Sr, 1);
+        r.Pc = ReferenceRead(IRQ_VECTOR_ADDRESS) | (ReferenceRead(IRQ_VECTOR_ADDRESS + 1) << 8);
+    }
+    break;
+    case CLC:
+        SET_C(r.Sr, 0);
+        break;
+    case CLD:
+        SET_D(r.Sr, 0);
+        break;
+    case CLI:
+        SET_I(r.Sr, 0);
+        break;
+    case CLV:
+        SET_V(r.Sr, 0);
+        break;
+    case SEC:
+        SET_C(r.Sr, 1);
+        break;
+    case SED:
+        SET_D(r.Sr, 1);
+        break;
+    case SEI:
+        SET_I(r.Sr, 1);
+        break;
+    case CMP:
+        Compare(&r, r.Ac, ReferenceRead(address));
+        break;
+    case CPX:
+        Compare(&r, r.X, ReferenceRead(address));
+        break;
+    case CPY:
+        Compare(&r, r.Y, ReferenceRead(address));
+        break;
+    case DEC:
+    case INC:
+        value = ReferenceRead(address) + (opcode->Operation == INC ? 1 : -1);
+        ReferenceWrite(address, value);
+        SetNZ(&r, value);
+        break;
+    case DEX:
+        SetNZ(&r, --r.X);
+        break;
+    case DEY:
+        SetNZ(&r, --r.Y);
+        break;
+    case INX:
+        SetNZ(&r, ++r.X);
+        break;
+    case INY:
+        SetNZ(&r, ++r.Y);
+        break;
+    case JMP:
+        r.Pc = address;
+        break;
+    case JSR:
+    {
+        // The address of the last byte of JSR is pushed, before that byte is read (it can be overwritten by the push)
+        uint16_t ret = r.Pc - 1;
+        Push(&r, ret >> 8);
+        Push(&r, ret & 0xFF);
+        r.Pc = (address & 0xFF) | (ReferenceRead(operandPc + 1) << 8);
+    }
+    break;
+    case LDA:
+        r.Ac = ReferenceRead(address);
+        SetNZ(&r, r.Ac);
+        break;
+    case LDX:
+        r.X = ReferenceRead(address);
+        SetNZ(&r, r.X);
+        break;
+    case LDY:
+        r.Y = ReferenceRead(address);
+        SetNZ(&r, r.Y);
+        break;
+    case NOP:
+        break;
+    case PHA:
+        Push(&r, r.Ac);
+        break;
+    case PHP:
+        Push(&r, r.Sr | BIT_B | BIT_5);
+        break;
+    case PLA:
+        r.Ac = Pull(&r);
+        SetNZ(&r, r.Ac);
+        break;
+    case PLP:
+        r.Sr = Pull(&r);
+        break;
+    case RTI:
+        r.Sr = Pull(&r);
+        r.Pc = Pull(&r);
+        r.Pc |= Pull(&r) << 8;
+        break;
+    case RTS:
+        r.Pc = Pull(&r);
+        r.Pc |= Pull(&r) << 8;
+        r.Pc++;
+        break;
+    case STA:
+        ReferenceWrite(address, r.Ac);
+        break;
+    case STX:
+        ReferenceWrite(address, r.X);
+        break;
+    case STY:
+        ReferenceWrite(address, r.Y);
+        break;
+    case TAX:
+        r.X = r.Ac;
+        SetNZ(&r, r.X);
+        break;
+    case TAY:
+        r.Y = r.Ac;
+        SetNZ(&r, r.Y);
+        break;
+    case TSX:
+        r.X = r.Sp;
+        SetNZ(&r, r.X);
+        break;
+    case TXA:
+        r.Ac = r.X;
+        SetNZ(&r, r.Ac);
+        break;
+    case TXS:
+        r.Sp = r.X;
+        break;
+    case TYA:
+        r.Ac = r.Y;
+        SetNZ(&r, r.Ac);
+        break;
+    default:
+        break;
+    }
+
+    // A taken branch takes one more cycle, and another one when it goes to another page
+    if (branch)
+    {
+        penalty += 1 + ((address & 0xFF00) != (r.Pc & 0xFF00));
+        r.Pc = address;
+    }
+
+    result->Registers = r;
+    result->Cycles = opcode->Cycles + penalty;
+    result->PenaltyCycles = penalty;
+}
+
+/* Cases */
+
+// Runs the case on both sides, on memory which is the base memory with the given bytes, returns TRUE when they match
+static BOOL RunCase(const FUZZ_REGISTERS *registers, const FUZZ_ACCESS *bytes, uint32_t numBytes, FUZZ_RESULT *emulator, FUZZ_RESULT *reference)
+{
+    for (uint32_t i = 0; i < numBytes; i++)
+    {
+        emulatorMemory.Bytes[bytes[i].Address] = bytes[i].Value;
+        referenceMemory.Bytes[bytes[i].Address] = bytes[i].Value;
+    }
+
+    emulatorMemory.NumReads = emulatorMemory.NumWrites = 0;
+    referenceMemory.NumReads = referenceMemory.NumWrites = 0;
+
+    RunEmulator(registers, emulator);
+    RunReference(registers, reference);
+
+    BOOL match = emulator->Registers.Pc == reference->Registers.Pc &&
+                 emulator->Registers.Ac == reference->Registers.Ac &&
+                 emulator->Registers.X == reference->Registers.X &&
+                 emulator->Registers.Y == reference->Registers.Y &&
+                 (emulator->Registers.Sr & FLAGS_MASK) == (reference->Registers.Sr & FLAGS_MASK) &&
+                 emulator->Registers.Sp == reference->Registers.Sp &&
+                 emulator->Cycles == reference->Cycles;
+
+    // Every byte written by either side has to have the same value on both
+    for (uint32_t i = 0; i < emulatorMemory.NumWrites; i++)
+    {
+        uint16_t address = emulatorMemory.Writes[i].Address;
+        match &= emulatorMemory.Bytes[address] == referenceMemory.Bytes[address];
+    }
+    for (uint32_t i = 0; i < referenceMemory.NumWrites; i++)
+    {
+        uint16_t address = referenceMemory.Writes[i].Address;
+        match &= emulatorMemory.Bytes[address] == referenceMemory.Bytes[address];
+    }
+
+    return match;
+}
+
+// Puts back the base memory where the last case changed it
+static void RestoreMemory(const FUZZ_ACCESS *bytes, uint32_t numBytes)
+{
+    for (uint32_t i = 0; i < numBytes; i++)
+    {
+        emulatorMemory.Bytes[bytes[i].Address] = baseMemory[bytes[i].Address];
+        referenceMemory.Bytes[bytes[i].Address] = baseMemory[bytes[i].Address];
+    }
+
+    for (uint32_t i = 0; i < emulatorMemory.NumWrites; i++)
+    {
+        uint16_t address = emulatorMemory.Writes[i].Address;
+        emulatorMemory.Bytes[address] = baseMemory[address];
+        referenceMemory.Bytes[address] = baseMemory[address];
+    }
+
+    for (uint32_t i = 0; i < referenceMemory.NumWrites; i++)
+    {
+        uint16_t address = referenceMemory.Writes[i].Address;
+        emulatorMemory.Bytes[address] = baseMemory[address];
+        referenceMemory.Bytes[address] = baseMemory[address];
+    }
+}
+
+static void SetBaseMemory(BOOL random)
+{
+    for (uint32_t i = 0; i < CPU_MEMORY_SIZE; i += 8)
+    {
+        *(uint64_t *)&baseMemory[i] = random ? Random() : 0;
+    }
+
+    memcpy(emulatorMemory.Bytes, baseMemory, CPU_MEMORY_SIZE);
+    memcpy(referenceMemory.Bytes, baseMemory, CPU_MEMORY_SIZE);
+}
+
+// Adds the bytes read by either side which are not in the list yet, returns the new number of bytes
+static uint32_t AddReads(FUZZ_ACCESS *bytes, uint32_t numBytes, const FUZZ_MEMORY *memory)
+{
+    for (uint32_t i = 0; i < memory->NumReads; i++)
+    {
+        BOOL found = FALSE;
+        for (uint32_t j = 0; j < numBytes; j++)
+        {
+            found |= bytes[j].Address == memory->Reads[i].Address;
+        }
+
+        if (!found && numBytes < 2 * MAX_ACCESSES)
+        {
+            // The value before the case changed it
+            bytes[numBytes].Address = memory->Reads[i].Address;
+            bytes[numBytes].Value = baseMemory[memory->Reads[i].Address];
+            numBytes++;
+        }
+    }
+
+    return numBytes;
+}
+
+static void PrintResult(const char *name, const FUZZ_RESULT *result, const FUZZ_MEMORY *memory)
+{
+    printf("  %-10s PC:%04X A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu", name,
+           result->Registers.Pc, result->Registers.Ac, result->Registers.X, result->Registers.Y, result->Registers.Sr, result->Registers.Sp,
+           result->Cycles);
+    if (result->PenaltyCycles > 0)
+    {
+        printf(" (%llu of page crossing or branch)", result->PenaltyCycles);
+    }
+    printf(" writes");
+    for (uint32_t i = 0; i < memory->NumWrites; i++)
+    {
+        printf(" %04X=%02X", memory->Writes[i].Address, memory->Bytes[memory->Writes[i].Address]);
+    }
+    printf("\n");
+}
+
+// Sets registers and bytes to 0 one at a time for as long as the case still fails, on memory of only zeros,
+// and prints it with every byte read
+static void ReportMismatch(FUZZ_REGISTERS registers, const FUZZ_ACCESS *instructionBytes, uint32_t numInstructionBytes, uint64_t caseNumber, uint64_t seed)
+{
+    FUZZ_ACCESS bytes[2 * MAX_ACCESSES];
+    uint32_t numBytes = AddReads(memcpy(bytes, instructionBytes, numInstructionBytes * sizeof(FUZZ_ACCESS)), numInstructionBytes, &emulatorMemory);
+    numBytes = AddReads(bytes, numBytes, &referenceMemory);
+    RestoreMemory(bytes, numBytes);
+
+    SetBaseMemory(FALSE);
+    FUZZ_RESULT emulator, reference;
+
+    BOOL smaller = TRUE;
+    while (smaller)
+    {
+        smaller = FALSE;
+
+        uint8_t *fields[] = {&registers.Ac, &registers.X, &registers.Y, &registers.Sr, &registers.Sp};
+        for (uint32_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+        {
+            uint8_t previous = *fields[i];
+            if (previous == 0)
+                continue;
+
+            *fields[i] = 0;
+            BOOL match = RunCase(&registers, bytes, numBytes, &emulator, &reference);
+            RestoreMemory(bytes, numBytes);
+            if (match)
+                *fields[i] = previous;
+            else
+                smaller = TRUE;
+        }
+
+        // The opcode is the first byte, and is kept
+        for (uint32_t i = 1; i < numBytes; i++)
+        {
+            uint8_t previous = bytes[i].Value;
+            if (previous == 0)
+                continue;
+
+            bytes[i].Value = 0;
+            BOOL match = RunCase(&registers, bytes, numBytes, &emulator, &reference);
+            RestoreMemory(bytes, numBytes);
+            if (match)
+                bytes[i].Value = previous;
+            else
+                smaller = TRUE;
+        }
+    }
+
+    // Other addresses may be read with the smaller values
+    RunCase(&registers, bytes, numBytes, &emulator, &reference);
+    RestoreMemory(bytes, numBytes);
+    numBytes = AddReads(bytes, numBytes, &emulatorMemory);
+    numBytes = AddReads(bytes, numBytes, &referenceMemory);
+    RunCase(&registers, bytes, numBytes, &emulator, &reference);
+
+    const REFERENCE_OPCODE *opcode = referenceTable[bytes[0].Value];
+    printf("Mismatch in %s (opcode %02X), case %llu of seed %llu\n", opcode_to_string[opcode->Operation], opcode->Opcode, caseNumber, seed);
+    printf("  before     PC:%04X A:%02X X:%02X Y:%02X P:%02X SP:%02X memory", registers.Pc, registers.Ac, registers.X, registers.Y, registers.Sr, registers.Sp);
+    for (uint32_t i = 0; i < numBytes; i++)
+    {
+        printf(" %04X=%02X", bytes[i].Address, bytes[i].Value);
+    }
+    printf(" (everything else 00)\n");
+    PrintResult("emulator", &emulator, &emulatorMemory);
+    PrintResult("reference", &reference, &referenceMemory);
+    fflush(stdout);
+
+    RestoreMemory(bytes, numBytes);
+    SetBaseMemory(TRUE);
+}
+
+// Compares instruction_set with the reference table before running anything
+static uint32_t CheckInstructionSet(void)
+{
+    uint32_t errors = 0;
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        const REFERENCE_OPCODE *opcode = referenceTable[i];
+        instruction_t instruction = instruction_set[i];
+        BOOL legal = instruction.operation != NIL;
+
+        if (opcode == NULL && legal)
+        {
+            printf("Opcode %02X is %s in instruction_set, but is not a legal opcode\n", i, opcode_to_string[instruction.operation]);
+            errors++;
+        }
+        else if (opcode != NULL && !legal)
+        {
+            printf("Opcode %02X (%s) is missing in instruction_set\n", i, opcode_to_string[opcode->Operation]);
+            errors++;
+        }
+        else if (opcode != NULL && (instruction.operation != opcode->Operation || instruction.addr_mode != opcode->AddrMode || instruction.cycles != opcode->Cycles))
+        {
+            printf("Opcode %02X is %s mode %d with %d cycles in instruction_set, but should be %s mode %d with %d cycles\n", i,
+                   opcode_to_string[instruction.operation], instruction.addr_mode, instruction.cycles,
+                   opcode_to_string[opcode->Operation], opcode->AddrMode, opcode->Cycles);
+            errors++;
+        }
+    }
+
+    return errors;
+}
+
+// Runs the cases of the opcodes with index % numWorkers == workerIndex in referenceOpcodes
+static int RunWorker(uint32_t workerIndex, uint32_t numWorkers, uint64_t seed, uint64_t numCases)
+{
+    const REFERENCE_OPCODE *opcodes[NUM_LEGAL_OPCODES];
+    uint32_t numOpcodes = 0;
+    for (uint32_t i = workerIndex; i < NUM_LEGAL_OPCODES; i += numWorkers)
+    {
+        opcodes[numOpcodes++] = &referenceOpcodes[i];
+    }
+
+    if (numOpcodes == 0)
+    {
+        return 0;
+    }
+
+    mapper.get_memory_pointer = FuzzGetMemoryPointer;
+    mapper.read_pointer = FuzzReadPointer;
+    mapper.write_to_pointer = FuzzWriteToPointer;
+    mapper.read_memory = FuzzReadMemory;
+    mapper.write_memory = FuzzWriteMemory;
+
+    baseMemory = VirtualAlloc(NULL, CPU_MEMORY_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    emulatorMemory.Bytes = VirtualAlloc(NULL, CPU_MEMORY_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    referenceMemory.Bytes = VirtualAlloc(NULL, CPU_MEMORY_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+    // Each worker has its own sequence, any case can be found again from the seed and the worker
+    uint64_t workerSeed = seed * 0x9E3779B97F4A7C15ULL + workerIndex + 1;
+    randomState = workerSeed;
+
+    uint64_t mismatches[NUM_LEGAL_OPCODES] = {0};
+    uint64_t totalMismatches = 0;
+
+    for (uint64_t c = 0; c < numCases; c++)
+    {
+        if (c % REFILL_INTERVAL == 0)
+        {
+            SetBaseMemory(TRUE);
+        }
+
+        uint32_t index = Random() % numOpcodes;
+        FUZZ_REGISTERS registers;
+        uint64_t r = Random();
+        registers.Pc = r;
+        registers.Ac = RandomRegister();
+        registers.X = RandomRegister();
+        registers.Y = RandomRegister();
+        registers.Sr = RandomRegister();
+        registers.Sp = RandomRegister();
+
+        FUZZ_ACCESS instructionBytes[3];
+        for (uint32_t i = 0; i < 3; i++)
+        {
+            instructionBytes[i].Address = registers.Pc + i;
+            instructionBytes[i].Value = i == 0 ? opcodes[index]->Opcode : RandomRegister();
+        }
+
+        FUZZ_RESULT emulator, reference;
+        if (!RunCase(&registers, instructionBytes, 3, &emulator, &reference))
+        {
+            if (mismatches[index]++ == 0)
+            {
+                ReportMismatch(registers, instructionBytes, 3, c, workerSeed);
+            }
+            totalMismatches++;
+        }
+
+        RestoreMemory(instructionBytes, 3);
+    }
+
+    for (uint32_t i = 0; i < numOpcodes; i++)
+    {
+        if (mismatches[i] > 0)
+        {
+            printf("%s (opcode %02X): %llu mismatches\n", opcode_to_string[opcodes[i]->Operation], opcodes[i]->Opcode, mismatches[i]);
+        }
+    }
+    fflush(stdout);
+
+    return totalMismatches > 0;
+}
+
+int StartWorkers(uint64_t numCases, uint64_t seed, uint32_t numWorkers)
+{
+    char executable[MAX_PATH];
+    GetModuleFileNameA(NULL, executable, MAX_PATH);
+
+    HANDLE workers[MAXIMUM_WAIT_OBJECTS];
+    uint32_t started = 0;
+    int result = 0;
+
+    for (uint32_t i = 0; i < numWorkers; i++)
+    {
+        // The opcodes are split evenly, so are the cases
+        uint64_t cases = numCases / numWorkers + (i < numCases % numWorkers);
+
+        char commandLine[2 * MAX_PATH];
+        snprintf(commandLine, sizeof(commandLine), "\"%s\" %s %d %d %llu %llu", executable, WORKER_ARGUMENT, i, numWorkers, seed, cases);
+
+        STARTUPINFOA startupInfo = {0};
+        startupInfo.cb = sizeof(startupInfo);
+        PROCESS_INFORMATION processInfo;
+
+        if (!CreateProcessA(NULL, commandLine, NULL, NULL, FALSE, 0, NULL, NULL, &startupInfo, &processInfo))
+        {
+            printf("Unable to start worker %d\n", i);
+            result = 1;
+            continue;
+        }
+
+        CloseHandle(processInfo.hThread);
+        workers[started++] = processInfo.hProcess;
+    }
+
+    WaitForMultipleObjects(started, workers, TRUE, INFINITE);
+
+    for (uint32_t i = 0; i < started; i++)
+    {
+        DWORD exitCode;
+        if (!GetExitCodeProcess(workers[i], &exitCode) || exitCode != 0)
+        {
+            result = 1;
+        }
+        CloseHandle(workers[i]);
+    }
+
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    for (uint32_t i = 0; i < NUM_LEGAL_OPCODES; i++)
+    {
+        referenceTable[referenceOpcodes[i].Opcode] = &referenceOpcodes[i];
+    }
+
+    if (argc == 6 && strcmp(argv[1], WORKER_ARGUMENT) == 0)
+    {
+        return RunWorker(atoi(argv[2]), atoi(argv[3]), strtoull(argv[4], NULL, 10), strtoull(argv[5], NULL, 10));
+    }
+
+    if (argc < 2 || argc > 4)
+    {
+        printf("Usage: cpufuzz <instructions> [seed] [workers]\n");
+        return 1;
+    }
+
+    uint64_t numCases = strtoull(argv[1], NULL, 10);
+    uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 10) : GetTickCount();
+
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    uint32_t numWorkers = argc > 3 ? atoi(argv[3]) : systemInfo.dwNumberOfProcessors;
+
+    if (numWorkers < 1)
+    {
+        numWorkers = 1;
+    }
+    else if (numWorkers > MAXIMUM_WAIT_OBJECTS)
+    {
+        numWorkers = MAXIMUM_WAIT_OBJECTS;
+    }
+
+    int result = CheckInstructionSet() > 0;
+
+    printf("Running %llu instructions with seed %llu on %d workers\n", numCases, seed, numWorkers);
+    fflush(stdout);
+
+    int64_t frequency, start, end;
+    QueryPerformanceFrequency((LARGE_INTEGER *)&frequency);
+    QueryPerformanceCounter((LARGE_INTEGER *)&start);
+
+    result |= StartWorkers(numCases, seed, numWorkers);
+
+    QueryPerformanceCounter((LARGE_INTEGER *)&end);
+    double seconds = (double)(end - start) / frequency;
+    printf("%s: %llu instructions in %.2f s (%.1f million per second)\n", result ? "FAIL" : "PASS", numCases, seconds, numCases / seconds / 1e6);
+
+    return result;
+}
@@ -0,0 +1,116 @@
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../main.h"
+#include "../nes/cpu_trace.h"
+
+/*
+    Writes a binary cpu trace (made with "Toggle cpu trace" or nesrun --trace) in the log format of nestest
+
+    cputrace <trace file> [first instruction] [number of instructions]
+
+    The lines go to standard output, oldest first, so the log can be compared with a golden log line by line:
+        cputrace cpu_trace.cpt | diff - nestest.log
+    The values at the addresses nestest adds to the disassembly (as in "LDA $00 = 00") are not in the trace.
+*/
+
+#define READ_RECORDS 0x1000
+
+// The tool only formats traces, nothing is drawn
+NES_BITMAP backBuffer;
+
+static cpu_trace_record_t records[READ_RECORDS];
+
+// Writes the records first -> first + count of the file
+static BOOL WriteRecords(HANDLE file, uint64_t first, uint64_t count)
+{
+    LARGE_INTEGER offset;
+    offset.QuadPart = (first + 1) * sizeof(cpu_trace_record_t);
+    SetFilePointerEx(file, offset, NULL, FILE_BEGIN);
+
+    char line[CPU_TRACE_LINE_SIZE];
+    while (count > 0)
+    {
+        DWORD length = count < READ_RECORDS ? count : READ_RECORDS;
+        DWORD bytesRead;
+        if (!ReadFile(file, records, length * sizeof(cpu_trace_record_t), &bytesRead, NULL) || bytesRead != length * sizeof(cpu_trace_record_t))
+        {
+            return FALSE;
+        }
+
+        for (DWORD i = 0; i < length; i++)
+        {
+            format_cpu_trace_record(&records[i], line);
+            puts(line);
+        }
+
+        count -= length;
+    }
+
+    return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: cputrace <trace file> [first instruction] [number of instructions]\n");
+        return 1;
+    }
+
+    HANDLE file = CreateFileA(argv[1], GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Unable to open %s\n", argv[1]);
+        return 1;
+    }
+
+    cpu_trace_header_t header;
+    if (!read_cpu_trace_header(file, &header))
+    {
+        fprintf(stderr, "%s is not a cpu trace\n", argv[1]);
+        CloseHandle(file);
+        return 1;
+    }
+
+    // A ring holds the last instructions, starting after the one written last
+    uint64_t available = header.count;
+    uint64_t oldest = 0;
+    if (header.capacity > 0 && header.count > header.capacity)
+    {
+        available = header.capacity;
+        oldest = header.count % header.capacity;
+    }
+
+    uint64_t first = argc > 2 ? strtoull(argv[2], NULL, 10) : 0;
+    uint64_t count = argc > 3 ? strtoull(argv[3], NULL, 10) : available;
+    if (first > available)
+    {
+        first = available;
+    }
+    if (count > available - first)
+    {
+        count = available - first;
+    }
+
+    static char outputBuffer[0x100000];
+    setvbuf(stdout, outputBuffer, _IOFBF, sizeof(outputBuffer));
+
+    // The part of the ring up to its end, and the part after it wraps around
+    uint64_t start = header.capacity > 0 ? (oldest + first) % header.capacity : first;
+    uint64_t untilEnd = header.capacity > 0 ? header.capacity - start : count;
+    uint64_t firstPart = count < untilEnd ? count : untilEnd;
+
+    BOOL success = WriteRecords(file, start, firstPart) && WriteRecords(file, 0, count - firstPart);
+    CloseHandle(file);
+    fflush(stdout);
+
+    if (!success)
+    {
+        fprintf(stderr, "%s ends before its last instruction\n", argv[1]);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,382 @@
+#include <Windows.h>
+#include <psapi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../main.h"
+#include "../video.h"
+#include "../nes/loader.h"
+#include "../nes/cpu.h"
+#include "../nes/ppu.h"
+#include "../nes/controller.h"
+#include "../nes/input_recording.h"
+
+/*
+    Runs a suite of roms from power up without a window and without waiting between frames, and compares with a baseline
+
+    framebench <suite> [--baseline <file>] [--save-baseline <file>] [--tolerance <percent>]
+
+    Each line of the suite is a rom, the number of frames to run it for and optionally an input recording
+    (made with "Toggle input recording") replayed as the controller:
+        # rom                 frames  input
+        roms/game.nes         10000   game.inr
+    Each rom reports its frames per second, the time per emulated cpu cycle, the peak working set of the process
+    and a hash of the state of the cpu and the ppu (registers, memory, OAM and the last frame) after the last frame.
+
+    The hash must match the baseline exactly, or the behaviour of the emulator has changed. A rom whose frames per second
+    are more than the tolerance (default 5%) below the baseline is a regression. The exit code is 1 if any rom has either.
+    The baseline file has a line per rom in the format --save-baseline writes.
+*/
+
+#define DEFAULT_TOLERANCE 5.0
+#define SUITE_MAX_ROMS 64
+#define SUITE_LINE_SIZE 1024
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+typedef struct SUITE_ROM
+{
+    char Rom[MAX_PATH];
+    char Input[MAX_PATH]; // Empty when the controller is left untouched
+    uint32_t Frames;
+} SUITE_ROM;
+
+typedef struct ROM_RESULT
+{
+    uint32_t Frames;
+    double Seconds;
+    uint64_t Cycles;
+    uint64_t Hash;
+    uint64_t PeakWorkingSet;
+} ROM_RESULT;
+
+typedef struct BASELINE_ENTRY
+{
+    char Rom[MAX_PATH];
+    uint32_t Frames;
+    uint64_t Hash;
+    double FramesPerSecond;
+} BASELINE_ENTRY;
+
+// The ppu draws into the backbuffer of the window in the BGRA output, the tool only uses the indexed output
+NES_BITMAP backBuffer;
+
+static SUITE_ROM suite[SUITE_MAX_ROMS];
+static uint32_t numSuiteRoms;
+static BASELINE_ENTRY baseline[SUITE_MAX_ROMS];
+static uint32_t numBaselineEntries;
+
+static uint64_t HashBytes(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// FNV-1a of the state the game can observe and the last frame drawn
+// Only the fields of the ppu which are part of the emulated hardware are hashed, not the caches of the renderer
+static uint64_t HashState()
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    hash = HashBytes(hash, &cpu.registers.pc, sizeof(cpu.registers.pc));
+    hash = HashBytes(hash, &cpu.registers.ac, sizeof(cpu.registers.ac));
+    hash = HashBytes(hash, &cpu.registers.x, sizeof(cpu.registers.x));
+    hash = HashBytes(hash, &cpu.registers.y, sizeof(cpu.registers.y));
+    hash = HashBytes(hash, &cpu.registers.sr, sizeof(cpu.registers.sr));
+    hash = HashBytes(hash, &cpu.registers.sp, sizeof(cpu.registers.sp));
+    hash = HashBytes(hash, &cpu.cycle, sizeof(cpu.cycle));
+    hash = HashBytes(hash, cpu_memory, CPU_MEMORY_SIZE);
+
+    hash = HashBytes(hash, &ppu_state.cycle, sizeof(ppu_state.cycle));
+    hash = HashBytes(hash, &ppu_state.scanline, sizeof(ppu_state.scanline));
+    hash = HashBytes(hash, &ppu_state.ctrl, sizeof(ppu_state.ctrl));
+    hash = HashBytes(hash, &ppu_state.mask, sizeof(ppu_state.mask));
+    hash = HashBytes(hash, &ppu_state.status, sizeof(ppu_state.status));
+    hash = HashBytes(hash, &ppu_state.oamaddr, sizeof(ppu_state.oamaddr));
+    hash = HashBytes(hash, &ppu_state.v, sizeof(ppu_state.v));
+    hash = HashBytes(hash, &ppu_state.t, sizeof(ppu_state.t));
+    hash = HashBytes(hash, &ppu_state.fine_x, sizeof(ppu_state.fine_x));
+    hash = HashBytes(hash, &ppu_state.w, sizeof(ppu_state.w));
+    hash = HashBytes(hash, &ppu_state.read_buffer, sizeof(ppu_state.read_buffer));
+    hash = HashBytes(hash, ppu_memory, PPU_MEMORY_SIZE);
+    hash = HashBytes(hash, oam_memory, OAM_SIZE);
+
+    hash = HashBytes(hash, indexed_frame, sizeof(indexed_frame));
+    hash = HashBytes(hash, indexed_frame_emphasis, sizeof(indexed_frame_emphasis));
+    return hash;
+}
+
+static BOOL ReadSuite(LPCSTR filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        return FALSE;
+    }
+
+    char line[SUITE_LINE_SIZE];
+    uint32_t lineNumber = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        lineNumber++;
+        if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+        {
+            continue;
+        }
+
+        if (numSuiteRoms == SUITE_MAX_ROMS)
+        {
+            fprintf(stderr, "The suite has more than %d roms\n", SUITE_MAX_ROMS);
+            break;
+        }
+
+        SUITE_ROM *rom = &suite[numSuiteRoms];
+        rom->Input[0] = '\0';
+        if (sscanf(line, "%259s %u %259s", rom->Rom, &rom->Frames, rom->Input) < 2)
+        {
+            fprintf(stderr, "Line %d of %s is not \"<rom> <frames> [input recording]\"\n", lineNumber, filename);
+            fclose(file);
+            return FALSE;
+        }
+        numSuiteRoms++;
+    }
+
+    fclose(file);
+    return TRUE;
+}
+
+static BOOL ReadBaseline(LPCSTR filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        return FALSE;
+    }
+
+    char line[SUITE_LINE_SIZE];
+    while (fgets(line, sizeof(line), file) != NULL && numBaselineEntries < SUITE_MAX_ROMS)
+    {
+        BASELINE_ENTRY *entry = &baseline[numBaselineEntries];
+        if (line[0] != '#' && sscanf(line, "%259s %u %llx %lf", entry->Rom, &entry->Frames, &entry->Hash, &entry->FramesPerSecond) == 4)
+        {
+            numBaselineEntries++;
+        }
+    }
+
+    fclose(file);
+    return TRUE;
+}
+
+static BASELINE_ENTRY *FindBaseline(const SUITE_ROM *rom)
+{
+    for (uint32_t i = 0; i < numBaselineEntries; i++)
+    {
+        if (strcmp(baseline[i].Rom, rom->Rom) == 0 && baseline[i].Frames == rom->Frames)
+        {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
+
+// Loads the rom into a machine powered up from nothing, so the result does not depend on the roms run before it
+static BOOL PowerUp(const SUITE_ROM *rom)
+{
+    HANDLE romFile = CreateFileA(rom->Rom, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (romFile == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Unable to open %s\n", rom->Rom);
+        return FALSE;
+    }
+
+    // The cartridge memory is only allocated for the size of the first rom loaded
+    VirtualFree(cartrage, 0, MEM_RELEASE);
+    cartrage = NULL;
+    memset(cpu_memory, 0, CPU_MEMORY_SIZE);
+    memset(ppu_memory, 0, PPU_MEMORY_SIZE);
+    memset(oam_memory, 0, OAM_SIZE);
+    memset(indexed_frame, 0, sizeof(indexed_frame));
+    memset(indexed_frame_emphasis, 0, sizeof(indexed_frame_emphasis));
+    // The strobe and the latched buttons are cleared by cpu_power_up
+    controller.bits = 0;
+
+    LOAD_STATUS status = loadNESFile(romFile);
+    CloseHandle(romFile);
+
+    if (status != SUCCESS)
+    {
+        fprintf(stderr, "Unable to load %s\n", rom->Rom);
+        return FALSE;
+    }
+
+    if (rom->Input[0] != '\0' && !start_input_replay(rom->Input))
+    {
+        fprintf(stderr, "Unable to read the input recording %s\n", rom->Input);
+        return FALSE;
+    }
+
+    cpu_power_up();
+    ppu_power_up();
+    return TRUE;
+}
+
+static BOOL RunRom(const SUITE_ROM *rom, ROM_RESULT *result)
+{
+    if (!PowerUp(rom))
+    {
+        return FALSE;
+    }
+
+    int64_t frequency, start, end;
+    QueryPerformanceFrequency((LARGE_INTEGER *)&frequency);
+    QueryPerformanceCounter((LARGE_INTEGER *)&start);
+
+    // Counted as in nesrun, the first change of the frame counter is the start of the first frame
+    uint32_t frames = 0;
+    uint16_t frameCounter = ppu_state.frame_counter + 1;
+    while (frames < rom->Frames && cpu.powered)
+    {
+        perform_next_instruction();
+
+        while (ppu_state.cycle < cpu.cycle * 3)
+        {
+            perform_next_ppu_cycle();
+        }
+
+        if (ppu_state.frame_counter != frameCounter)
+        {
+            frameCounter = ppu_state.frame_counter;
+            frames++;
+        }
+    }
+
+    QueryPerformanceCounter((LARGE_INTEGER *)&end);
+    stop_input_recording();
+
+    PROCESS_MEMORY_COUNTERS memoryCounters = {0};
+    memoryCounters.cb = sizeof(memoryCounters);
+    GetProcessMemoryInfo(GetCurrentProcess(), &memoryCounters, sizeof(memoryCounters));
+
+    result->Frames = frames;
+    result->Seconds = (double)(end - start) / frequency;
+    result->Cycles = cpu.cycle;
+    result->Hash = HashState();
+    result->PeakWorkingSet = memoryCounters.PeakWorkingSetSize;
+    return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: framebench <suite> [--baseline <file>] [--save-baseline <file>] [--tolerance <percent>]\n");
+        return 1;
+    }
+
+    LPCSTR baselineFile = NULL;
+    LPCSTR saveBaselineFile = NULL;
+    double tolerance = DEFAULT_TOLERANCE;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+        {
+            baselineFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--save-baseline") == 0 && i + 1 < argc)
+        {
+            saveBaselineFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+        {
+            tolerance = atof(argv[++i]);
+        }
+        else
+        {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (!ReadSuite(argv[1]))
+    {
+        fprintf(stderr, "Unable to read the suite %s\n", argv[1]);
+        return 1;
+    }
+
+    if (baselineFile != NULL && !ReadBaseline(baselineFile))
+    {
+        fprintf(stderr, "Unable to read the baseline %s\n", baselineFile);
+        return 1;
+    }
+
+    FILE *saveBaseline = NULL;
+    if (saveBaselineFile != NULL)
+    {
+        saveBaseline = fopen(saveBaselineFile, "w");
+        if (saveBaseline == NULL)
+        {
+            fprintf(stderr, "Unable to create the baseline %s\n", saveBaselineFile);
+            return 1;
+        }
+        fprintf(saveBaseline, "# rom frames hash fps\n");
+    }
+
+    BuildConversionTables();
+    ppu_output = PPU_OUTPUT_INDEXED;
+
+    printf("%-32s %8s %10s %10s %10s  %-16s %s\n", "rom", "frames", "fps", "ns/cycle", "peak MB", "hash", "baseline");
+
+    BOOL failed = FALSE;
+    for (uint32_t i = 0; i < numSuiteRoms; i++)
+    {
+        const SUITE_ROM *rom = &suite[i];
+        ROM_RESULT result;
+        if (!RunRom(rom, &result))
+        {
+            failed = TRUE;
+            continue;
+        }
+
+        double framesPerSecond = result.Frames / result.Seconds;
+        printf("%-32s %8u %10.1f %10.3f %10.1f  %016llx ", rom->Rom, result.Frames, framesPerSecond,
+               result.Seconds * 1000000000.0 / result.Cycles, result.PeakWorkingSet / (1024.0 * 1024.0), result.Hash);
+
+        BASELINE_ENTRY *entry = FindBaseline(rom);
+        if (entry == NULL)
+        {
+            printf("%s\n", baselineFile != NULL ? "missing" : "-");
+        }
+        else
+        {
+            double change = (framesPerSecond / entry->FramesPerSecond - 1.0) * 100.0;
+            BOOL hashMatches = entry->Hash == result.Hash;
+            BOOL regressed = result.Frames == rom->Frames && change < -tolerance;
+            printf("%+.1f%%%s%s\n", change, hashMatches ? "" : " HASH MISMATCH", regressed ? " REGRESSION" : "");
+            failed |= !hashMatches || regressed;
+        }
+
+        // The time of a rom which stopped early is not comparable, but its hash still is
+        if (result.Frames < rom->Frames)
+        {
+            fprintf(stderr, "%s: the cpu stopped after %d frames\n", rom->Rom, result.Frames);
+            failed = TRUE;
+        }
+
+        if (saveBaseline != NULL)
+        {
+            fprintf(saveBaseline, "%s %u %016llx %.1f\n", rom->Rom, rom->Frames, result.Hash, framesPerSecond);
+        }
+    }
+
+    if (saveBaseline != NULL)
+    {
+        fclose(saveBaseline);
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,423 @@
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../main.h"
+#include "../video.h"
+#include "../scaler.h"
+#include "../nes/loader.h"
+#include "../nes/cpu.h"
+#include "../nes/ppu.h"
+
+/*
+    Micro-benchmarks of the cpu, the bus, the ppu and the present path, each on its own
+
+    nesbench [filter] [--warmup N] [--repetitions N]
+
+    No rom is needed, the benchmarks set up a mapper 0 cartridge with a synthetic program and scene.
+    Each benchmark runs its warm-up repetitions, then the timed ones, and reports the median, the p99 and the fastest
+    repetition together with the throughput at the median. Only the benchmarks with the filter in their name are run.
+    The results are written to standard output as JSON, so runs before and after a change can be compared by a script.
+*/
+
+#define DEFAULT_WARMUP 10
+#define DEFAULT_REPETITIONS 100
+
+// Instructions and bus accesses per repetition, enough to be well above the resolution of the counter
+#define CPU_OPERATIONS 0x10000
+#define BUS_OPERATIONS 0x40000
+#define OAM_DMA_OPERATIONS 64
+
+#define BENCH_CODE_ADDRESS PROGRAM_ROM_ADDRESS
+// The operands $10 $03 are the zero page pointer of the indirect modes, and the low byte of the address it points to
+#define BENCH_ZEROPAGE_POINTER 0x10
+#define BENCH_DATA_ADDRESS 0x0310
+#define BENCH_OAM_PAGE 0x02
+#define BENCH_PPU_CYCLES_PER_FRAME (341 * 262)
+
+typedef struct BENCHMARK BENCHMARK;
+
+struct BENCHMARK
+{
+    const char *Name;
+    const char *Unit;
+    uint32_t Operations; // Units of work in a repetition
+    void (*Setup)(const BENCHMARK *benchmark);
+    void (*Run)(const BENCHMARK *benchmark);
+    uint8_t Opcode;   // The instruction of the cpu benchmarks
+    SCALER Scaler;    // The filter of the scaler benchmarks
+    uint8_t Scale;
+};
+
+typedef struct BENCHMARK_RESULT
+{
+    double Median;
+    double P99;
+    double Min;
+} BENCHMARK_RESULT;
+
+// The ppu draws into the backbuffer of the window in the BGRA output, the benchmarks use the indexed output
+NES_BITMAP backBuffer;
+
+// Results of the bus reads are added up here, so they are not optimized away
+static volatile uint8_t busSink;
+static PIXEL32 *bgraFrame;
+
+static void SetupCartridge()
+{
+    memset(&header, 0, sizeof(header));
+    header.prg_rom_size = 2;
+    header.prg_ram_size = 1;
+    header.mirroring = VERTICAL;
+    select_mapper(0);
+
+    for (uint8_t page = 0; page < PATTERN_PAGE_COUNT; page++)
+    {
+        map_ppu_page(page, ppu_memory + page * PPU_PAGE_SIZE);
+    }
+    set_nametable_mirroring(header.mirroring);
+
+    // Random patterns, so every tile has all four colors
+    srand(1);
+    for (uint16_t i = 0; i < PATTERN_TABLE_SIZE * 2; i++)
+    {
+        ppu_memory[i] = rand();
+    }
+
+    cpu_power_up();
+    ppu_power_up();
+}
+
+/* Cpu */
+
+static void SetupInstruction(const BENCHMARK *benchmark)
+{
+    // The operands are the same for every instruction, each mode uses the ones it needs
+    cpu_memory[BENCH_CODE_ADDRESS] = benchmark->Opcode;
+    cpu_memory[BENCH_CODE_ADDRESS + 1] = BENCH_ZEROPAGE_POINTER;
+    cpu_memory[BENCH_CODE_ADDRESS + 2] = BENCH_DATA_ADDRESS >> 8;
+    cpu_memory[BENCH_ZEROPAGE_POINTER] = BENCH_DATA_ADDRESS & 0xff;
+    cpu_memory[BENCH_ZEROPAGE_POINTER + 1] = BENCH_DATA_ADDRESS >> 8;
+    // JMP ($0310) jumps back to the instruction
+    cpu_memory[BENCH_DATA_ADDRESS] = BENCH_CODE_ADDRESS & 0xff;
+    cpu_memory[BENCH_DATA_ADDRESS + 1] = BENCH_CODE_ADDRESS >> 8;
+
+    cpu.registers.x = 4;
+    cpu.registers.y = 4;
+    cpu.registers.sp = 0xFD;
+}
+
+static void RunInstruction(const BENCHMARK *benchmark)
+{
+    instruction_t instruction = instruction_set[benchmark->Opcode];
+
+    for (uint32_t i = 0; i < CPU_OPERATIONS; i++)
+    {
+        cpu.registers.pc = BENCH_CODE_ADDRESS;
+        // The branch is always taken
+        cpu.registers.sr = BIT_5;
+        cpu.current_instruction = instruction;
+        perform_instruction(instruction);
+    }
+}
+
+/* Bus */
+
+static void RunReadRam(const BENCHMARK *benchmark)
+{
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < BUS_OPERATIONS; i++)
+    {
+        sum += mapper.read_memory(i & (INTERNAL_RAM_BANK_SIZE - 1));
+    }
+    busSink = sum;
+}
+
+static void RunWriteRam(const BENCHMARK *benchmark)
+{
+    for (uint32_t i = 0; i < BUS_OPERATIONS; i++)
+    {
+        mapper.write_memory(i & (INTERNAL_RAM_BANK_SIZE - 1), i);
+    }
+}
+
+static void RunReadRom(const BENCHMARK *benchmark)
+{
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < BUS_OPERATIONS; i++)
+    {
+        sum += mapper.read_memory(PROGRAM_ROM_ADDRESS + (i & (PROGRAM_BANK_SIZE * 2 - 1)));
+    }
+    busSink = sum;
+}
+
+// The path the instructions take, the operand is found as a pointer before it is read
+static void RunReadPointer(const BENCHMARK *benchmark)
+{
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < BUS_OPERATIONS; i++)
+    {
+        sum += mapper.read_pointer(mapper.get_memory_pointer(i & (INTERNAL_RAM_BANK_SIZE - 1)));
+    }
+    busSink = sum;
+}
+
+/* Ppu */
+
+static void SetupBackground(const BENCHMARK *benchmark)
+{
+    // Every tile and palette of both nametables in use, written through the registers like a game does
+    write_ppu_addr(VRAM_ADDRESS >> 8);
+    write_ppu_addr(VRAM_ADDRESS & 0xff);
+    for (uint16_t i = 0; i < NAME_TABLE_SIZE * 2; i++)
+    {
+        write_ppu_data(i % NAME_TABLE_SIZE < NAMETABLE_ATTRIBUTE_OFFSET ? i * 7 : i * 0x1B);
+    }
+
+    write_ppu_addr(PALETTE_ADDRESS >> 8);
+    write_ppu_addr(PALETTE_ADDRESS & 0xff);
+    for (uint8_t i = 0; i < PALETTE_SIZE; i++)
+    {
+        write_ppu_data(i * 5 % NES_COLOR_COUNT);
+    }
+
+    // Scrolled into the middle of the plane, so both nametables are drawn
+    write_ppu_scroll(100);
+    write_ppu_scroll(0);
+    write_ppu_ctrl(0);
+    write_ppu_mask(BC_ENABLE_BIT | BC_LC_ENABLE_BITS);
+
+    memset(oam_memory, 0xFF, OAM_SIZE);
+    refresh_oam_shadow();
+}
+
+static void SetupSprites(const BENCHMARK *benchmark)
+{
+    SetupBackground(benchmark);
+
+    // All 64 sprites, 8 on each of the lines they cover, with every flip and priority
+    for (uint8_t i = 0; i < OAM_SPRITE_COUNT; i++)
+    {
+        oam_memory[i * 4 + OAM_Y] = (i / OAM2_SPRITE_COUNT) * 28 + 4;
+        oam_memory[i * 4 + OAM_TILE] = i * 3;
+        oam_memory[i * 4 + OAM_ATTRIBUTE] = (i & PALETTE_BITS) | ((i << 3) & (FLIP_V_BIT | FLIP_H_BIT | PRIORITY_BIT));
+        oam_memory[i * 4 + OAM_X] = (i % OAM2_SPRITE_COUNT) * 30 + 8;
+    }
+    refresh_oam_shadow();
+
+    write_ppu_ctrl(SPRITE_HIGHT_BIT);
+    write_ppu_mask(BC_ENABLE_BIT | BC_LC_ENABLE_BITS | SPRITE_ENABLE_BIT | SPRITE_LC_ENABLE_BIT);
+}
+
+static void RunFrame(const BENCHMARK *benchmark)
+{
+    // Frames where nothing changed are not drawn, so every frame is made dirty
+    mark_ppu_dirty();
+
+    for (uint32_t i = 0; i < BENCH_PPU_CYCLES_PER_FRAME; i++)
+    {
+        perform_next_ppu_cycle();
+    }
+}
+
+// As when the game scrolls to new tiles or switches patterns, the whole background plane is drawn again
+static void RunFrameRedraw(const BENCHMARK *benchmark)
+{
+    mark_background_dirty(0x0000);
+    RunFrame(benchmark);
+}
+
+static void SetupOamDma(const BENCHMARK *benchmark)
+{
+    for (uint16_t i = 0; i < OAM_SIZE; i++)
+    {
+        cpu_memory[(BENCH_OAM_PAGE << 8) + i] = i;
+    }
+}
+
+static void RunOamDma(const BENCHMARK *benchmark)
+{
+    for (uint32_t i = 0; i < OAM_DMA_OPERATIONS; i++)
+    {
+        // A sprite moves between the copies, as in a game
+        cpu_memory[BENCH_OAM_PAGE << 8]++;
+        perform_oam_dma(BENCH_OAM_PAGE);
+    }
+}
+
+/* Present */
+
+// A frame of the sprite scene, converted as the present thread gets it
+static void SetupPresent(const BENCHMARK *benchmark)
+{
+    SetupSprites(benchmark);
+    RunFrame(benchmark);
+    RunFrame(benchmark);
+    ConvertIndexedToBGRA(indexed_frame, indexed_frame_emphasis, bgraFrame, TRUE);
+}
+
+static void RunConvert(const BENCHMARK *benchmark)
+{
+    ConvertIndexedToBGRA(indexed_frame, indexed_frame_emphasis, bgraFrame, TRUE);
+}
+
+static void RunScaler(const BENCHMARK *benchmark)
+{
+    ScaleFrame(benchmark->Scaler, bgraFrame, scaledFrame, benchmark->Scale);
+}
+
+#define CPU_BENCHMARK(name, opcode) {name, "instructions", CPU_OPERATIONS, SetupInstruction, RunInstruction, opcode}
+#define BUS_BENCHMARK(name, run) {name, "accesses", BUS_OPERATIONS, NULL, run}
+#define PPU_BENCHMARK(name, setup, run) {name, "pixels", NES_PX_WIDTH * NES_PX_HEIGHT, setup, run}
+#define SCALER_BENCHMARK(name, scaler, scale) {name, "pixels", NES_PX_WIDTH * NES_PX_HEIGHT * scale * scale, SetupPresent, RunScaler, 0, scaler, scale}
+
+static const BENCHMARK benchmarks[] =
+{
+    // One instruction of each addressing mode, on the operands set up by SetupInstruction
+    CPU_BENCHMARK("cpu/accumulator", 0x0A),  // ASL A
+    CPU_BENCHMARK("cpu/absolute", 0xAD),     // LDA $0310
+    CPU_BENCHMARK("cpu/absolute_x", 0xBD),   // LDA $0310,X
+    CPU_BENCHMARK("cpu/absolute_y", 0xB9),   // LDA $0310,Y
+    CPU_BENCHMARK("cpu/immediate", 0xA9),    // LDA #$10
+    CPU_BENCHMARK("cpu/implied", 0xE8),      // INX
+    CPU_BENCHMARK("cpu/indirect", 0x6C),     // JMP ($0310)
+    CPU_BENCHMARK("cpu/x_indirect", 0xA1),   // LDA ($10,X)
+    CPU_BENCHMARK("cpu/indirect_y", 0xB1),   // LDA ($10),Y
+    CPU_BENCHMARK("cpu/relative", 0xD0),     // BNE
+    CPU_BENCHMARK("cpu/zeropage", 0xA5),     // LDA $10
+    CPU_BENCHMARK("cpu/zeropage_x", 0xB5),   // LDA $10,X
+    CPU_BENCHMARK("cpu/zeropage_y", 0xB6),   // LDX $10,Y
+    CPU_BENCHMARK("cpu/read_modify_write", 0xEE), // INC $0310
+
+    BUS_BENCHMARK("bus/read_ram", RunReadRam),
+    BUS_BENCHMARK("bus/write_ram", RunWriteRam),
+    BUS_BENCHMARK("bus/read_rom", RunReadRom),
+    BUS_BENCHMARK("bus/read_pointer", RunReadPointer),
+
+    PPU_BENCHMARK("ppu/background", SetupBackground, RunFrame),
+    PPU_BENCHMARK("ppu/background_redraw", SetupBackground, RunFrameRedraw),
+    PPU_BENCHMARK("ppu/sprites", SetupSprites, RunFrame),
+    {"ppu/oam_dma", "transfers", OAM_DMA_OPERATIONS, SetupOamDma, RunOamDma},
+
+    PPU_BENCHMARK("present/convert_indexed", SetupPresent, RunConvert),
+    SCALER_BENCHMARK("scaler/nearest_x3", SCALER_NEAREST, 3),
+    SCALER_BENCHMARK("scaler/scale2x", SCALER_SCALE2X, 2),
+    SCALER_BENCHMARK("scaler/scale3x", SCALER_SCALE3X, 3),
+    SCALER_BENCHMARK("scaler/2xbr", SCALER_XBR, 2),
+};
+
+static int CompareTimes(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static BENCHMARK_RESULT RunBenchmark(const BENCHMARK *benchmark, uint32_t warmup, uint32_t repetitions, double *times)
+{
+    int64_t frequency;
+    QueryPerformanceFrequency((LARGE_INTEGER *)&frequency);
+
+    // Every benchmark starts from a cartridge just powered up
+    SetupCartridge();
+    if (benchmark->Setup != NULL)
+    {
+        benchmark->Setup(benchmark);
+    }
+
+    for (uint32_t i = 0; i < warmup; i++)
+    {
+        benchmark->Run(benchmark);
+    }
+
+    for (uint32_t i = 0; i < repetitions; i++)
+    {
+        int64_t start, end;
+        QueryPerformanceCounter((LARGE_INTEGER *)&start);
+        benchmark->Run(benchmark);
+        QueryPerformanceCounter((LARGE_INTEGER *)&end);
+        times[i] = (double)(end - start) * 1000000000.0 / frequency;
+    }
+
+    qsort(times, repetitions, sizeof(double), CompareTimes);
+
+    // The p99 is the nearest rank, the slowest repetition when there are less than 100
+    BENCHMARK_RESULT result;
+    result.Min = times[0];
+    result.Median = repetitions % 2 ? times[repetitions / 2] : (times[repetitions / 2 - 1] + times[repetitions / 2]) / 2;
+    result.P99 = times[(repetitions * 99 + 99) / 100 - 1];
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    const char *filter = NULL;
+    uint32_t warmup = DEFAULT_WARMUP;
+    uint32_t repetitions = DEFAULT_REPETITIONS;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+        {
+            warmup = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc)
+        {
+            repetitions = strtoul(argv[++i], NULL, 10);
+        }
+        else if (argv[i][0] != '-' && filter == NULL)
+        {
+            filter = argv[i];
+        }
+        else
+        {
+            fprintf(stderr, "Usage: nesbench [filter] [--warmup N] [--repetitions N]\n");
+            return 1;
+        }
+    }
+
+    if (repetitions == 0)
+    {
+        fprintf(stderr, "At least one repetition is needed\n");
+        return 1;
+    }
+
+    BuildConversionTables();
+    ppu_output = PPU_OUTPUT_INDEXED;
+
+    bgraFrame = VirtualAlloc(NULL, DRAW_AREA_MEMORY_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    double *times = malloc(repetitions * sizeof(double));
+    if (bgraFrame == NULL || times == NULL || !InitScalers())
+    {
+        fprintf(stderr, "Unable to allocate the frames\n");
+        return 1;
+    }
+
+    printf("{\n  \"warmup\": %u,\n  \"repetitions\": %u,\n  \"benchmarks\": [", warmup, repetitions);
+
+    BOOL first = TRUE;
+    for (uint32_t i = 0; i < sizeof(benchmarks) / sizeof(BENCHMARK); i++)
+    {
+        const BENCHMARK *benchmark = &benchmarks[i];
+        if (filter != NULL && strstr(benchmark->Name, filter) == NULL)
+        {
+            continue;
+        }
+
+        BENCHMARK_RESULT result = RunBenchmark(benchmark, warmup, repetitions, times);
+
+        printf("%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"operations\": %u, \"median_ns\": %.0f, \"p99_ns\": %.0f, \"min_ns\": %.0f, \"per_second\": %.0f}",
+               first ? "" : ",", benchmark->Name, benchmark->Unit, benchmark->Operations,
+               result.Median, result.P99, result.Min, benchmark->Operations * 1000000000.0 / result.Median);
+        fflush(stdout);
+
+        // Progress for the one waiting, the JSON is kept alone on standard output
+        fprintf(stderr, "%-28s %12.1f M%s/s\n", benchmark->Name, benchmark->Operations * 1000.0 / result.Median, benchmark->Unit);
+        first = FALSE;
+    }
+
+    printf("\n  ]\n}\n");
+
+    FreeScalers();
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../main.h"
+#include "../video.h"
+#include "../videocapture.h"
+#include "../nes/loader.h"
+#include "../nes/cpu.h"
+#include "../nes/ppu.h"
+#include "../nes/cpu_trace.h"
+#include "../nes/cpu_profile.h"
+
+/*
+    Runs a rom without a window and without waiting between frames, optionally recording the video
+
+    nesrun <rom> <frames> [--video <file or -> [y4m|raw|indexed] [--delta]] [--trace <file> [--trace-ring <instructions>]] [--profile]
+
+    The emulation runs as fast as it can, the video capture writes from its own thread and the emulation waits for it
+    when its queue is full, so every frame is written. If frames are dropped anyway the tool exits with 2.
+    With "-" as the file the video goes to standard output, to be piped into an encoder:
+        nesrun game.nes 3600 --video - y4m | ffmpeg -i - game.mkv
+    Anything else the tool prints goes to standard error.
+    With --trace every instruction is written to a binary cpu trace, or only the last ones with --trace-ring,
+    to be read with the cputrace tool.
+    With --profile the cycles of the game are profiled, and the report and the collapsed stacks are written to
+    cpu_profile.txt and cpu_profile.folded.
+*/
+
+// The ppu draws into the backbuffer of the window in the BGRA output, the tool only uses the indexed output
+NES_BITMAP backBuffer;
+
+static const char *formatArguments[VIDEO_FORMAT_COUNT] = {"y4m", "raw", "indexed"};
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: nesrun <rom> <frames> [--video <file or -> [y4m|raw|indexed] [--delta]] [--trace <file> [--trace-ring <instructions>]] [--profile]\n");
+        return 1;
+    }
+
+    uint32_t numFrames = atoi(argv[2]);
+    LPCSTR videoFile = NULL;
+    VIDEO_FORMAT format = VIDEO_FORMAT_Y4M;
+    BOOL delta = FALSE;
+    LPCSTR traceFile = NULL;
+    uint64_t traceRing = 0;
+    BOOL profile = FALSE;
+
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--video") == 0 && i + 1 < argc)
+        {
+            videoFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--delta") == 0)
+        {
+            delta = TRUE;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            traceFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--trace-ring") == 0 && i + 1 < argc)
+        {
+            traceRing = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--profile") == 0)
+        {
+            profile = TRUE;
+        }
+        else
+        {
+            BOOL known = FALSE;
+            for (uint8_t f = 0; f < VIDEO_FORMAT_COUNT; f++)
+            {
+                if (strcmp(argv[i], formatArguments[f]) == 0)
+                {
+                    format = f;
+                    known = TRUE;
+                }
+            }
+
+            if (!known)
+            {
+                fprintf(stderr, "Unknown argument %s\n", argv[i]);
+                return 1;
+            }
+        }
+    }
+
+    HANDLE romFile = CreateFileA(argv[1], GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (romFile == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Unable to open %s\n", argv[1]);
+        return 1;
+    }
+
+    LOAD_STATUS status = loadNESFile(romFile);
+    CloseHandle(romFile);
+
+    if (status != SUCCESS)
+    {
+        fprintf(stderr, "Unable to load %s\n", argv[1]);
+        return 1;
+    }
+
+    BuildConversionTables();
+    ppu_output = PPU_OUTPUT_INDEXED;
+    cpu_power_up();
+    ppu_power_up();
+
+    if (videoFile != NULL && !StartVideoCapture(videoFile, format, delta, TRUE))
+    {
+        fprintf(stderr, "Unable to start the video capture to %s\n", videoFile);
+        return 1;
+    }
+
+    if (traceFile != NULL && !start_cpu_trace(traceFile, traceRing))
+    {
+        fprintf(stderr, "Unable to start the cpu trace to %s\n", traceFile);
+        return 1;
+    }
+
+    if (profile && !start_cpu_profile())
+    {
+        fprintf(stderr, "Unable to start the cpu profile\n");
+        return 1;
+    }
+
+    int64_t frequency, start, end;
+    QueryPerformanceFrequency((LARGE_INTEGER *)&frequency);
+    QueryPerformanceCounter((LARGE_INTEGER *)&start);
+
+    // The frame counter of the ppu is 16 bits, so the frames are counted as it changes
+    // It changes as each frame starts, and the ppu is powered up just before the first one starts, so that change is skipped
+    uint32_t frames = 0;
+    uint16_t frameCounter = ppu_state.frame_counter + 1;
+    while (frames < numFrames && cpu.powered)
+    {
+        perform_next_instruction();
+
+        while (ppu_state.cycle < cpu.cycle * 3)
+        {
+            perform_next_ppu_cycle();
+        }
+
+        if (ppu_state.frame_counter != frameCounter)
+        {
+            frameCounter = ppu_state.frame_counter;
+            frames++;
+        }
+    }
+
+    QueryPerformanceCounter((LARGE_INTEGER *)&end);
+    double seconds = (double)(end - start) / frequency;
+
+    uint32_t dropped = videoCapture.Dropped;
+    uint64_t traced = cpu_trace.header.count;
+    StopVideoCapture();
+    stop_cpu_trace();
+
+    if (profile)
+    {
+        write_cpu_profile(CPU_PROFILE_REPORT_FILE, CPU_PROFILE_STACKS_FILE);
+        stop_cpu_profile();
+    }
+
+    fprintf(stderr, "%d frames in %.3f s (%.1f fps)", frames, seconds, frames / seconds);
+    if (videoFile != NULL)
+    {
+        fprintf(stderr, ", %d video frames dropped", dropped);
+    }
+    if (traceFile != NULL)
+    {
+        fprintf(stderr, ", %llu instructions traced", traced);
+    }
+    fprintf(stderr, "\n");
+
+    if (dropped)
+    {
+        fprintf(stderr, "The video capture is incomplete\n");
+        return 2;
+    }
+
+    return 0;
+}
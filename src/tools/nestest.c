@@ -0,0 +1,239 @@
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../main.h"
+#include "../nes/loader.h"
+#include "../nes/cpu.h"
+#include "../nes/ppu.h"
+#include "../nes/cpu_trace.h"
+
+/*
+    Runs kevtris's nestest in its automation mode and compares every instruction with the golden log
+
+    nestest <nestest.nes> <nestest.log> [--illegal]
+
+    The rom starts at $C000 with the state the log starts with. The log is read into memory before the cpu runs,
+    and before each instruction the registers and the cycle count are compared with the next line of the log,
+    stopping at the first one which differs. The emulator only has the legal instructions, so the test stops
+    where the log reaches the illegal ones (marked with '*'), unless --illegal is given.
+    The exit code is 0 when every line matched and the test wrote no error code to $02 and $03.
+*/
+
+#define NESTEST_START_ADDRESS 0xC000
+// The state after the reset sequence, as on the first line of the log
+#define NESTEST_START_CYCLE 7
+#define NESTEST_START_SR 0x24
+// Lines shown before the one which differs
+#define NESTEST_CONTEXT_LINES 4
+// The result of the tests of the legal and illegal instructions, 0 when all passed
+#define NESTEST_RESULT_ADDRESS 0x0002
+
+typedef struct GOLDEN_LINE
+{
+    uint16_t Pc;
+    uint8_t Ac;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t Sr;
+    uint8_t Sp;
+    uint64_t Cycle;
+    BOOL Illegal;
+    char *Text;
+} GOLDEN_LINE;
+
+// The emulator only draws into this in the BGRA output, the test does not draw
+NES_BITMAP backBuffer;
+
+static GOLDEN_LINE *goldenLines;
+static uint32_t numGoldenLines;
+
+// Reads the whole log into memory, with the fields of each line parsed
+static BOOL ReadGoldenLog(LPCSTR filename)
+{
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+
+    LARGE_INTEGER size;
+    GetFileSizeEx(file, &size);
+    char *text = malloc(size.QuadPart + 1);
+    DWORD bytesRead;
+    BOOL read = ReadFile(file, text, size.QuadPart, &bytesRead, NULL) && bytesRead == size.QuadPart;
+    CloseHandle(file);
+
+    if (!read)
+    {
+        free(text);
+        return FALSE;
+    }
+    text[size.QuadPart] = '\0';
+
+    uint32_t maxLines = 1;
+    for (char *c = text; *c != '\0'; c++)
+    {
+        maxLines += *c == '\n';
+    }
+    goldenLines = malloc(maxLines * sizeof(GOLDEN_LINE));
+
+    for (char *line = strtok(text, "\r\n"); line != NULL; line = strtok(NULL, "\r\n"))
+    {
+        GOLDEN_LINE *golden = &goldenLines[numGoldenLines];
+        char *registers = strstr(line, "A:");
+        char *cycle = strstr(line, "CYC:");
+
+        if (registers == NULL || cycle == NULL ||
+            sscanf(line, "%4hx", &golden->Pc) != 1 ||
+            sscanf(registers, "A:%2hhx X:%2hhx Y:%2hhx P:%2hhx SP:%2hhx", &golden->Ac, &golden->X, &golden->Y, &golden->Sr, &golden->Sp) != 5 ||
+            sscanf(cycle, "CYC:%llu", &golden->Cycle) != 1)
+        {
+            fprintf(stderr, "Line %d of %s is not in the format of nestest.log:\n%s\n", numGoldenLines + 1, filename, line);
+            return FALSE;
+        }
+
+        // The mnemonic of an illegal instruction starts with a '*' in the column before the mnemonics
+        golden->Illegal = strlen(line) > 15 && line[15] == '*';
+        golden->Text = line;
+        numGoldenLines++;
+    }
+
+    return TRUE;
+}
+
+static void ReportDivergence(uint32_t index, const cpu_trace_record_t *record)
+{
+    GOLDEN_LINE *golden = &goldenLines[index];
+
+    fprintf(stderr, "FAIL at line %d of the log, after %d matching instructions\n", index + 1, index);
+
+    uint32_t first = index > NESTEST_CONTEXT_LINES ? index - NESTEST_CONTEXT_LINES : 0;
+    for (uint32_t i = first; i < index; i++)
+    {
+        fprintf(stderr, "           %s\n", goldenLines[i].Text);
+    }
+
+    char actual[CPU_TRACE_LINE_SIZE];
+    format_cpu_trace_record(record, actual);
+    fprintf(stderr, "expected:  %s\n", golden->Text);
+    fprintf(stderr, "actual:    %s\n", actual);
+
+    fprintf(stderr, "differs:  ");
+    if (record->pc != golden->Pc)
+        fprintf(stderr, " PC");
+    if (record->ac != golden->Ac)
+        fprintf(stderr, " A");
+    if (record->x != golden->X)
+        fprintf(stderr, " X");
+    if (record->y != golden->Y)
+        fprintf(stderr, " Y");
+    if (record->sr != golden->Sr)
+        fprintf(stderr, " P (%02X ^ %02X = %02X)", record->sr, golden->Sr, record->sr ^ golden->Sr);
+    if (record->sp != golden->Sp)
+        fprintf(stderr, " SP");
+    if (record->cycle != golden->Cycle)
+        fprintf(stderr, " CYC (%lld)", (int64_t)(record->cycle - golden->Cycle));
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: nestest <nestest.nes> <nestest.log> [--illegal]\n");
+        return 1;
+    }
+
+    BOOL illegal = argc > 3 && strcmp(argv[3], "--illegal") == 0;
+
+    if (!ReadGoldenLog(argv[2]))
+    {
+        fprintf(stderr, "Unable to read the log %s\n", argv[2]);
+        return 1;
+    }
+
+    HANDLE romFile = CreateFileA(argv[1], GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (romFile == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Unable to open %s\n", argv[1]);
+        return 1;
+    }
+
+    LOAD_STATUS status = loadNESFile(romFile);
+    CloseHandle(romFile);
+
+    if (status != SUCCESS)
+    {
+        fprintf(stderr, "Unable to load %s\n", argv[1]);
+        return 1;
+    }
+
+    BuildConversionTables();
+    ppu_output = PPU_OUTPUT_NONE;
+    cpu_power_up();
+    ppu_power_up();
+
+    cpu.registers.pc = NESTEST_START_ADDRESS;
+    cpu.registers.sr = NESTEST_START_SR;
+    cpu.cycle = NESTEST_START_CYCLE;
+    ppu_state.cycle = NESTEST_START_CYCLE * 3;
+
+    int64_t frequency, start, end;
+    QueryPerformanceFrequency((LARGE_INTEGER *)&frequency);
+    QueryPerformanceCounter((LARGE_INTEGER *)&start);
+
+    uint32_t index = 0;
+    BOOL diverged = FALSE;
+    // The state before each instruction, as the trace records it
+    cpu_trace_record_t record = {0};
+    while (index < numGoldenLines && cpu.powered)
+    {
+        GOLDEN_LINE *golden = &goldenLines[index];
+        if (golden->Illegal && !illegal)
+        {
+            break;
+        }
+
+        fill_cpu_trace_record(&record);
+        if (record.pc != golden->Pc || record.ac != golden->Ac || record.x != golden->X || record.y != golden->Y ||
+            record.sr != golden->Sr || record.sp != golden->Sp || record.cycle != golden->Cycle)
+        {
+            diverged = TRUE;
+            break;
+        }
+
+        perform_next_instruction();
+
+        while (ppu_state.cycle < cpu.cycle * 3)
+        {
+            perform_next_ppu_cycle();
+        }
+
+        index++;
+    }
+
+    QueryPerformanceCounter((LARGE_INTEGER *)&end);
+    double milliseconds = (double)(end - start) * 1000 / frequency;
+
+    if (diverged)
+    {
+        ReportDivergence(index, &record);
+        return 1;
+    }
+
+    uint8_t legalResult = mapper.read_memory(NESTEST_RESULT_ADDRESS);
+    uint8_t illegalResult = mapper.read_memory(NESTEST_RESULT_ADDRESS + 1);
+
+    fprintf(stderr, "%s: %d of %d lines matched in %.2f ms, result $02 = %02X, $03 = %02X\n",
+            legalResult == 0 && (!illegal || illegalResult == 0) ? "PASS" : "FAIL",
+            index, numGoldenLines, milliseconds, legalResult, illegalResult);
+
+    if (index < numGoldenLines && !goldenLines[index].Illegal)
+    {
+        fprintf(stderr, "The cpu stopped at line %d of the log\n", index + 1);
+        return 1;
+    }
+
+    return legalResult == 0 && (!illegal || illegalResult == 0) ? 0 : 1;
+}
@@ -0,0 +1,242 @@
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../main.h"
+#include "../video.h"
+#include "../nes/loader.h"
+#include "../nes/ppu.h"
+#include "../nes/ppu_capture.h"
+
+/*
+    Draws the frames of a ppu capture (made with "Toggle ppu capture") as bitmaps
+
+    ppurender <capture file> <first frame> <last frame> <output directory> [workers]
+
+    Every frame in the capture can be drawn on its own, so the range is split between a number of worker processes,
+    one per core unless given. The ppu is all global state, which is why processes are used rather than threads.
+    Each worker runs the same ppu code as the emulator, with the tool starting itself with "--worker" and its part of the range.
+*/
+
+#define WORKER_ARGUMENT "--worker"
+#define BITMAP_HEADER_SIZE 54
+
+// The ppu draws into the backbuffer of the window in the BGRA output, the tool only uses the indexed output
+NES_BITMAP backBuffer;
+
+void WriteBitmap(LPCSTR filename, PIXEL32 *pixels)
+{
+    uint32_t imageSize = NES_PX_WIDTH * NES_PX_HEIGHT * sizeof(PIXEL32);
+    uint32_t fileSize = BITMAP_HEADER_SIZE + imageSize;
+
+    // BITMAPFILEHEADER followed by BITMAPINFOHEADER, a bottom-up 32-bit image
+    uint8_t bitmapHeader[BITMAP_HEADER_SIZE] = {'B', 'M'};
+    *(uint32_t *)(bitmapHeader + 2) = fileSize;
+    *(uint32_t *)(bitmapHeader + 10) = BITMAP_HEADER_SIZE;
+    *(uint32_t *)(bitmapHeader + 14) = 40;
+    *(int32_t *)(bitmapHeader + 18) = NES_PX_WIDTH;
+    *(int32_t *)(bitmapHeader + 22) = NES_PX_HEIGHT;
+    *(uint16_t *)(bitmapHeader + 26) = 1;
+    *(uint16_t *)(bitmapHeader + 28) = 32;
+    *(uint32_t *)(bitmapHeader + 34) = imageSize;
+
+    HANDLE file = CreateFileA(filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        printf("Unable to create %s\n", filename);
+        return;
+    }
+
+    DWORD bytesWritten;
+    WriteFile(file, bitmapHeader, BITMAP_HEADER_SIZE, &bytesWritten, NULL);
+    WriteFile(file, pixels, imageSize, &bytesWritten, NULL);
+    CloseHandle(file);
+}
+
+HANDLE OpenCapture(LPCSTR filename)
+{
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        printf("Unable to open %s\n", filename);
+    }
+    return file;
+}
+
+int RenderFrames(LPCSTR captureName, uint32_t firstFrame, uint32_t lastFrame, LPCSTR outputDirectory)
+{
+    HANDLE file = OpenCapture(captureName);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < firstFrame; i++)
+    {
+        if (!skip_ppu_capture_frame(file))
+        {
+            printf("The capture has only %d frames\n", i);
+            CloseHandle(file);
+            return 1;
+        }
+    }
+
+    ppu_capture_frame_t *frame = VirtualAlloc(NULL, sizeof(ppu_capture_frame_t), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    ppu_log_entry_t *entries = VirtualAlloc(NULL, PPU_CAPTURE_MAX_ENTRIES * sizeof(ppu_log_entry_t), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    PIXEL32 *pixels = VirtualAlloc(NULL, BGRA_FRAME_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+    build_emphasis_palettes();
+    BuildConversionTables();
+    ppu_output = PPU_OUTPUT_INDEXED;
+
+    int result = 0;
+    for (uint32_t i = firstFrame; i <= lastFrame; i++)
+    {
+        if (!read_ppu_capture_frame(file, frame, entries))
+        {
+            printf("Unable to read frame %d\n", i);
+            result = 1;
+            break;
+        }
+
+        if (!select_mapper(frame->mapper_number))
+        {
+            printf("Mapper not implemented: %d\n", frame->mapper_number);
+            result = 1;
+            break;
+        }
+
+        restore_ppu_capture_frame(frame);
+        replay_ppu_capture_frame(frame, entries);
+
+        char filename[MAX_PATH];
+        snprintf(filename, sizeof(filename), "%s\\frame_%06d.bmp", outputDirectory, i);
+        ConvertIndexedToBGRA(indexed_frame, indexed_frame_emphasis, pixels, TRUE);
+        WriteBitmap(filename, pixels);
+    }
+
+    VirtualFree(frame, 0, MEM_RELEASE);
+    VirtualFree(entries, 0, MEM_RELEASE);
+    VirtualFree(pixels, 0, MEM_RELEASE);
+    CloseHandle(file);
+    return result;
+}
+
+uint32_t CountFrames(LPCSTR captureName)
+{
+    HANDLE file = OpenCapture(captureName);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return 0;
+    }
+
+    uint32_t count = 0;
+    while (skip_ppu_capture_frame(file))
+    {
+        count++;
+    }
+
+    CloseHandle(file);
+    return count;
+}
+
+int StartWorkers(LPCSTR captureName, uint32_t firstFrame, uint32_t lastFrame, LPCSTR outputDirectory, uint32_t numWorkers)
+{
+    char executable[MAX_PATH];
+    GetModuleFileNameA(NULL, executable, MAX_PATH);
+
+    // Each worker gets a part of the range of about the same size
+    uint32_t numFrames = lastFrame - firstFrame + 1;
+    if (numWorkers > numFrames)
+    {
+        numWorkers = numFrames;
+    }
+
+    HANDLE workers[MAXIMUM_WAIT_OBJECTS];
+    uint32_t started = 0;
+    int result = 0;
+
+    for (uint32_t i = 0; i < numWorkers; i++)
+    {
+        uint32_t first = firstFrame + (uint64_t)numFrames * i / numWorkers;
+        uint32_t last = firstFrame + (uint64_t)numFrames * (i + 1) / numWorkers - 1;
+
+        char commandLine[3 * MAX_PATH];
+        snprintf(commandLine, sizeof(commandLine), "\"%s\" %s \"%s\" %d %d \"%s\"", executable, WORKER_ARGUMENT, captureName, first, last, outputDirectory);
+
+        STARTUPINFOA startupInfo = {0};
+        startupInfo.cb = sizeof(startupInfo);
+        PROCESS_INFORMATION processInfo;
+
+        if (!CreateProcessA(NULL, commandLine, NULL, NULL, FALSE, 0, NULL, NULL, &startupInfo, &processInfo))
+        {
+            printf("Unable to start the worker for frames %d - %d\n", first, last);
+            result = 1;
+            continue;
+        }
+
+        CloseHandle(processInfo.hThread);
+        workers[started++] = processInfo.hProcess;
+    }
+
+    WaitForMultipleObjects(started, workers, TRUE, INFINITE);
+
+    for (uint32_t i = 0; i < started; i++)
+    {
+        DWORD exitCode;
+        if (!GetExitCodeProcess(workers[i], &exitCode) || exitCode != 0)
+        {
+            result = 1;
+        }
+        CloseHandle(workers[i]);
+    }
+
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 6 && strcmp(argv[1], WORKER_ARGUMENT) == 0)
+    {
+        return RenderFrames(argv[2], atoi(argv[3]), atoi(argv[4]), argv[5]);
+    }
+
+    if (argc != 5 && argc != 6)
+    {
+        printf("Usage: ppurender <capture file> <first frame> <last frame> <output directory> [workers]\n");
+        return 1;
+    }
+
+    uint32_t numFrames = CountFrames(argv[1]);
+    uint32_t firstFrame = atoi(argv[2]);
+    uint32_t lastFrame = atoi(argv[3]);
+
+    if (numFrames == 0 || firstFrame >= numFrames || firstFrame > lastFrame)
+    {
+        printf("No frames to draw, the capture has %d frames\n", numFrames);
+        return 1;
+    }
+
+    if (lastFrame >= numFrames)
+    {
+        lastFrame = numFrames - 1;
+    }
+
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    uint32_t numWorkers = argc == 6 ? atoi(argv[5]) : systemInfo.dwNumberOfProcessors;
+
+    if (numWorkers < 1)
+    {
+        numWorkers = 1;
+    }
+    else if (numWorkers > MAXIMUM_WAIT_OBJECTS)
+    {
+        numWorkers = MAXIMUM_WAIT_OBJECTS;
+    }
+
+    CreateDirectoryA(argv[4], NULL);
+
+    printf("Drawing frames %d - %d with %d workers\n", firstFrame, lastFrame, numWorkers);
+    return StartWorkers(argv[1], firstFrame, lastFrame, argv[4], numWorkers);
+}
@@ -0,0 +1,101 @@
+#include <windows.h>
+#include <stdint.h>
+#include <immintrin.h>
+#include "main.h"
+#include "video.h"
+#include "./nes/ppu.h"
+
+// The emphasis palettes converted to the other output formats
+uint16_t rgb565Palettes[EMPHASIS_COUNT][NES_COLOR_COUNT];
+uint8_t grayscalePalettes[EMPHASIS_COUNT][NES_COLOR_COUNT];
+
+BOOL useAVX2;
+
+void BuildConversionTables(void)
+{
+    build_emphasis_palettes();
+
+    for (uint8_t emphasis = 0; emphasis < EMPHASIS_COUNT; emphasis++)
+    {
+        for (uint8_t color = 0; color < NES_COLOR_COUNT; color++)
+        {
+            PIXEL32 px = emphasis_palettes[emphasis][color];
+            rgb565Palettes[emphasis][color] = ((px.BGRA.Red >> 3) << 11) | ((px.BGRA.Green >> 2) << 5) | (px.BGRA.Blue >> 3);
+            // BT.601 luma weights in 8-bit fixed point
+            grayscalePalettes[emphasis][color] = (77 * px.BGRA.Red + 150 * px.BGRA.Green + 29 * px.BGRA.Blue) >> 8;
+        }
+    }
+
+    __builtin_cpu_init();
+    useAVX2 = __builtin_cpu_supports("avx2");
+}
+
+// Converts one row using gathers of 8 palette entries at a time
+__attribute__((target("avx2"))) static void ConvertRowToBGRA_AVX2(const uint8_t *src, PIXEL32 *dst, const PIXEL32 *palette)
+{
+    for (uint16_t x = 0; x < NES_PX_WIDTH; x += 8)
+    {
+        __m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + x)));
+        __m256i pixels = _mm256_i32gather_epi32((const int *)palette, indices, 4);
+        _mm256_storeu_si256((__m256i *)(dst + x), pixels);
+    }
+}
+
+static void ConvertRowToBGRA(const uint8_t *src, PIXEL32 *dst, const PIXEL32 *palette)
+{
+    for (uint16_t x = 0; x < NES_PX_WIDTH; x += 4)
+    {
+        dst[x + 0] = palette[src[x + 0]];
+        dst[x + 1] = palette[src[x + 1]];
+        dst[x + 2] = palette[src[x + 2]];
+        dst[x + 3] = palette[src[x + 3]];
+    }
+}
+
+// The DIB backbuffer is stored bottom-up, while the indexed frame is top-down
+void ConvertIndexedToBGRA(const uint8_t *indices, const uint8_t *emphasis, PIXEL32 *dst, BOOL bottomUp)
+{
+    for (uint16_t y = 0; y < NES_PX_HEIGHT; y++)
+    {
+        const uint8_t *srcRow = indices + y * NES_PX_WIDTH;
+        PIXEL32 *dstRow = dst + (bottomUp ? NES_PX_HEIGHT - y - 1 : y) * NES_PX_WIDTH;
+        const PIXEL32 *palette = emphasis_palettes[emphasis[y]];
+
+        if (useAVX2)
+        {
+            ConvertRowToBGRA_AVX2(srcRow, dstRow, palette);
+        }
+        else
+        {
+            ConvertRowToBGRA(srcRow, dstRow, palette);
+        }
+    }
+}
+
+void ConvertIndexedToRGB565(uint16_t *dst)
+{
+    for (uint16_t y = 0; y < NES_PX_HEIGHT; y++)
+    {
+        const uint8_t *srcRow = indexed_frame + y * NES_PX_WIDTH;
+        const uint16_t *palette = rgb565Palettes[indexed_frame_emphasis[y]];
+
+        for (uint16_t x = 0; x < NES_PX_WIDTH; x++)
+        {
+            dst[y * NES_PX_WIDTH + x] = palette[srcRow[x]];
+        }
+    }
+}
+
+void ConvertIndexedToGrayscale(uint8_t *dst)
+{
+    for (uint16_t y = 0; y < NES_PX_HEIGHT; y++)
+    {
+        const uint8_t *srcRow = indexed_frame + y * NES_PX_WIDTH;
+        const uint8_t *palette = grayscalePalettes[indexed_frame_emphasis[y]];
+
+        for (uint16_t x = 0; x < NES_PX_WIDTH; x++)
+        {
+            dst[y * NES_PX_WIDTH + x] = palette[srcRow[x]];
+        }
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef VIDEO_H
+
+#define VIDEO_H
+
+#include <windows.h>
+#include <stdint.h>
+#include "main.h"
+
+// Bytes needed for a whole frame in each of the formats the indexed frame can be converted to
+#define BGRA_FRAME_SIZE (NES_PX_WIDTH * NES_PX_HEIGHT * 4)
+#define RGB565_FRAME_SIZE (NES_PX_WIDTH * NES_PX_HEIGHT * 2)
+#define GRAYSCALE_FRAME_SIZE (NES_PX_WIDTH * NES_PX_HEIGHT)
+
+void BuildConversionTables(void);
+// The indices and the emphasis of each row are those of the ppu (indexed_frame) or a copy of them in the swap chain
+void ConvertIndexedToBGRA(const uint8_t *indices, const uint8_t *emphasis, PIXEL32 *dst, BOOL bottomUp);
+void ConvertIndexedToRGB565(uint16_t *dst);
+void ConvertIndexedToGrayscale(uint8_t *dst);
+
+#endif
@@ -0,0 +1,321 @@
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "logger.h"
+#include "video.h"
+#include "videocapture.h"
+#include "./nes/ppu.h"
+
+/*
+    Lossless video capture, streamed to a file or standard output by a writer thread
+
+    The ppu copies each completed frame into a free slot of the queue and moves on.
+    If the writer falls so far behind that the queue is full, the frame is dropped and counted when playing in real time,
+    or the ppu waits for the writer to free a slot when the capture is started with wait (headless, where no frame may be lost).
+    All encoding is done by the writer thread, so the capture costs the emulation a copy of the frame.
+*/
+
+VIDEO_CAPTURE videoCapture;
+const char *videoFormatNames[VIDEO_FORMAT_COUNT] = {"Y4M", "Raw BGRA", "Indexed"};
+
+// BT.601 limited range YUV of each color, built from the same emphasis palettes as the BGRA output
+static uint8_t yuvPalettes[EMPHASIS_COUNT][NES_COLOR_COUNT][3];
+static PPU_OUTPUT previousOutput;
+
+static void RGBToYUV(PIXEL32 px, uint8_t *yuv)
+{
+    yuv[0] = ((66 * px.BGRA.Red + 129 * px.BGRA.Green + 25 * px.BGRA.Blue + 128) >> 8) + 16;
+    yuv[1] = ((-38 * px.BGRA.Red - 74 * px.BGRA.Green + 112 * px.BGRA.Blue + 128) >> 8) + 128;
+    yuv[2] = ((112 * px.BGRA.Red - 94 * px.BGRA.Green - 18 * px.BGRA.Blue + 128) >> 8) + 128;
+}
+
+// Returns the number of bytes of the encoded frame
+static uint32_t EncodeY4M(const VIDEO_FRAME *frame, uint8_t *out)
+{
+    const uint32_t planeSize = NES_PX_WIDTH * NES_PX_HEIGHT;
+    memcpy(out, "FRAME\n", 6);
+    uint8_t *plane = out + 6;
+
+    for (uint16_t y = 0; y < NES_PX_HEIGHT; y++)
+    {
+        for (uint16_t x = 0; x < NES_PX_WIDTH; x++)
+        {
+            uint8_t yuv[3];
+            if (frame->Indexed)
+            {
+                uint8_t emphasis = frame->Data[planeSize + y];
+                memcpy(yuv, yuvPalettes[emphasis][frame->Data[y * NES_PX_WIDTH + x]], 3);
+            }
+            else
+            {
+                RGBToYUV(((PIXEL32 *)frame->Data)[(NES_PX_HEIGHT - 1 - y) * NES_PX_WIDTH + x], yuv);
+            }
+
+            plane[y * NES_PX_WIDTH + x] = yuv[0];
+            plane[planeSize + y * NES_PX_WIDTH + x] = yuv[1];
+            plane[2 * planeSize + y * NES_PX_WIDTH + x] = yuv[2];
+        }
+    }
+
+    return 6 + 3 * planeSize;
+}
+
+static uint32_t EncodeRaw(const VIDEO_FRAME *frame, uint8_t *out)
+{
+    PIXEL32 *dst = (PIXEL32 *)out;
+
+    for (uint16_t y = 0; y < NES_PX_HEIGHT; y++)
+    {
+        if (frame->Indexed)
+        {
+            const PIXEL32 *palette = emphasis_palettes[frame->Data[NES_PX_WIDTH * NES_PX_HEIGHT + y]];
+            for (uint16_t x = 0; x < NES_PX_WIDTH; x++)
+            {
+                dst[y * NES_PX_WIDTH + x] = palette[frame->Data[y * NES_PX_WIDTH + x]];
+            }
+        }
+        else
+        {
+            memcpy(dst + y * NES_PX_WIDTH, (PIXEL32 *)frame->Data + (NES_PX_HEIGHT - 1 - y) * NES_PX_WIDTH, NES_PX_WIDTH * sizeof(PIXEL32));
+        }
+    }
+
+    return BGRA_FRAME_SIZE;
+}
+
+static uint32_t EncodeIndexed(const VIDEO_FRAME *frame, uint8_t *out, BOOL keyframe)
+{
+    const uint8_t *emphasis = frame->Data + NES_PX_WIDTH * NES_PX_HEIGHT;
+    const uint8_t *previousEmphasis = videoCapture.Previous + NES_PX_WIDTH * NES_PX_HEIGHT;
+    uint8_t *mask = out;
+    uint8_t *row = out + VIDEO_ROW_MASK_SIZE;
+    memset(mask, 0, VIDEO_ROW_MASK_SIZE);
+
+    for (uint16_t y = 0; y < NES_PX_HEIGHT; y++)
+    {
+        const uint8_t *indices = frame->Data + y * NES_PX_WIDTH;
+
+        if (keyframe || emphasis[y] != previousEmphasis[y] || memcmp(indices, videoCapture.Previous + y * NES_PX_WIDTH, NES_PX_WIDTH) != 0)
+        {
+            mask[y / 8] |= 1 << (y % 8);
+            memcpy(row, indices, NES_PX_WIDTH);
+            row[NES_PX_WIDTH] = emphasis[y];
+            row += NES_PX_WIDTH + 1;
+        }
+    }
+
+    memcpy(videoCapture.Previous, frame->Data, VIDEO_INDEXED_FRAME_SIZE);
+    return row - out;
+}
+
+static void WriteVideo(const void *data, uint32_t size)
+{
+    DWORD bytesWritten;
+    if (!WriteFile(videoCapture.File, data, size, &bytesWritten, NULL) || bytesWritten != size)
+    {
+        Log("Unable to write the video capture", LL_ERROR);
+    }
+}
+
+DWORD WINAPI VideoWriterProc(LPVOID param)
+{
+    uint32_t frameNumber = 0;
+
+    for (;;)
+    {
+        // Frames queued before the stop are still written
+        BOOL stop = videoCapture.Stop;
+
+        while (videoCapture.Tail != videoCapture.Head)
+        {
+            const VIDEO_FRAME *frame = &videoCapture.Frames[videoCapture.Tail % VIDEO_CAPTURE_QUEUE_LENGTH];
+            uint32_t size;
+
+            switch (videoCapture.Format)
+            {
+            case VIDEO_FORMAT_Y4M:
+                size = EncodeY4M(frame, videoCapture.Output);
+                break;
+            case VIDEO_FORMAT_RAW:
+                size = EncodeRaw(frame, videoCapture.Output);
+                break;
+            default:
+                size = EncodeIndexed(frame, videoCapture.Output, !videoCapture.Delta || frameNumber % VIDEO_KEYFRAME_INTERVAL == 0);
+                break;
+            }
+
+            WriteVideo(videoCapture.Output, size);
+            frameNumber++;
+            InterlockedIncrement(&videoCapture.Tail);
+            SetEvent(videoCapture.WrittenEvent);
+        }
+
+        if (stop)
+        {
+            break;
+        }
+
+        WaitForSingleObject(videoCapture.FrameEvent, INFINITE);
+    }
+
+    return 0;
+}
+
+// The indexed format needs the palette indices, so the ppu is switched to the indexed output while capturing it
+// The pipeline has to be synchronized before the capture is started or stopped
+// With wait the emulation is held back by the writer instead of dropping frames
+BOOL StartVideoCapture(LPCSTR filename, VIDEO_FORMAT format, BOOL delta, BOOL wait)
+{
+    if (videoCapture.Enabled)
+    {
+        return TRUE;
+    }
+
+    videoCapture.IsStdout = strcmp(filename, VIDEO_CAPTURE_STDOUT) == 0;
+    videoCapture.File = videoCapture.IsStdout ? GetStdHandle(STD_OUTPUT_HANDLE) : CreateFileA(filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (videoCapture.File == INVALID_HANDLE_VALUE || videoCapture.File == NULL)
+    {
+        Logf("Unable to open the video capture %s", LL_ERROR, filename);
+        return FALSE;
+    }
+
+    uint8_t *memory = VirtualAlloc(NULL, VIDEO_CAPTURE_QUEUE_LENGTH * BGRA_FRAME_SIZE + BGRA_FRAME_SIZE + VIDEO_INDEXED_FRAME_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+    if (memory == NULL)
+    {
+        Log("Unable to allocate the video capture queue", LL_ERROR);
+        if (!videoCapture.IsStdout)
+        {
+            CloseHandle(videoCapture.File);
+        }
+        return FALSE;
+    }
+
+    for (uint8_t i = 0; i < VIDEO_CAPTURE_QUEUE_LENGTH; i++)
+    {
+        videoCapture.Frames[i].Data = memory + i * BGRA_FRAME_SIZE;
+    }
+    videoCapture.Output = memory + VIDEO_CAPTURE_QUEUE_LENGTH * BGRA_FRAME_SIZE;
+    videoCapture.Previous = videoCapture.Output + BGRA_FRAME_SIZE;
+
+    for (uint8_t emphasis = 0; emphasis < EMPHASIS_COUNT; emphasis++)
+    {
+        for (uint8_t color = 0; color < NES_COLOR_COUNT; color++)
+        {
+            RGBToYUV(emphasis_palettes[emphasis][color], yuvPalettes[emphasis][color]);
+        }
+    }
+
+    videoCapture.Format = format;
+    videoCapture.Delta = delta && format == VIDEO_FORMAT_INDEXED;
+    videoCapture.Head = 0;
+    videoCapture.Tail = 0;
+    videoCapture.Dropped = 0;
+    videoCapture.Wait = wait;
+    videoCapture.Stop = FALSE;
+
+    if (format == VIDEO_FORMAT_Y4M)
+    {
+        char header[128];
+        int length = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%s Ip A1:1 C444\n", NES_PX_WIDTH, NES_PX_HEIGHT, VIDEO_FRAME_RATE);
+        WriteVideo(header, length);
+    }
+    else if (format == VIDEO_FORMAT_INDEXED)
+    {
+        VIDEO_INDEXED_HEADER header = {VIDEO_INDEXED_MAGIC, NES_PX_WIDTH, NES_PX_HEIGHT, videoCapture.Delta ? VIDEO_INDEXED_DELTA_BIT : 0};
+        WriteVideo(&header, sizeof(header));
+    }
+
+    previousOutput = ppu_output;
+    if (format == VIDEO_FORMAT_INDEXED && ppu_output == PPU_OUTPUT_BGRA)
+    {
+        ppu_output = PPU_OUTPUT_INDEXED;
+        mark_ppu_dirty();
+    }
+
+    videoCapture.FrameEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    videoCapture.WrittenEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    videoCapture.Thread = CreateThread(NULL, 0, VideoWriterProc, NULL, 0, NULL);
+    videoCapture.Enabled = TRUE;
+
+    Logf("Video capture started: %s (%s%s)", LL_INFO, filename, videoFormatNames[format], videoCapture.Delta ? ", delta" : "");
+    return TRUE;
+}
+
+void StopVideoCapture(void)
+{
+    if (!videoCapture.Enabled)
+    {
+        return;
+    }
+
+    videoCapture.Enabled = FALSE;
+    videoCapture.Stop = TRUE;
+    SetEvent(videoCapture.FrameEvent);
+    WaitForSingleObject(videoCapture.Thread, INFINITE);
+    CloseHandle(videoCapture.Thread);
+    CloseHandle(videoCapture.FrameEvent);
+    CloseHandle(videoCapture.WrittenEvent);
+
+    if (!videoCapture.IsStdout)
+    {
+        CloseHandle(videoCapture.File);
+    }
+
+    if (ppu_output != previousOutput && ppu_output != PPU_OUTPUT_NONE)
+    {
+        ppu_output = previousOutput;
+        mark_ppu_dirty();
+    }
+
+    VirtualFree(videoCapture.Frames[0].Data, 0, MEM_RELEASE);
+
+    Logf("Video capture stopped: %d frames written, %d dropped", LL_INFO, videoCapture.Tail, videoCapture.Dropped);
+    if (videoCapture.Dropped)
+    {
+        Log("The video capture writer could not keep up, frames were dropped", LL_WARNING);
+    }
+}
+
+// Called by the ppu at the start of vertical blank, for every frame including those where nothing was drawn
+void CaptureVideoFrame(void)
+{
+    // Nothing is drawn while the ppu itself is captured, and the indexed format has no use for BGRA frames
+    if (ppu_output == PPU_OUTPUT_NONE || (ppu_output == PPU_OUTPUT_BGRA && videoCapture.Format == VIDEO_FORMAT_INDEXED))
+    {
+        return;
+    }
+
+    LONG head = videoCapture.Head;
+    if ((uint32_t)(head - videoCapture.Tail) >= VIDEO_CAPTURE_QUEUE_LENGTH && !videoCapture.Wait)
+    {
+        videoCapture.Dropped++;
+        return;
+    }
+
+    // The event may be left set by a frame written before the queue filled, so the queue is checked again after each wake
+    while ((uint32_t)(head - videoCapture.Tail) >= VIDEO_CAPTURE_QUEUE_LENGTH)
+    {
+        WaitForSingleObject(videoCapture.WrittenEvent, INFINITE);
+    }
+
+    VIDEO_FRAME *frame = &videoCapture.Frames[head % VIDEO_CAPTURE_QUEUE_LENGTH];
+    frame->Indexed = ppu_output == PPU_OUTPUT_INDEXED;
+
+    if (frame->Indexed)
+    {
+        memcpy(frame->Data, indexed_frame, NES_PX_WIDTH * NES_PX_HEIGHT);
+        memcpy(frame->Data + NES_PX_WIDTH * NES_PX_HEIGHT, indexed_frame_emphasis, NES_PX_HEIGHT);
+    }
+    else
+    {
+        memcpy(frame->Data, backBuffer.Memory, BGRA_FRAME_SIZE);
+    }
+
+    // The frame is complete before the writer can see it
+    InterlockedIncrement(&videoCapture.Head);
+    SetEvent(videoCapture.FrameEvent);
+}
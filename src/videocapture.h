@@ -0,0 +1,79 @@
+#ifndef VIDEOCAPTURE_H
+
+#define VIDEOCAPTURE_H
+
+#include <windows.h>
+#include <stdint.h>
+#include "main.h"
+
+#define VIDEO_CAPTURE_FILE "capture.y4m"
+// Written to standard output instead of a file, to be piped into an encoder
+#define VIDEO_CAPTURE_STDOUT "-"
+// Frames waiting to be written, when it is full the ppu drops the frame or waits for the writer
+#define VIDEO_CAPTURE_QUEUE_LENGTH 64
+// The frame rate of the ntsc nes, 60.0988 frames per second
+#define VIDEO_FRAME_RATE "39375000:655171"
+
+// Palette indices of a frame followed by the emphasis of each row
+#define VIDEO_INDEXED_FRAME_SIZE (NES_PX_WIDTH * NES_PX_HEIGHT + NES_PX_HEIGHT)
+#define VIDEO_INDEXED_MAGIC 0x5653454E // "NESV"
+#define VIDEO_INDEXED_DELTA_BIT 0x1
+// Every so many frames all rows are written in the delta format, so a decoder can start there
+#define VIDEO_KEYFRAME_INTERVAL 600
+#define VIDEO_ROW_MASK_SIZE (NES_PX_HEIGHT / 8)
+
+typedef enum VIDEO_FORMAT
+{
+    VIDEO_FORMAT_Y4M,     // YUV 4:4:4, read by most encoders as it is
+    VIDEO_FORMAT_RAW,     // Top-down BGRA frames (ffmpeg -f rawvideo -pix_fmt bgra -s 256x240)
+    VIDEO_FORMAT_INDEXED, // Palette indices and emphasis, optionally only the rows changed since the previous frame
+    VIDEO_FORMAT_COUNT,
+} VIDEO_FORMAT;
+
+// The indexed file starts with this header, each frame is a mask of the rows that follow (all of them without delta),
+// and each of those rows is its 256 palette indices followed by its emphasis bits
+typedef struct VIDEO_INDEXED_HEADER
+{
+    uint32_t Magic;
+    uint16_t Width;
+    uint16_t Height;
+    uint32_t Flags;
+} VIDEO_INDEXED_HEADER;
+
+typedef struct VIDEO_FRAME
+{
+    BOOL Indexed; // The data is VIDEO_INDEXED_FRAME_SIZE bytes of indices and emphasis, otherwise a bottom-up BGRA frame
+    uint8_t *Data;
+} VIDEO_FRAME;
+
+typedef struct VIDEO_CAPTURE
+{
+    BOOL Enabled;
+    VIDEO_FORMAT Format;
+    BOOL Delta;
+    HANDLE File;
+    BOOL IsStdout;
+    HANDLE Thread;
+    HANDLE FrameEvent;   // Set when a frame is queued, or the capture is stopped
+    HANDLE WrittenEvent; // Set when the writer has written a frame, which frees a slot of the queue
+    BOOL Wait;           // The ppu waits for a free slot instead of dropping the frame
+    volatile BOOL Stop;
+
+    // The ppu is the only one writing the head, and the writer thread the only one writing the tail
+    VIDEO_FRAME Frames[VIDEO_CAPTURE_QUEUE_LENGTH];
+    volatile LONG Head; // Number of frames queued
+    volatile LONG Tail; // Number of frames written
+
+    uint32_t Dropped;
+    uint8_t *Output;   // The encoded frame written to the file
+    uint8_t *Previous; // The last indexed frame written, for the delta
+} VIDEO_CAPTURE;
+
+extern VIDEO_CAPTURE videoCapture;
+extern const char *videoFormatNames[VIDEO_FORMAT_COUNT];
+
+BOOL StartVideoCapture(LPCSTR filename, VIDEO_FORMAT format, BOOL delta, BOOL wait);
+void StopVideoCapture(void);
+void CaptureVideoFrame(void);
+
+#endif
@@ -3,32 +3,43 @@
 #include <Wingdi.h>
 #include <Winerror.h>
 #include <stdio.h>
+#include <string.h>
+#include <x86intrin.h>
 #include "resource.h"
 #include "main.h"
 #include "logger.h"
+#include "video.h"
+#include "swapchain.h"
+#include "scaler.h"
+#include "ntsc.h"
+#include "overlay.h"
+#include "videocapture.h"
+#include "frameprofile.h"
+#include "eventtrace.h"
 #include "./nes/loader.h"
 #include "./nes/cpu.h"
 #include "./nes/ppu.h"
+#include "./nes/ppu_pipeline.h"
+#include "./nes/ppu_capture.h"
+#include "./nes/cpu_trace.h"
+#include "./nes/cpu_profile.h"
 #include "./nes/controller.h"
+#include "./nes/input_recording.h"
 
 HWND window;
 NES_BITMAP backBuffer;
 PERFDATA perfData;
 BOOL running;
 
-// If null is passed as the hdc, a device context is created and released by the renderer
-// Any hdc passed to the function, will not be released
-void RenderFrame(HDC hdc)
+HANDLE presentThread;
+volatile BOOL presentStop;
+volatile BOOL repaintRequested;
+volatile BOOL benchmarkRequested;
+
+// Called on the present thread, the frame is owned by it until the next frame is taken
+void RenderFrame(void *frame)
 {
-    HDC locHdc;
-    if (hdc == NULL)
-    {
-        locHdc = GetDC(window);
-    }
-    else
-    {
-        locHdc = hdc;
-    }
+    HDC locHdc = GetDC(window);
 
     RECT windowRect;
     GetClientRect(window, &windowRect);
@@ -47,6 +58,42 @@ void RenderFrame(HDC hdc)
         perfData.CurrentScaleFactor = maxHscale;
     }
 
+    // The NTSC filter replaces the scaler, as it needs the palette indices which only frames drawn in the indexed output have
+    // The frame is scaled in software when a scaler is selected, GDI only stretches what is left
+    BITMAPINFO scaledInfo = backBuffer.BitmapInfo;
+    LONG sourceWidth = NES_PX_WIDTH;
+    LONG sourceHeight = NES_PX_HEIGHT;
+    if (ntscEnabled && swapChain.HasIndexed[swapChain.Presenting])
+    {
+        uint8_t *indexed = swapChain.IndexedFrames[swapChain.Presenting];
+        FilterNtsc(indexed, indexed + NES_PX_WIDTH * NES_PX_HEIGHT, ntscFrame);
+        sourceWidth = NTSC_WIDTH;
+        frame = ntscFrame;
+    }
+    else
+    {
+        uint8_t scaled = ScaleFrame(currentScaler, frame, scaledFrame, perfData.CurrentScaleFactor);
+        if (scaled > 1)
+        {
+            sourceWidth = NES_PX_WIDTH * scaled;
+            sourceHeight = NES_PX_HEIGHT * scaled;
+            frame = scaledFrame;
+        }
+    }
+    scaledInfo.bmiHeader.biWidth = sourceWidth;
+    scaledInfo.bmiHeader.biHeight = sourceHeight;
+
+    // The overlay is blitted into the frame that is stretched, which is copied first if it is still the one in the swap chain
+    if (perfData.DisplayDebugInfo)
+    {
+        if (frame != scaledFrame && frame != ntscFrame)
+        {
+            memcpy(scaledFrame, frame, DRAW_AREA_MEMORY_SIZE);
+            frame = scaledFrame;
+        }
+        BlitOverlay(frame, sourceWidth, sourceHeight);
+    }
+
     StretchDIBits(locHdc,
                   (windowWidth - NES_PX_WIDTH * perfData.CurrentScaleFactor) / 2,
                   (windowHeight - NES_PX_HEIGHT * perfData.CurrentScaleFactor) / 2,
@@ -54,70 +101,50 @@ void RenderFrame(HDC hdc)
                   NES_PX_HEIGHT * perfData.CurrentScaleFactor,
                   0,
                   0,
-                  NES_PX_WIDTH,
-                  NES_PX_HEIGHT,
-                  backBuffer.Memory,
-                  &backBuffer.BitmapInfo,
+                  sourceWidth,
+                  sourceHeight,
+                  frame,
+                  &scaledInfo,
                   DIB_RGB_COLORS,
                   SRCCOPY);
 
-    //Display debug info
+    ReleaseDC(window, locHdc);
+}
 
-    if (perfData.DisplayDebugInfo)
+DWORD WINAPI PresentThreadProc(LPVOID param)
+{
+    while (!presentStop)
     {
-        RECT drawArea;
-        drawArea.left = (windowWidth - NES_PX_WIDTH * perfData.CurrentScaleFactor) / 2;
-        drawArea.right = (windowWidth - NES_PX_WIDTH * perfData.CurrentScaleFactor) / 2 + NES_PX_WIDTH * perfData.CurrentScaleFactor;
-        drawArea.top = (windowHeight - NES_PX_HEIGHT * perfData.CurrentScaleFactor) / 2;
-        drawArea.bottom = (windowHeight - NES_PX_HEIGHT * perfData.CurrentScaleFactor) / 2 + NES_PX_HEIGHT * perfData.CurrentScaleFactor;
+        WaitForSingleObject(swapChain.FrameEvent, PRESENT_TIMEOUT_MS);
 
-        char strbuf[1024];
-        sprintf(strbuf, "W: %4d H: %4d\nAvg. cooked FPS: %.2f\nAvg. raw FPS: %.2f\nPC %.4x\tOP: %s\nCYC: %d, PPU_CYC: %d",
-                windowWidth, windowHeight, perfData.CookedFPSAverage, perfData.RawFPSAverage, cpu.registers.pc, opcode_to_string[cpu.current_instruction.operation], cpu.cycle, ppu_state.cycle);
+        // The same frame is presented again when the window content is lost, or when the debug overlay has changed
+        BOOL fresh = TakeFrame();
+        BOOL overlayUpdated = perfData.DisplayDebugInfo && UpdateOverlay();
 
-        if (cpu.current_instruction.bytes > 1)
+        if (fresh || repaintRequested || overlayUpdated)
         {
-            char strbuf2[100];
-            sprintf(strbuf2, " %.2x", cpu_memory[cpu.registers.pc + 1]);
-            strcat(strbuf, strbuf2);
+            repaintRequested = FALSE;
+            uint64_t presentStart = StartFrameSection();
+            int64_t presentSpan = StartTraceSpan();
+            // An indexed frame is converted once, when it is taken, repaints reuse the converted frame
+            if (fresh)
+            {
+                ConvertTakenFrame();
+            }
+            RenderFrame(swapChain.Frames[swapChain.Presenting]);
+            EndTraceSpan(TRACE_STREAM_PRESENT, TRACE_PRESENT, presentSpan, 0);
+            InterlockedAdd64(&frameProfiler.PresentTicks, __rdtsc() - presentStart);
         }
 
-        if (cpu.current_instruction.bytes > 2)
+        // The scalers are measured on the frame presented, after it has been converted
+        if (benchmarkRequested)
         {
-            char strbuf2[100];
-            sprintf(strbuf2, " %.2x", cpu_memory[cpu.registers.pc + 2]);
-            strcat(strbuf, strbuf2);
+            benchmarkRequested = FALSE;
+            BenchmarkScalers(swapChain.Frames[swapChain.Presenting], scaledFrame);
         }
-
-        DrawTextA(locHdc, strbuf, strlen(strbuf), &drawArea, TA_TOP);
     }
 
-    if (hdc == NULL)
-    {
-        ReleaseDC(window, locHdc);
-    }
-}
-
-void Blit32BppBitmapToBuffer(NES_BITMAP bitmap, uint16_t x, uint16_t y, uint16_t brightness)
-{
-    // Start in the upper left pixel
-    // Without the transposition, the bottom left is the first index
-    uint16_t bufferStartPx = NES_PX_WIDTH * NES_PX_HEIGHT - NES_PX_WIDTH - (NES_PX_WIDTH * y) + x;
-    uint16_t bmStartPx = bitmap.BitmapInfo.bmiHeader.biWidth * bitmap.BitmapInfo.bmiHeader.biHeight - bitmap.BitmapInfo.bmiHeader.biWidth;
-
-    PIXEL32 px = {0};
-
-    // TODO Implement SIMD
-    // For now only one by one pixel
-
-    for (uint16_t y = 0; y < bitmap.BitmapInfo.bmiHeader.biWidth; y++)
-    {
-        for (uint16_t x = 0; x < bitmap.BitmapInfo.bmiHeader.biHeight; x++)
-        {
-            // TODO Implement brightness
-            *((PIXEL32 *)backBuffer.Memory + bufferStartPx + x - y * NES_PX_WIDTH) = *((PIXEL32 *)bitmap.Memory + bmStartPx + x - bitmap.BitmapInfo.bmiHeader.biWidth * y);
-        }
-    }
+    return 0;
 }
 
 LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
@@ -179,6 +206,12 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
                 break;
             }
 
+            // The render thread is stopped while the ppu is reset
+            BOOL pipelined = ppu_pipeline.enabled;
+            stop_ppu_pipeline();
+            stop_ppu_capture();
+
+            int64_t loadSpan = StartTraceSpan();
             LOAD_STATUS status = loadNESFile(nesFileHandle);
 
             if (status == SUCCESS)
@@ -186,12 +219,133 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
                 cpu_power_up();
                 ppu_power_up();
             }
+            EndTraceSpan(TRACE_STREAM_EMULATION, TRACE_ROM_LOAD, loadSpan, status);
+
+            if (pipelined)
+            {
+                start_ppu_pipeline();
+            }
 
             CloseHandle(nesFileHandle);
         }
         break;
         case ID_OPTIONS_TOGGLE_DEBUG:
             perfData.DisplayDebugInfo = !perfData.DisplayDebugInfo;
+            repaintRequested = TRUE;
+            SetEvent(swapChain.FrameEvent);
+            break;
+        case ID_OPTIONS_TOGGLE_INDEXED:
+            if (ppu_pipeline.enabled)
+            {
+                sync_ppu_pipeline();
+            }
+            ppu_output = ppu_output == PPU_OUTPUT_INDEXED ? PPU_OUTPUT_BGRA : PPU_OUTPUT_INDEXED;
+            // The frame in the new output has to be drawn again
+            mark_ppu_dirty();
+            break;
+        case ID_OPTIONS_TOGGLE_PIPELINE:
+            if (ppu_pipeline.enabled)
+            {
+                stop_ppu_pipeline();
+            }
+            else
+            {
+                start_ppu_pipeline();
+            }
+            break;
+        case ID_OPTIONS_TOGGLE_CAPTURE:
+            if (ppu_pipeline.enabled)
+            {
+                sync_ppu_pipeline();
+            }
+
+            if (ppu_capture.enabled)
+            {
+                stop_ppu_capture();
+            }
+            else
+            {
+                start_ppu_capture(PPU_CAPTURE_FILE);
+            }
+            break;
+        case ID_OPTIONS_TOGGLE_VIDEO:
+            if (ppu_pipeline.enabled)
+            {
+                sync_ppu_pipeline();
+            }
+
+            if (videoCapture.Enabled)
+            {
+                StopVideoCapture();
+            }
+            else
+            {
+                StartVideoCapture(VIDEO_CAPTURE_FILE, VIDEO_FORMAT_Y4M, FALSE, FALSE);
+            }
+            break;
+        case ID_OPTIONS_TOGGLE_CPU_TRACE:
+            if (cpu_trace.enabled)
+            {
+                stop_cpu_trace();
+            }
+            else
+            {
+                start_cpu_trace(CPU_TRACE_FILE, 0);
+            }
+            break;
+        case ID_OPTIONS_TOGGLE_INPUT_RECORDING:
+            if (input_recording.mode != INPUT_RECORDING_OFF)
+            {
+                stop_input_recording();
+            }
+            else
+            {
+                start_input_recording(INPUT_RECORDING_FILE);
+            }
+            break;
+        case ID_OPTIONS_DUMP_FRAME_PROFILE:
+            DumpFrameProfile(FRAME_PROFILE_FILE, FRAME_HISTOGRAM_FILE);
+            break;
+        case ID_OPTIONS_TOGGLE_EVENT_TRACE:
+            if (eventTrace.Enabled)
+            {
+                StopEventTrace();
+            }
+            else
+            {
+                StartEventTrace(EVENT_TRACE_FILE);
+            }
+            break;
+        case ID_OPTIONS_TOGGLE_CPU_PROFILE:
+            if (cpu_profile.enabled)
+            {
+                write_cpu_profile(CPU_PROFILE_REPORT_FILE, CPU_PROFILE_STACKS_FILE);
+                stop_cpu_profile();
+            }
+            else
+            {
+                start_cpu_profile();
+            }
+            break;
+        case ID_OPTIONS_NEXT_SCALER:
+            currentScaler = (currentScaler + 1) % SCALER_COUNT;
+            Logf("Scaler: %s", LL_INFO, scalerNames[currentScaler]);
+            repaintRequested = TRUE;
+            SetEvent(swapChain.FrameEvent);
+            break;
+        case ID_OPTIONS_TOGGLE_NTSC:
+            ntscEnabled = !ntscEnabled;
+            if (ntscEnabled && ppu_output != PPU_OUTPUT_INDEXED)
+            {
+                Log("The NTSC filter is only applied in the indexed output", LL_WARNING);
+            }
+            repaintRequested = TRUE;
+            SetEvent(swapChain.FrameEvent);
+            break;
+        case ID_OPTIONS_BENCHMARK_SCALERS:
+            // Run on the present thread, which owns the scaled frame
+            benchmarkRequested = TRUE;
+            SetEvent(swapChain.FrameEvent);
             break;
         case ID_WINDOW_SET_MAX_SCALE:
             SetWindowToMatchScale(perfData.MaxScaleFactor);
@@ -211,20 +365,36 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
         HDC hdc;
         PAINTSTRUCT ps;
 
+        // The present thread draws the window, the paint only validates it
         hdc = BeginPaint(window, &ps);
-        RenderFrame(hdc);
         EndPaint(window, &ps);
+        repaintRequested = TRUE;
+        SetEvent(swapChain.FrameEvent);
     }
     break;
     case WM_CLOSE:
         running = FALSE;
+        stop_ppu_pipeline();
+        stop_ppu_capture();
+        StopVideoCapture();
+        stop_cpu_trace();
+        write_cpu_profile(CPU_PROFILE_REPORT_FILE, CPU_PROFILE_STACKS_FILE);
+        stop_cpu_profile();
+        stop_input_recording();
+        presentStop = TRUE;
+        SetEvent(swapChain.FrameEvent);
+        WaitForSingleObject(presentThread, INFINITE);
+        CloseHandle(presentThread);
+        StopEventTrace();
+        FreeScalers();
+        FreeNtscFilter();
         Log("CPU:", LL_DEBUG);
         log_cpu_mem();
         Log("PPU:", LL_DEBUG);
         log_ppu_memory();
         Log("Terminating", LL_INFO);
         VirtualFree(cartrage, 0, MEM_RELEASE);
-        VirtualFree(backBuffer.Memory, 0, MEM_RELEASE);
+        FreeSwapChain();
         CloseLogFile();
         PostQuitMessage(0);
         break;
@@ -249,6 +419,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 
     // Finds the performance frequency, number of "performance ticks" per second
     QueryPerformanceFrequency((LARGE_INTEGER *)&perfData.PerfFrequency);
+    InitFrameProfiler();
 
     if (CreateMainWindow() != ERROR_SUCCESS)
     {
@@ -263,11 +434,27 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     backBuffer.BitmapInfo.bmiHeader.biBitCount = NES_BPP;
     backBuffer.BitmapInfo.bmiHeader.biCompression = BI_RGB;
     backBuffer.BitmapInfo.bmiHeader.biPlanes = 1;
-    backBuffer.Memory = VirtualAlloc(NULL, DRAW_AREA_MEMORY_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
 
-    if (backBuffer.Memory == NULL)
+    // The ppu draws into the swap chain, which sets the memory of the backbuffer
+    if (!InitSwapChain())
+    {
+        return 1;
+    }
+
+    BuildConversionTables();
+
+    if (!InitScalers() || !InitNtscFilter())
+    {
+        return 1;
+    }
+
+    // Presenting is done on its own thread, so a slow present does not take time from the emulation
+    presentStop = FALSE;
+    presentThread = CreateThread(NULL, 0, PresentThreadProc, NULL, 0, NULL);
+    if (presentThread == NULL)
     {
-        Logf("Unable to allocate backbuffer memory of %d bytes", LL_ERROR, DRAW_AREA_MEMORY_SIZE);
+        Log("Unable to create the present thread", LL_ERROR);
+        return 1;
     }
 
     running = TRUE;
@@ -277,43 +464,76 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     int64_t frameStart, frameEnd, elapsedTime;
     int64_t cookedAccumulatedMicroseconds = 0;
     int64_t rawAccumulatedMicroseconds = 0;
+    uint32_t splitSampleCounter = 0;
     while (running)
     {
         QueryPerformanceCounter((LARGE_INTEGER *)&frameStart);
+        int64_t frameSpan = StartTraceSpan();
 
+        uint64_t inputStart = StartFrameSection();
+        int64_t inputSpan = StartTraceSpan();
         while (PeekMessageA(&msg, window, 0, 0, PM_REMOVE))
         {
             DispatchMessageA(&msg);
         }
 
         ProcessInput();
-        RenderFrame(NULL);
+        EndTraceSpan(TRACE_STREAM_EMULATION, TRACE_INPUT, inputSpan, 0);
+        EndFrameSection(FRAME_SECTION_INPUT, inputStart);
         perfData.TotalFramesRendered += 1;
 
+        // The cpu section has the time of the whole emulation until the frame ends and it is split with the ppu
+        uint64_t emulationStart = StartFrameSection();
+        int64_t cpuSpan = StartTraceSpan();
         uint64_t prev_cpu_cycles = cpu.cycle;
         //for (uint64_t i = 0; i < CYCLES_PER_SEC * elapsedTime / 1000000; i++)
         while (cpu.cycle < prev_cpu_cycles + CYCLES_PER_SEC / 60 && cpu.powered)
         {
+            BOOL sampled = ++splitSampleCounter % SPLIT_SAMPLE_INTERVAL == 0;
+            uint64_t sampleStart = sampled ? __rdtsc() : 0;
+
             perform_next_instruction();
 
-            while (ppu_state.cycle < cpu.cycle * 3)
+            uint64_t cpuEnd = sampled ? __rdtsc() : 0;
+
+            if (ppu_pipeline.enabled)
+            {
+                advance_ppu_pipeline(cpu.cycle * 3);
+            }
+            else
+            {
+                while (ppu_state.cycle < cpu.cycle * 3)
+                {
+                    perform_next_ppu_cycle();
+                }
+            }
+
+            if (sampled)
             {
-                perform_next_ppu_cycle();
+                frameProfiler.CpuSampleTicks += cpuEnd - sampleStart;
+                frameProfiler.PpuSampleTicks += __rdtsc() - cpuEnd;
             }
         }
+        EndTraceSpan(TRACE_STREAM_EMULATION, TRACE_CPU, cpuSpan, cpu.cycle - prev_cpu_cycles);
+        EndFrameSection(FRAME_SECTION_CPU, emulationStart);
 
         // Calculate the raw frame time in microseconds
         QueryPerformanceCounter((LARGE_INTEGER *)&frameEnd);
         // This results in the time passed in microsecond
         elapsedTime = (frameEnd - frameStart) * 1000000 / perfData.PerfFrequency;
         rawAccumulatedMicroseconds += elapsedTime;
+        perfData.FrameTimes[perfData.TotalFramesRendered % FRAME_TIME_HISTORY] = elapsedTime < UINT16_MAX ? elapsedTime : UINT16_MAX;
 
         // Sleep for the rest of the frame time
         //Logf("Time elapsed %dms", LL_DEBUG, elapsedTime / 1000);
         if ((TARGET_MICROSECONDS_PER_FRAME - elapsedTime) > 0)
         {
             //Logf("Sleeping for %dms", LL_DEBUG, (TARGET_MICROSECONDS_PER_FRAME - elapsedTime) / 1000);
+            uint64_t sleepStart = StartFrameSection();
+            int64_t sleepSpan = StartTraceSpan();
             Sleep((TARGET_MICROSECONDS_PER_FRAME - elapsedTime) / 1000);
+            EndTraceSpan(TRACE_STREAM_EMULATION, TRACE_SLEEP, sleepSpan, 0);
+            EndFrameSection(FRAME_SECTION_SLEEP, sleepStart);
         }
 
         // Calulate the cooked frame time in microseconds
@@ -332,7 +552,12 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 
             rawAccumulatedMicroseconds = 0;
             cookedAccumulatedMicroseconds = 0;
+
+            UpdateProcessCounters();
         }
+
+        EndProfiledFrame();
+        EndTraceSpan(TRACE_STREAM_EMULATION, TRACE_FRAME, frameSpan, perfData.TotalFramesRendered);
     }
 
     return msg.wParam;